@@ -1,4 +1,42 @@
 #include "ast.h"
+#include <unordered_map>
+
+BinaryOp binaryOpFromString(const std::string& op) {
+    static const std::unordered_map<std::string, BinaryOp> ops = {
+        {"=", BinaryOp::Assign},
+        {"+", BinaryOp::Add},
+        {"-", BinaryOp::Subtract},
+        {"*", BinaryOp::Multiply},
+        {"/", BinaryOp::Divide},
+        {"%", BinaryOp::Modulo},
+        {">", BinaryOp::Greater},
+        {">=", BinaryOp::GreaterEqual},
+        {"<", BinaryOp::Less},
+        {"<=", BinaryOp::LessEqual},
+        {"!=", BinaryOp::NotEqual},
+        {"==", BinaryOp::Equal}
+    };
+    
+    auto it = ops.find(op);
+    return it != ops.end() ? it->second : BinaryOp::Unknown;
+}
+
+const char* superinstructionName(Superinstruction fused) {
+    switch (fused) {
+        case Superinstruction::IncrementLocal: return "increment-local";
+        case Superinstruction::CompareLocal: return "compare-local";
+        case Superinstruction::ModuloTest: return "modulo-test";
+        default: return "none";
+    }
+}
+
+const char* staticTypeName(StaticType type) {
+    switch (type) {
+        case StaticType::Number: return "number";
+        case StaticType::Bool: return "bool";
+        default: return "any";
+    }
+}
 
 // Expression accept methods
 void LiteralExpression::accept(Visitor& visitor) {
@@ -13,6 +51,10 @@ void BinaryExpression::accept(Visitor& visitor) {
     visitor.visit(*this);
 }
 
+void LogicalExpression::accept(Visitor& visitor) {
+    visitor.visit(*this);
+}
+
 void UnaryExpression::accept(Visitor& visitor) {
     visitor.visit(*this);
 }
@@ -21,6 +63,14 @@ void CallExpression::accept(Visitor& visitor) {
     visitor.visit(*this);
 }
 
+void ArrayExpression::accept(Visitor& visitor) {
+    visitor.visit(*this);
+}
+
+void IndexExpression::accept(Visitor& visitor) {
+    visitor.visit(*this);
+}
+
 // Statement accept methods
 void ExpressionStatement::accept(Visitor& visitor) {
     visitor.visit(*this);
@@ -42,6 +92,18 @@ void WhileStatement::accept(Visitor& visitor) {
     visitor.visit(*this);
 }
 
+void ForStatement::accept(Visitor& visitor) {
+    visitor.visit(*this);
+}
+
+void ForInStatement::accept(Visitor& visitor) {
+    visitor.visit(*this);
+}
+
+void YieldStatement::accept(Visitor& visitor) {
+    visitor.visit(*this);
+}
+
 void FunctionDeclaration::accept(Visitor& visitor) {
     visitor.visit(*this);
 }
@@ -54,6 +116,108 @@ void PrintStatement::accept(Visitor& visitor) {
     visitor.visit(*this);
 }
 
+void ImportStatement::accept(Visitor& visitor) {
+    visitor.visit(*this);
+}
+
 void Program::accept(Visitor& visitor) {
     visitor.visit(*this);
-}
\ No newline at end of file
+}
+
+// RecursiveVisitor: default traversal
+void RecursiveVisitor::visit(LiteralExpression&) {}
+
+void RecursiveVisitor::visit(IdentifierExpression&) {}
+
+void RecursiveVisitor::visit(BinaryExpression& node) {
+    node.left->accept(*this);
+    node.right->accept(*this);
+}
+
+void RecursiveVisitor::visit(LogicalExpression& node) {
+    node.left->accept(*this);
+    node.right->accept(*this);
+}
+
+void RecursiveVisitor::visit(UnaryExpression& node) {
+    node.operand->accept(*this);
+}
+
+void RecursiveVisitor::visit(CallExpression& node) {
+    node.callee->accept(*this);
+    for (auto& arg : node.arguments) {
+        arg->accept(*this);
+    }
+}
+
+void RecursiveVisitor::visit(ArrayExpression& node) {
+    for (auto& element : node.elements) {
+        element->accept(*this);
+    }
+}
+
+void RecursiveVisitor::visit(IndexExpression& node) {
+    node.object->accept(*this);
+    node.index->accept(*this);
+}
+
+void RecursiveVisitor::visit(ExpressionStatement& node) {
+    node.expression->accept(*this);
+}
+
+void RecursiveVisitor::visit(VarDeclaration& node) {
+    if (node.initializer) node.initializer->accept(*this);
+}
+
+void RecursiveVisitor::visit(BlockStatement& node) {
+    for (auto& stmt : node.statements) {
+        stmt->accept(*this);
+    }
+}
+
+void RecursiveVisitor::visit(IfStatement& node) {
+    node.condition->accept(*this);
+    node.thenBranch->accept(*this);
+    if (node.elseBranch) node.elseBranch->accept(*this);
+}
+
+void RecursiveVisitor::visit(WhileStatement& node) {
+    node.condition->accept(*this);
+    node.body->accept(*this);
+}
+
+void RecursiveVisitor::visit(ForStatement& node) {
+    if (node.initializer) node.initializer->accept(*this);
+    if (node.condition) node.condition->accept(*this);
+    if (node.increment) node.increment->accept(*this);
+    node.body->accept(*this);
+}
+
+void RecursiveVisitor::visit(ForInStatement& node) {
+    node.iterable->accept(*this);
+    node.body->accept(*this);
+}
+
+void RecursiveVisitor::visit(YieldStatement& node) {
+    if (node.value) node.value->accept(*this);
+}
+
+void RecursiveVisitor::visit(FunctionDeclaration& node) {
+    if (node.body) node.body->accept(*this);
+}
+
+void RecursiveVisitor::visit(ReturnStatement& node) {
+    if (node.value) node.value->accept(*this);
+}
+
+void RecursiveVisitor::visit(PrintStatement& node) {
+    node.expression->accept(*this);
+}
+
+void RecursiveVisitor::visit(ImportStatement&) {}
+
+void RecursiveVisitor::visit(Program& node) {
+    for (auto& stmt : node.statements) {
+        stmt->accept(*this);
+    }
+}
@@ -2,11 +2,19 @@
 #include <memory>
 #include <vector>
 #include <string>
+#include <unordered_set>
+#include <utility>
 #include <variant>
+#include <atomic>
+#include <mutex>
+#include "fluxstring.h"
+#include "lexer.h"
 
 // Forward declarations
 class Visitor;
 class FluxCallable;
+class FluxArray;
+class FluxIterator;
 
 // Base AST node
 class ASTNode {
@@ -16,11 +24,52 @@ public:
 };
 
 // Value type for Flux
-using FluxValue = std::variant<double, std::string, bool, std::nullptr_t, std::shared_ptr<FluxCallable>>;
+using FluxValue = std::variant<double, FluxString, bool, std::nullptr_t, std::shared_ptr<FluxCallable>,
+                               std::shared_ptr<FluxArray>, std::shared_ptr<FluxIterator>>;
+
+// What the TypeAnalyzer proved about the values of an expression or local
+enum class StaticType {
+    Any,
+    Number,
+    Bool
+};
+
+const char* staticTypeName(StaticType type);
+
+// How the interpreter computes an expression without boxing its value, as
+// chosen by the TypeAnalyzer: Boxed goes through the visitor as usual, the
+// others only combine operands that are themselves proven numbers
+enum class UnboxedForm {
+    Boxed,
+    Local,       // a local held in an unboxed slot
+    Constant,    // a number literal
+    Arithmetic,  // + - * / % of two numbers
+    Negate,      // -x of a number
+    Compare      // < <= > >= == != of two numbers
+};
+
+// Value of a pure expression kept by the Optimizer so that it is computed
+// once per run of the loop or statement owning it, instead of each time it
+// is reached. Occurrences of the same expression share one. The value lives
+// in a frame slot, and a flag in an unboxed slot says whether it is there.
+struct CachedValue {
+    int slot;
+    int flag;  // 0 until first computed, then 1 if kept or 2 if it couldn't be
+    // Frame slots the expression reads; it is only kept while none of them
+    // holds an array, an iterator or a function, which can change under it
+    std::vector<int> locals;
+    // Globals called by the owner; it is only kept if they are all pure
+    // natives, which can't rebind anything the expression depends on
+    std::vector<std::string> natives;
+};
 
 // Expression nodes
 class Expression : public ASTNode {
 public:
+    StaticType type = StaticType::Any;
+    UnboxedForm form = UnboxedForm::Boxed;
+    std::shared_ptr<CachedValue> cached;  // set by the Optimizer
+    
     virtual ~Expression() = default;
 };
 
@@ -35,19 +84,113 @@ public:
 class IdentifierExpression : public Expression {
 public:
     std::string name;
+    // Where the Resolver found the variable; all -1 means environment lookup
+    int slot;     // frame slot of a local
+    int cell;     // cell of a local captured by a nested function
+    int upvalue;  // captured variable of an enclosing function
+    int numberSlot;  // unboxed slot of a local the TypeAnalyzer proved a number or bool
     
-    IdentifierExpression(const std::string& n) : name(n) {}
+    IdentifierExpression(const std::string& n) : name(n), slot(-1), cell(-1), upvalue(-1), numberSlot(-1) {}
     void accept(Visitor& visitor) override;
 };
 
+// Binary operator, resolved once from its lexeme when the node is built
+enum class BinaryOp {
+    Assign,
+    Add,
+    Subtract,
+    Multiply,
+    Divide,
+    Modulo,
+    Greater,
+    GreaterEqual,
+    Less,
+    LessEqual,
+    NotEqual,
+    Equal,
+    Unknown
+};
+
+// Specialized forms a BinaryExpression rewrites itself into based on the
+// operand types it observes. Uninitialized nodes specialize on their first
+// evaluation; a specialized node that sees other types falls back to Generic
+// for good so a polymorphic site doesn't keep flip-flopping. The kind is
+// atomic because parallel_map workers evaluate the same tree concurrently.
+enum class BinaryKind {
+    Uninitialized,
+    Generic,
+    NumberAdd,
+    NumberSubtract,
+    NumberMultiply,
+    NumberDivide,
+    NumberModulo,
+    NumberGreater,
+    NumberGreaterEqual,
+    NumberLess,
+    NumberLessEqual,
+    StringConcat
+};
+
+BinaryOp binaryOpFromString(const std::string& op);
+
+// Fused forms of common loop idioms, chosen by the PeepholeOptimizer. Each
+// runs as one node visit over operands read straight from frame or unboxed
+// slots; a fused node whose boxed locals don't hold numbers takes the
+// ordinary path instead.
+enum class Superinstruction {
+    None,
+    IncrementLocal,  // i = i + k, i = i - k
+    CompareLocal,    // i < n, i <= 10, x == y, ...
+    ModuloTest,      // x % k == 0, x % k != 0
+    Count
+};
+
+const char* superinstructionName(Superinstruction fused);
+
+// Operand of a superinstruction: a local's frame slot or unboxed slot, or a
+// number constant
+struct FusedOperand {
+    int slot;        // frame slot, or -1
+    int numberSlot;  // unboxed slot of a number local, or -1; both -1 for a constant
+    double constant;
+};
+
 class BinaryExpression : public Expression {
 public:
     std::unique_ptr<Expression> left;
     std::string operator_;
     std::unique_ptr<Expression> right;
+    BinaryOp op;
+    std::atomic<BinaryKind> kind;
+    // IncrementLocal keeps the local in fusedLeft and the signed step in
+    // fusedRight; the others keep their two operands
+    Superinstruction fused;
+    FusedOperand fusedLeft;
+    FusedOperand fusedRight;
     
     BinaryExpression(std::unique_ptr<Expression> l, const std::string& op, std::unique_ptr<Expression> r)
-        : left(std::move(l)), operator_(op), right(std::move(r)) {}
+        : left(std::move(l)), operator_(op), right(std::move(r)),
+          op(binaryOpFromString(op)), kind(BinaryKind::Uninitialized), fused(Superinstruction::None),
+          fusedLeft{-1, -1, 0}, fusedRight{-1, -1, 0} {}
+    void accept(Visitor& visitor) override;
+};
+
+// `and` / `or`: the right operand is only evaluated when the left one
+// doesn't already decide the result
+enum class LogicalOp {
+    And,
+    Or
+};
+
+class LogicalExpression : public Expression {
+public:
+    std::unique_ptr<Expression> left;
+    std::string operator_;
+    std::unique_ptr<Expression> right;
+    LogicalOp op;
+    
+    LogicalExpression(std::unique_ptr<Expression> l, const std::string& op, std::unique_ptr<Expression> r)
+        : left(std::move(l)), operator_(op), right(std::move(r)), op(op == "and" ? LogicalOp::And : LogicalOp::Or) {}
     void accept(Visitor& visitor) override;
 };
 
@@ -71,9 +214,31 @@ public:
     void accept(Visitor& visitor) override;
 };
 
+class ArrayExpression : public Expression {
+public:
+    std::vector<std::unique_ptr<Expression>> elements;
+    
+    ArrayExpression(std::vector<std::unique_ptr<Expression>> elems) : elements(std::move(elems)) {}
+    void accept(Visitor& visitor) override;
+};
+
+class IndexExpression : public Expression {
+public:
+    std::unique_ptr<Expression> object;
+    std::unique_ptr<Expression> index;
+    
+    IndexExpression(std::unique_ptr<Expression> obj, std::unique_ptr<Expression> idx)
+        : object(std::move(obj)), index(std::move(idx)) {}
+    void accept(Visitor& visitor) override;
+};
+
 // Statement nodes
 class Statement : public ASTNode {
 public:
+    int line = 0;  // where the statement starts, set by the Parser; 0 for ones it didn't parse
+    // Flags of the cached values this statement owns, cleared each time it runs
+    std::vector<int> cacheFlags;
+    
     virtual ~Statement() = default;
 };
 
@@ -89,17 +254,21 @@ class VarDeclaration : public Statement {
 public:
     std::string name;
     std::unique_ptr<Expression> initializer;
+    int slot;
+    int cell;  // set instead of slot when a nested function captures it
+    int numberSlot;  // set instead of slot when every value stored is a number or bool
     
     VarDeclaration(const std::string& n, std::unique_ptr<Expression> init)
-        : name(n), initializer(std::move(init)) {}
+        : name(n), initializer(std::move(init)), slot(-1), cell(-1), numberSlot(-1) {}
     void accept(Visitor& visitor) override;
 };
 
 class BlockStatement : public Statement {
 public:
     std::vector<std::unique_ptr<Statement>> statements;
+    bool needsEnvironment;  // false when all its locals live in frame slots, or it has none
     
-    BlockStatement(std::vector<std::unique_ptr<Statement>> stmts) : statements(std::move(stmts)) {}
+    BlockStatement(std::vector<std::unique_ptr<Statement>> stmts) : statements(std::move(stmts)), needsEnvironment(true) {}
     void accept(Visitor& visitor) override;
 };
 
@@ -124,14 +293,107 @@ public:
     void accept(Visitor& visitor) override;
 };
 
+class ForStatement : public Statement {
+public:
+    std::unique_ptr<Statement> initializer;
+    std::unique_ptr<Expression> condition;
+    std::unique_ptr<Expression> increment;
+    std::unique_ptr<Statement> body;
+    
+    // Counted loop `for (let i = a; i < n; i = i + k)` as recognized by the
+    // parser; counter is empty for any other shape
+    std::string counter;
+    BinaryOp counterCompare;
+    Expression* counterBound;
+    double counterStep;
+    // Body block can run in one environment for all iterations (it declares
+    // no functions, so nothing can capture a per-iteration binding)
+    bool reuseBodyEnvironment;
+    bool needsEnvironment;
+    
+    ForStatement(std::unique_ptr<Statement> init, std::unique_ptr<Expression> cond,
+                 std::unique_ptr<Expression> incr, std::unique_ptr<Statement> b)
+        : initializer(std::move(init)), condition(std::move(cond)), increment(std::move(incr)), body(std::move(b)),
+          counterCompare(BinaryOp::Unknown), counterBound(nullptr), counterStep(0), reuseBodyEnvironment(false),
+          needsEnvironment(true) {}
+    void accept(Visitor& visitor) override;
+};
+
+class ForInStatement : public Statement {
+public:
+    std::string variable;
+    std::unique_ptr<Expression> iterable;
+    std::unique_ptr<Statement> body;
+    bool reuseBodyEnvironment;
+    // Loop variable's frame slot or cell; both -1 when it lives in a loop environment
+    int slot;
+    int cell;
+    
+    ForInStatement(const std::string& var, std::unique_ptr<Expression> iter, std::unique_ptr<Statement> b)
+        : variable(var), iterable(std::move(iter)), body(std::move(b)), reuseBodyEnvironment(false), slot(-1),
+          cell(-1) {}
+    void accept(Visitor& visitor) override;
+};
+
+class YieldStatement : public Statement {
+public:
+    std::unique_ptr<Expression> value;
+    
+    YieldStatement(std::unique_ptr<Expression> val) : value(std::move(val)) {}
+    void accept(Visitor& visitor) override;
+};
+
+// Where a closure's upvalue comes from when the function is declared: a cell of
+// the enclosing call, or one of the enclosing function's own upvalues
+struct UpvalueSource {
+    bool fromCell;
+    int index;
+};
+
+// Unparsed body of a function loaded with lazy parsing: the tokens from just
+// after its '{' through the matching '}', parsed on the first call. The
+// tokens view into the loading module's source.
+struct LazyBody {
+    std::vector<Token> tokens;
+    std::atomic<bool> parsed;
+    std::mutex mutex;
+    
+    explicit LazyBody(std::vector<Token> bodyTokens) : tokens(std::move(bodyTokens)), parsed(false) {}
+};
+
 class FunctionDeclaration : public Statement {
 public:
     std::string name;
+    std::string path;  // of the file it is declared in
     std::vector<std::string> parameters;
-    std::unique_ptr<BlockStatement> body;
+    std::unique_ptr<BlockStatement> body;  // nullptr until a lazy body is parsed
+    std::unique_ptr<LazyBody> lazyBody;   // set when the body was skipped at load time
+    bool memoAnnotated;   // declared as `memo fun`
+    bool pure;            // proven pure by PurityAnalyzer
+    bool memoize;         // annotated and pure
+    bool isGenerator;     // body contains `yield`
+    // Statements of a generator body that contain a yield; the interpreter
+    // steps through these on its own frame stack so they can be suspended
+    std::unordered_set<const Statement*> suspendPoints;
+    // Set by the Resolver for every function but generators: the call keeps
+    // its locals in frameSize slots on the interpreter's frame stack, and the
+    // ones a nested function captures in cellCount shared cells
+    bool framed;
+    int frameSize;
+    int cellCount;
+    std::vector<int> parameterCells;  // cell of each parameter, -1 if not captured
+    // Free variables of enclosing functions that the body references
+    std::vector<UpvalueSource> upvalues;
+    // Set by the TypeAnalyzer for framed functions: the call's unboxed slots,
+    // and the type of every parameter and local in declaration order
+    int numberCount;
+    std::vector<std::pair<std::string, StaticType>> localTypes;
+    int slot;  // where the declaring scope stores the function, -1 for its environment
+    int cell;  // set instead of slot when a nested function captures it
     
     FunctionDeclaration(const std::string& n, std::vector<std::string> params, std::unique_ptr<BlockStatement> b)
-        : name(n), parameters(std::move(params)), body(std::move(b)) {}
+        : name(n), parameters(std::move(params)), body(std::move(b)), memoAnnotated(false), pure(false), memoize(false),
+          isGenerator(false), framed(false), frameSize(0), cellCount(0), numberCount(0), slot(-1), cell(-1) {}
     void accept(Visitor& visitor) override;
 };
 
@@ -151,6 +413,15 @@ public:
     void accept(Visitor& visitor) override;
 };
 
+// `import "path"`: runs a module file once, at global scope
+class ImportStatement : public Statement {
+public:
+    std::string path;
+    
+    ImportStatement(const std::string& p) : path(p) {}
+    void accept(Visitor& visitor) override;
+};
+
 // Program (root node)
 class Program : public ASTNode {
 public:
@@ -167,15 +438,49 @@ public:
     virtual void visit(LiteralExpression& node) = 0;
     virtual void visit(IdentifierExpression& node) = 0;
     virtual void visit(BinaryExpression& node) = 0;
+    virtual void visit(LogicalExpression& node) = 0;
     virtual void visit(UnaryExpression& node) = 0;
     virtual void visit(CallExpression& node) = 0;
+    virtual void visit(ArrayExpression& node) = 0;
+    virtual void visit(IndexExpression& node) = 0;
     virtual void visit(ExpressionStatement& node) = 0;
     virtual void visit(VarDeclaration& node) = 0;
     virtual void visit(BlockStatement& node) = 0;
     virtual void visit(IfStatement& node) = 0;
     virtual void visit(WhileStatement& node) = 0;
+    virtual void visit(ForStatement& node) = 0;
+    virtual void visit(ForInStatement& node) = 0;
+    virtual void visit(YieldStatement& node) = 0;
     virtual void visit(FunctionDeclaration& node) = 0;
     virtual void visit(ReturnStatement& node) = 0;
     virtual void visit(PrintStatement& node) = 0;
+    virtual void visit(ImportStatement& node) = 0;
     virtual void visit(Program& node) = 0;
+};
+
+// Visitor that walks every child node; analysis passes override only the
+// nodes they care about and call the base method to keep descending.
+class RecursiveVisitor : public Visitor {
+public:
+    void visit(LiteralExpression& node) override;
+    void visit(IdentifierExpression& node) override;
+    void visit(BinaryExpression& node) override;
+    void visit(LogicalExpression& node) override;
+    void visit(UnaryExpression& node) override;
+    void visit(CallExpression& node) override;
+    void visit(ArrayExpression& node) override;
+    void visit(IndexExpression& node) override;
+    void visit(ExpressionStatement& node) override;
+    void visit(VarDeclaration& node) override;
+    void visit(BlockStatement& node) override;
+    void visit(IfStatement& node) override;
+    void visit(WhileStatement& node) override;
+    void visit(ForStatement& node) override;
+    void visit(ForInStatement& node) override;
+    void visit(YieldStatement& node) override;
+    void visit(FunctionDeclaration& node) override;
+    void visit(ReturnStatement& node) override;
+    void visit(PrintStatement& node) override;
+    void visit(ImportStatement& node) override;
+    void visit(Program& node) override;
 };
\ No newline at end of file
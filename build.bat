@@ -8,14 +8,14 @@ REM Try different compilers
 if exist "C:\Program Files (x86)\Microsoft Visual Studio\2019\Community\VC\Auxiliary\Build\vcvars64.bat" (
     echo Using Visual Studio 2019...
     call "C:\Program Files (x86)\Microsoft Visual Studio\2019\Community\VC\Auxiliary\Build\vcvars64.bat"
-    cl.exe /EHsc /std:c++17 /Fo:build\ /Fe:flux.exe main.cpp lexer.cpp parser.cpp ast.cpp interpreter.cpp
+    cl.exe /EHsc /std:c++17 /Fo:build\ /Fe:flux.exe main.cpp lexer.cpp parser.cpp ast.cpp interpreter.cpp purity.cpp memo.cpp threadpool.cpp resolver.cpp types.cpp peephole.cpp optimizer.cpp module.cpp fluxstring.cpp stats.cpp trace.cpp records.cpp mappedfile.cpp snapshot.cpp server.cpp emitcpp.cpp memory.cpp fiber.cpp scheduler.cpp heapprofile.cpp
     goto :build_done
 )
 
 if exist "C:\Program Files\Microsoft Visual Studio\2022\Community\VC\Auxiliary\Build\vcvars64.bat" (
     echo Using Visual Studio 2022...
     call "C:\Program Files\Microsoft Visual Studio\2022\Community\VC\Auxiliary\Build\vcvars64.bat"
-    cl.exe /EHsc /std:c++17 /Fo:build\ /Fe:flux.exe main.cpp lexer.cpp parser.cpp ast.cpp interpreter.cpp
+    cl.exe /EHsc /std:c++17 /Fo:build\ /Fe:flux.exe main.cpp lexer.cpp parser.cpp ast.cpp interpreter.cpp purity.cpp memo.cpp threadpool.cpp resolver.cpp types.cpp peephole.cpp optimizer.cpp module.cpp fluxstring.cpp stats.cpp trace.cpp records.cpp mappedfile.cpp snapshot.cpp server.cpp emitcpp.cpp memory.cpp fiber.cpp scheduler.cpp heapprofile.cpp
     goto :build_done
 )
 
@@ -24,7 +24,7 @@ where g++ >nul 2>&1
 if %ERRORLEVEL% == 0 (
     echo Using MinGW g++...
     if not exist "build" mkdir build
-    g++ -std=c++17 -O2 -o flux.exe main.cpp lexer.cpp parser.cpp ast.cpp interpreter.cpp
+    g++ -std=c++17 -O2 -pthread -o flux.exe main.cpp lexer.cpp parser.cpp ast.cpp interpreter.cpp purity.cpp memo.cpp threadpool.cpp resolver.cpp types.cpp peephole.cpp optimizer.cpp module.cpp fluxstring.cpp stats.cpp trace.cpp records.cpp mappedfile.cpp snapshot.cpp server.cpp emitcpp.cpp memory.cpp fiber.cpp scheduler.cpp heapprofile.cpp
     goto :build_done
 )
 
@@ -33,7 +33,7 @@ where clang++ >nul 2>&1
 if %ERRORLEVEL% == 0 (
     echo Using Clang++...
     if not exist "build" mkdir build
-    clang++ -std=c++17 -O2 -o flux.exe main.cpp lexer.cpp parser.cpp ast.cpp interpreter.cpp
+    clang++ -std=c++17 -O2 -pthread -o flux.exe main.cpp lexer.cpp parser.cpp ast.cpp interpreter.cpp purity.cpp memo.cpp threadpool.cpp resolver.cpp types.cpp peephole.cpp optimizer.cpp module.cpp fluxstring.cpp stats.cpp trace.cpp records.cpp mappedfile.cpp snapshot.cpp server.cpp emitcpp.cpp memory.cpp fiber.cpp scheduler.cpp heapprofile.cpp
     goto :build_done
 )
 
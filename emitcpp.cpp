@@ -0,0 +1,1241 @@
+#include "emitcpp.h"
+#include "module.h"
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <set>
+#include <stdexcept>
+#include <unordered_map>
+#include <vector>
+
+namespace {
+
+// A declaration site: the VarDeclaration, ForInStatement or FunctionDeclaration
+// that introduces a name, or the parameter string itself
+using Site = const void*;
+
+struct NativeInfo {
+    const char* name;
+    int arity;  // -1 for any number of arguments
+};
+
+const NativeInfo nativeFunctions[] = {
+    {"clock", 0}, {"sqrt", 1}, {"abs", 1}, {"len", 1}, {"push", 2}, {"range", -1},
+    {"read_file", 1}, {"read_lines", 1}, {"split_fields", -1}, {"parallel_map", 2},
+};
+
+const NativeInfo* findNative(const std::string& name) {
+    for (const auto& native : nativeFunctions) {
+        if (name == native.name) return &native;
+    }
+    return nullptr;
+}
+
+// Shortest spelling that reads back as the same double, always with a point
+// or exponent so C++ takes it as a double
+std::string numberLiteral(double value) {
+    char buffer[32];
+    std::snprintf(buffer, sizeof(buffer), "%.15g", value);
+    if (std::strtod(buffer, nullptr) != value) {
+        std::snprintf(buffer, sizeof(buffer), "%.17g", value);
+    }
+    std::string text = buffer;
+    if (text.find_first_of(".e") == std::string::npos) text += ".0";
+    return text;
+}
+
+std::string stringLiteral(std::string_view text) {
+    std::string result = "\"";
+    for (unsigned char c : text) {
+        if (c == '"' || c == '\\') {
+            result += '\\';
+            result += static_cast<char>(c);
+        } else if (c == '\n') {
+            result += "\\n";
+        } else if (c == '\t') {
+            result += "\\t";
+        } else if (c < 0x20 || c >= 0x7f) {
+            char escape[8];
+            std::snprintf(escape, sizeof(escape), "\\%03o", c);
+            result += escape;
+        } else {
+            result += static_cast<char>(c);
+        }
+    }
+    return result + "\"";
+}
+
+std::string join(const std::vector<std::string>& parts) {
+    std::string result;
+    for (size_t i = 0; i < parts.size(); i++) {
+        if (i > 0) result += ", ";
+        result += parts[i];
+    }
+    return result;
+}
+
+// True when every path through the statement ends in a return
+bool alwaysReturns(const Statement* statement) {
+    if (dynamic_cast<const ReturnStatement*>(statement)) return true;
+    if (auto block = dynamic_cast<const BlockStatement*>(statement)) {
+        for (const auto& stmt : block->statements) {
+            if (alwaysReturns(stmt.get())) return true;
+        }
+        return false;
+    }
+    if (auto branch = dynamic_cast<const IfStatement*>(statement)) {
+        return branch->elseBranch && alwaysReturns(branch->thenBranch.get()) &&
+               alwaysReturns(branch->elseBranch.get());
+    }
+    return false;
+}
+
+// Loads the files a script imports, transitively, with every function body
+// parsed. Each file is one unit, numbered in the order it is first imported;
+// the script itself is unit 0.
+class UnitLoader : public RecursiveVisitor {
+public:
+    struct Unit {
+        Program* program;
+        std::string path;
+    };
+    
+    std::vector<Unit> units;
+    std::unordered_map<const ImportStatement*, int> imports;
+    
+    explicit UnitLoader(const std::unordered_set<std::string>& pureNatives) : pureNatives(pureNatives) {}
+    
+    void add(Program& program, const std::string& path) {
+        units.push_back({&program, path});
+        std::string enclosing = directory;
+        directory = std::filesystem::path(path).parent_path().string();
+        program.accept(*this);
+        directory = enclosing;
+    }
+    
+    void visit(FunctionDeclaration& node) override {
+        if (node.lazyBody) ensureFunctionBody(node, pureNatives);
+        RecursiveVisitor::visit(node);
+    }
+    
+    void visit(ImportStatement& node) override {
+        std::filesystem::path path(node.path);
+        if (path.is_relative() && !directory.empty()) {
+            path = std::filesystem::path(directory) / path;
+        }
+        
+        std::string key = ModuleCache::key(path.string());
+        auto known = ids.find(key);
+        if (known != ids.end()) {
+            imports[&node] = known->second;
+            return;
+        }
+        
+        int id = static_cast<int>(units.size());
+        ids[key] = id;
+        imports[&node] = id;
+        Module* module = modules.load(path.string(), pureNatives);
+        add(*module->program, module->path);
+    }
+
+private:
+    const std::unordered_set<std::string>& pureNatives;
+    ModuleCache modules;
+    std::unordered_map<std::string, int> ids;
+    std::string directory;
+};
+
+// Finds the locals referenced from a function nested in their scope; those
+// are kept in shared cells. Unlike the Resolver's pass, this counts the
+// locals of blocks in top-level code too, since compiled code has no
+// environments to fall back on.
+class CaptureFinder : public RecursiveVisitor {
+public:
+    std::unordered_set<Site> captured;
+    
+    void visit(IdentifierExpression& node) override {
+        for (auto it = scopes.rbegin(); it != scopes.rend(); ++it) {
+            auto found = it->find(node.name);
+            if (found == it->end()) continue;
+            if (found->second.owner != current) captured.insert(found->second.site);
+            return;
+        }
+    }
+    
+    void visit(VarDeclaration& node) override {
+        RecursiveVisitor::visit(node);
+        declare(node.name, &node);
+    }
+    
+    void visit(BlockStatement& node) override {
+        scopes.emplace_back();
+        RecursiveVisitor::visit(node);
+        scopes.pop_back();
+    }
+    
+    void visit(ForStatement& node) override {
+        scopes.emplace_back();
+        RecursiveVisitor::visit(node);
+        scopes.pop_back();
+    }
+    
+    void visit(ForInStatement& node) override {
+        node.iterable->accept(*this);
+        scopes.emplace_back();
+        declare(node.variable, &node);
+        node.body->accept(*this);
+        scopes.pop_back();
+    }
+    
+    void visit(FunctionDeclaration& node) override {
+        declare(node.name, &node);
+        
+        Site enclosing = current;
+        current = &node;
+        scopes.emplace_back();
+        for (const auto& param : node.parameters) {
+            declare(param, &param);
+        }
+        for (auto& stmt : node.body->statements) {
+            stmt->accept(*this);
+        }
+        scopes.pop_back();
+        current = enclosing;
+    }
+
+private:
+    struct Binding {
+        Site owner;  // the declaring function, or &topLevel
+        Site site;
+    };
+    
+    static constexpr char topLevel = 0;
+    std::vector<std::unordered_map<std::string, Binding>> scopes;  // innermost-last; globals aren't tracked
+    Site current = &topLevel;
+    
+    void declare(const std::string& name, Site site) {
+        if (!scopes.empty()) scopes.back().emplace(name, Binding{current, site});
+    }
+};
+
+// Which global names are bound by what: `fun` declarations at the top level
+// of a unit, or anything else (a top-level `let`, or an assignment anywhere).
+// A name bound by exactly one declaration and nothing else always holds that
+// function once it is defined, so calls to it can skip the lookup.
+class GlobalBindings : public RecursiveVisitor {
+public:
+    std::unordered_map<std::string, std::vector<FunctionDeclaration*>> functions;
+    std::vector<FunctionDeclaration*> declarations;  // in program order
+    std::unordered_set<std::string> rebound;
+    
+    void visit(Program& node) override {
+        for (auto& stmt : node.statements) {
+            if (auto function = dynamic_cast<FunctionDeclaration*>(stmt.get())) {
+                functions[function->name].push_back(function);
+                declarations.push_back(function);
+            } else if (auto variable = dynamic_cast<VarDeclaration*>(stmt.get())) {
+                rebound.insert(variable->name);
+            }
+            stmt->accept(*this);
+        }
+    }
+    
+    void visit(BinaryExpression& node) override {
+        if (node.op == BinaryOp::Assign) {
+            if (auto identifier = dynamic_cast<IdentifierExpression*>(node.left.get())) {
+                rebound.insert(identifier->name);
+            }
+        }
+        RecursiveVisitor::visit(node);
+    }
+    
+    FunctionDeclaration* stableFunction(const std::string& name) const {
+        auto found = functions.find(name);
+        if (found == functions.end() || found->second.size() != 1 || rebound.count(name)) return nullptr;
+        return found->second.front();
+    }
+    
+    // The native a global still holds wherever it is read
+    const NativeInfo* stableNative(const std::string& name) const {
+        if (functions.count(name) || rebound.count(name)) return nullptr;
+        return findNative(name);
+    }
+};
+
+// State shared by everything emitted for one program
+struct Context {
+    const UnitLoader& loader;
+    const std::unordered_set<Site>& captured;
+    const GlobalBindings& bindings;
+    std::unordered_map<const FunctionDeclaration*, std::string> functionNames;  // top-level functions
+    std::unordered_set<const FunctionDeclaration*> numeric;
+    std::set<std::string> globals;
+    std::unordered_map<std::string, std::string> strings;  // constant name by contents
+    std::vector<std::pair<std::string, std::string>> constants;  // name and contents, in order
+    int counter = 0;
+    
+    // Every generated name ends in a number no other name ends in, so no
+    // two can clash; names of globals end in a letter
+    std::string fresh(const std::string& base) {
+        return base + "_" + std::to_string(counter++);
+    }
+    
+    std::string global(const std::string& name) {
+        globals.insert(name);
+        return "global_" + name;
+    }
+    
+    std::string string(const FluxString& value) {
+        std::string text = value.str();
+        auto found = strings.find(text);
+        if (found != strings.end()) return found->second;
+        std::string name = strings[text] = fresh("str");
+        constants.emplace_back(name, text);
+        return name;
+    }
+};
+
+// Lines of C++ at a current indentation
+struct CodeWriter {
+    std::string text;
+    int depth = 0;
+    
+    void line(const std::string& code) {
+        text.append(depth * 4, ' ');
+        text += code;
+        text += '\n';
+    }
+    
+    std::string indentation() const {
+        return std::string(depth * 4, ' ');
+    }
+};
+
+// Compiles a top-level function whose parameters are numbers to plain double
+// arithmetic, or fails if anything in it could produce another type: every
+// local must start and stay a number, conditions must be comparisons or
+// their logical combinations, calls may only go to sqrt, abs and other
+// numeric functions, and every path must return a number.
+class NumericEmitter : public Visitor {
+public:
+    NumericEmitter(Context& context, FunctionDeclaration& function) : context(context), function(function) {}
+    
+    // Fills in the signature of num_<name> and its body
+    bool compile(std::string& signature, std::string& body) {
+        if (!alwaysReturns(function.body.get())) return false;
+        
+        scopes.emplace_back();
+        std::vector<std::string> parameters;
+        for (const auto& param : function.parameters) {
+            parameters.push_back("double " + declare(param));
+        }
+        writer.depth = 1;
+        writer.line("flux::CallScope call;");
+        for (auto& stmt : function.body->statements) {
+            stmt->accept(*this);
+            if (!ok) return false;
+        }
+        
+        signature = "static double num_" + context.functionNames.at(&function) + "(" + join(parameters) + ")";
+        body = writer.text;
+        return true;
+    }
+    
+    void visit(LiteralExpression& node) override {
+        if (auto number = std::get_if<double>(&node.value)) {
+            result(numberLiteral(*number), Number);
+        } else if (auto boolean = std::get_if<bool>(&node.value)) {
+            result(*boolean ? "true" : "false", Bool);
+        } else {
+            ok = false;
+        }
+    }
+    
+    void visit(IdentifierExpression& node) override {
+        const std::string* local = lookup(node.name);
+        if (!local) {
+            ok = false;
+            return;
+        }
+        result(*local, Number);
+    }
+    
+    void visit(BinaryExpression& node) override {
+        if (node.op == BinaryOp::Assign) {
+            auto identifier = dynamic_cast<IdentifierExpression*>(node.left.get());
+            const std::string* local = identifier ? lookup(identifier->name) : nullptr;
+            std::string value = number(node.right.get());
+            if (!local) ok = false;
+            if (ok) result("(" + *local + " = " + value + ")", Number);
+            return;
+        }
+        
+        if (node.op == BinaryOp::Equal || node.op == BinaryOp::NotEqual) {
+            Type leftType, rightType;
+            std::string left = compile(node.left.get(), leftType);
+            std::string right = compile(node.right.get(), rightType);
+            if (ok && leftType != rightType) ok = false;
+            result("(" + left + (node.op == BinaryOp::Equal ? " == " : " != ") + right + ")", Bool);
+            return;
+        }
+        
+        std::string left = number(node.left.get());
+        std::string right = number(node.right.get());
+        switch (node.op) {
+            case BinaryOp::Add: result("(" + left + " + " + right + ")", Number); break;
+            case BinaryOp::Subtract: result("(" + left + " - " + right + ")", Number); break;
+            case BinaryOp::Multiply: result("(" + left + " * " + right + ")", Number); break;
+            case BinaryOp::Divide: result("flux::divideNumbers(" + left + ", " + right + ")", Number); break;
+            case BinaryOp::Modulo: result("std::fmod(" + left + ", " + right + ")", Number); break;
+            case BinaryOp::Greater: result("(" + left + " > " + right + ")", Bool); break;
+            case BinaryOp::GreaterEqual: result("(" + left + " >= " + right + ")", Bool); break;
+            case BinaryOp::Less: result("(" + left + " < " + right + ")", Bool); break;
+            case BinaryOp::LessEqual: result("(" + left + " <= " + right + ")", Bool); break;
+            default: ok = false; break;
+        }
+    }
+    
+    // Both operands are booleans, so the operand `and` and `or` return is
+    // the result of && and ||
+    void visit(LogicalExpression& node) override {
+        std::string left = condition(node.left.get());
+        std::string right = condition(node.right.get());
+        result("(" + left + (node.op == LogicalOp::And ? " && " : " || ") + right + ")", Bool);
+    }
+    
+    void visit(UnaryExpression& node) override {
+        if (node.operator_ == "-") {
+            result("(-" + number(node.operand.get()) + ")", Number);
+        } else {
+            result("(!" + condition(node.operand.get()) + ")", Bool);
+        }
+    }
+    
+    void visit(CallExpression& node) override {
+        auto callee = dynamic_cast<IdentifierExpression*>(node.callee.get());
+        if (!callee || lookup(callee->name)) {
+            ok = false;
+            return;
+        }
+        
+        std::vector<std::string> arguments;
+        for (const auto& arg : node.arguments) {
+            arguments.push_back(number(arg.get()));
+        }
+        if (!ok) return;
+        
+        const NativeInfo* native = context.bindings.stableNative(callee->name);
+        FunctionDeclaration* target = context.bindings.stableFunction(callee->name);
+        if (native && (callee->name == "sqrt" || callee->name == "abs") && arguments.size() == 1) {
+            result((callee->name == "sqrt" ? "std::sqrt(" : "std::fabs(") + arguments[0] + ")", Number);
+        } else if (target && context.numeric.count(target) && target->parameters.size() == arguments.size()) {
+            // A function that is running is defined, so recursion skips the check
+            std::string call = "num_" + context.functionNames.at(target) + "(" + join(arguments) + ")";
+            if (target != &function) call = "(" + context.global(callee->name) + ".require(), " + call + ")";
+            result(call, Number);
+        } else {
+            ok = false;
+        }
+    }
+    
+    void visit(ArrayExpression&) override { ok = false; }
+    void visit(IndexExpression&) override { ok = false; }
+    
+    void visit(ExpressionStatement& node) override {
+        Type type;
+        std::string code = compile(node.expression.get(), type);
+        writer.line(code + ";");
+    }
+    
+    void visit(VarDeclaration& node) override {
+        if (!node.initializer) {
+            ok = false;
+            return;
+        }
+        std::string value = number(node.initializer.get());
+        auto existing = scopes.back().find(node.name);
+        if (existing != scopes.back().end()) {
+            writer.line(existing->second + " = " + value + ";");
+        } else {
+            writer.line("double " + declare(node.name) + " = " + value + ";");
+        }
+    }
+    
+    void visit(BlockStatement& node) override {
+        writer.line("{");
+        branch(&node);
+        writer.line("}");
+    }
+    
+    void visit(IfStatement& node) override {
+        writer.line("if (" + condition(node.condition.get()) + ") {");
+        branch(node.thenBranch.get());
+        if (node.elseBranch) {
+            writer.line("} else {");
+            branch(node.elseBranch.get());
+        }
+        writer.line("}");
+    }
+    
+    void visit(WhileStatement& node) override {
+        writer.line("while (" + condition(node.condition.get()) + ") {");
+        branch(node.body.get());
+        writer.line("}");
+    }
+    
+    void visit(ForStatement& node) override {
+        writer.line("{");
+        writer.depth++;
+        scopes.emplace_back();
+        if (node.initializer) node.initializer->accept(*this);
+        std::string test = node.condition ? condition(node.condition.get()) : "";
+        Type type;
+        std::string increment = node.increment ? compile(node.increment.get(), type) : "";
+        writer.line("for (; " + test + "; " + increment + ") {");
+        branch(node.body.get());
+        writer.line("}");
+        scopes.pop_back();
+        writer.depth--;
+        writer.line("}");
+    }
+    
+    // Only `for x in range(...)`, which counts in a double like the interpreter
+    void visit(ForInStatement& node) override {
+        auto call = dynamic_cast<CallExpression*>(node.iterable.get());
+        auto callee = call ? dynamic_cast<IdentifierExpression*>(call->callee.get()) : nullptr;
+        if (!callee || callee->name != "range" || lookup("range") || !context.bindings.stableNative("range") ||
+            call->arguments.empty() || call->arguments.size() > 3) {
+            ok = false;
+            return;
+        }
+        
+        std::vector<std::string> bounds;
+        for (const auto& arg : call->arguments) {
+            bounds.push_back(number(arg.get()));
+        }
+        if (!ok) return;
+        
+        std::string count = context.fresh("loop");
+        std::string start = bounds.size() > 1 ? bounds[0] : "0.0";
+        std::string end = bounds.size() > 1 ? bounds[1] : bounds[0];
+        std::string step = bounds.size() > 2 ? bounds[2] : "1.0";
+        writer.line("{");
+        writer.depth++;
+        writer.line("double " + count + " = " + start + ", end_" + count + " = " + end + ", step_" + count +
+                    " = " + step + ";");
+        writer.line("flux::checkStep(step_" + count + ");");
+        writer.line("for (; step_" + count + " > 0 ? " + count + " < end_" + count + " : " + count + " > end_" +
+                    count + "; " + count + " += step_" + count + ") {");
+        writer.depth++;
+        scopes.emplace_back();
+        writer.line("double " + declare(node.variable) + " = " + count + ";");
+        statements(node.body.get());
+        scopes.pop_back();
+        writer.depth--;
+        writer.line("}");
+        writer.depth--;
+        writer.line("}");
+    }
+    
+    void visit(ReturnStatement& node) override {
+        if (!node.value) {
+            ok = false;
+            return;
+        }
+        writer.line("return " + number(node.value.get()) + ";");
+    }
+    
+    void visit(YieldStatement&) override { ok = false; }
+    void visit(FunctionDeclaration&) override { ok = false; }
+    void visit(PrintStatement&) override { ok = false; }
+    void visit(ImportStatement&) override { ok = false; }
+    void visit(Program&) override { ok = false; }
+
+private:
+    enum Type { Number, Bool };
+    
+    Context& context;
+    FunctionDeclaration& function;
+    CodeWriter writer;
+    std::vector<std::unordered_map<std::string, std::string>> scopes;
+    bool ok = true;
+    std::string code;
+    Type type = Number;
+    
+    void result(const std::string& expression, Type expressionType) {
+        code = expression;
+        type = expressionType;
+    }
+    
+    std::string compile(Expression* expression, Type& expressionType) {
+        code.clear();
+        if (ok) expression->accept(*this);
+        expressionType = type;
+        return code;
+    }
+    
+    std::string number(Expression* expression) {
+        Type expressionType;
+        std::string result = compile(expression, expressionType);
+        if (expressionType != Number) ok = false;
+        return result;
+    }
+    
+    std::string condition(Expression* expression) {
+        Type expressionType;
+        std::string result = compile(expression, expressionType);
+        if (expressionType != Bool) ok = false;
+        return result;
+    }
+    
+    std::string declare(const std::string& name) {
+        return scopes.back()[name] = context.fresh(name);
+    }
+    
+    const std::string* lookup(const std::string& name) const {
+        for (auto it = scopes.rbegin(); it != scopes.rend(); ++it) {
+            auto found = it->find(name);
+            if (found != it->end()) return &found->second;
+        }
+        return nullptr;
+    }
+    
+    // A block's statements, or a lone statement, in a scope of their own
+    void statements(Statement* body) {
+        scopes.emplace_back();
+        if (auto block = dynamic_cast<BlockStatement*>(body)) {
+            for (auto& stmt : block->statements) {
+                if (ok) stmt->accept(*this);
+            }
+        } else if (ok) {
+            body->accept(*this);
+        }
+        scopes.pop_back();
+    }
+    
+    void branch(Statement* body) {
+        writer.depth++;
+        statements(body);
+        writer.depth--;
+    }
+};
+
+// Emits everything else, with values held in flux::Value. Locals are C++
+// locals, or shared cells when a nested function captures them; nested
+// functions are lambdas that copy the cells they use.
+class CppEmitter : public Visitor {
+public:
+    CodeWriter prototypes;
+    CodeWriter definitions;
+    
+    explicit CppEmitter(Context& context) : context(context) {}
+    
+    void emitUnit(int id) {
+        const UnitLoader::Unit& unit = context.loader.units[id];
+        CodeWriter body;
+        body.depth = 1;
+        std::swap(writer, body);
+        
+        // Importing a unit runs it once; later imports, including cyclic
+        // ones, do nothing
+        writer.line("static bool loaded = false;");
+        writer.line("if (loaded) return;");
+        writer.line("loaded = true;");
+        for (auto& stmt : unit.program->statements) {
+            stmt->accept(*this);
+        }
+        
+        std::swap(writer, body);
+        std::string name = "unit_" + std::to_string(id);
+        prototypes.line("static void " + name + "();");
+        definitions.line("// " + unit.path);
+        definitions.line("static void " + name + "() {");
+        definitions.text += body.text;
+        definitions.line("}");
+        definitions.line("");
+    }
+    
+    void visit(LiteralExpression& node) override {
+        if (auto number = std::get_if<double>(&node.value)) {
+            result(numberLiteral(*number), Constant);
+        } else if (auto str = std::get_if<FluxString>(&node.value)) {
+            result(context.string(*str), Constant);
+        } else if (auto boolean = std::get_if<bool>(&node.value)) {
+            result(*boolean ? "flux::Value(true)" : "flux::Value(false)", Constant);
+        } else {
+            result("flux::Value(nullptr)", Constant);
+        }
+    }
+    
+    void visit(IdentifierExpression& node) override {
+        if (const Local* local = lookup(node.name)) {
+            result(local->cell ? "(*" + local->name + ")" : local->name, Read);
+        } else {
+            result(context.global(node.name) + ".get()", Throws);
+        }
+    }
+    
+    void visit(BinaryExpression& node) override {
+        if (node.op == BinaryOp::Assign) {
+            Operand value = operand(node.right.get());
+            auto identifier = dynamic_cast<IdentifierExpression*>(node.left.get());
+            if (!identifier) {
+                result("((void)" + value.code + ", flux::fail(\"Invalid assignment target\"), flux::Value(nullptr))",
+                       Effects);
+            } else if (const Local* local = lookup(identifier->name)) {
+                result("(" + std::string(local->cell ? "*" : "") + local->name + " = " + value.code + ")", Effects);
+            } else {
+                result(context.global(identifier->name) + ".set(" + value.code + ")", Effects);
+            }
+            return;
+        }
+        
+        const char* operation = "";
+        switch (node.op) {
+            case BinaryOp::Add: operation = "flux::add"; break;
+            case BinaryOp::Subtract: operation = "flux::subtract"; break;
+            case BinaryOp::Multiply: operation = "flux::multiply"; break;
+            case BinaryOp::Divide: operation = "flux::divide"; break;
+            case BinaryOp::Modulo: operation = "flux::modulo"; break;
+            case BinaryOp::Greater: operation = "flux::greater"; break;
+            case BinaryOp::GreaterEqual: operation = "flux::greaterEqual"; break;
+            case BinaryOp::Less: operation = "flux::less"; break;
+            case BinaryOp::LessEqual: operation = "flux::lessEqual"; break;
+            case BinaryOp::NotEqual: operation = "flux::notEqual"; break;
+            case BinaryOp::Equal: operation = "flux::isEqual"; break;
+            default:
+                throw std::runtime_error("Unknown binary operator: " + node.operator_);
+        }
+        std::vector<Operand> operands{operand(node.left.get()), operand(node.right.get())};
+        result(ordered(operation, operands), Throws, operands);
+    }
+    
+    void visit(LogicalExpression& node) override {
+        Operand left = operand(node.left.get());
+        Operand right = operand(node.right.get());
+        std::string function = node.op == LogicalOp::And ? "flux::logicalAnd(" : "flux::logicalOr(";
+        result(function + left.code + ", [&]() -> flux::Value { return " + right.code + "; })", Read,
+               {left, right});
+    }
+    
+    void visit(UnaryExpression& node) override {
+        Operand value = operand(node.operand.get());
+        if (node.operator_ == "-") {
+            result("flux::negate(" + value.code + ")", Throws, {value});
+        } else {
+            result("flux::Value(!flux::truthy(" + value.code + "))", Read, {value});
+        }
+    }
+    
+    void visit(CallExpression& node) override {
+        std::vector<Operand> arguments;
+        for (const auto& arg : node.arguments) {
+            arguments.push_back(operand(arg.get()));
+        }
+        
+        auto callee = dynamic_cast<IdentifierExpression*>(node.callee.get());
+        if (callee && !lookup(callee->name)) {
+            FunctionDeclaration* target = context.bindings.stableFunction(callee->name);
+            if (target && target->parameters.size() == arguments.size()) {
+                std::string call = ordered("fn_" + context.functionNames.at(target), arguments);
+                if (target != function) call = "(" + context.global(callee->name) + ".require(), " + call + ")";
+                result(call, Effects);
+                return;
+            }
+            
+            const NativeInfo* native = context.bindings.stableNative(callee->name);
+            if (native && (native->arity < 0 || native->arity == static_cast<int>(arguments.size()))) {
+                result("flux::callNative(flux::natives::" + callee->name + ", {" + codes(arguments) + "})",
+                       Effects);
+                return;
+            }
+        }
+        
+        arguments.insert(arguments.begin(), operand(node.callee.get()));
+        result("flux::call({" + codes(arguments) + "})", Effects);
+    }
+    
+    void visit(ArrayExpression& node) override {
+        std::vector<Operand> elements;
+        for (const auto& element : node.elements) {
+            elements.push_back(operand(element.get()));
+        }
+        result("flux::array({" + codes(elements) + "})", Read, elements);
+    }
+    
+    void visit(IndexExpression& node) override {
+        std::vector<Operand> operands{operand(node.object.get()), operand(node.index.get())};
+        result(ordered("flux::index", operands), Throws, operands);
+    }
+    
+    void visit(ExpressionStatement& node) override {
+        writer.line(operand(node.expression.get()).code + ";");
+    }
+    
+    void visit(VarDeclaration& node) override {
+        std::string value = node.initializer ? operand(node.initializer.get()).code : "flux::Value(nullptr)";
+        if (scopes.empty()) {
+            writer.line(context.global(node.name) + ".define(" + value + ");");
+            return;
+        }
+        
+        bool cell = context.captured.count(&node) > 0;
+        auto existing = scopes.back().find(node.name);
+        if (existing != scopes.back().end()) {
+            const Local& local = existing->second;
+            writer.line(local.name + " = " + (local.cell ? "std::make_shared<flux::Value>(" + value + ")" : value) + ";");
+        } else if (cell) {
+            writer.line("auto " + declare(node.name, true) + " = std::make_shared<flux::Value>(" + value + ");");
+        } else {
+            writer.line("flux::Value " + declare(node.name, false) + " = " + value + ";");
+        }
+    }
+    
+    void visit(BlockStatement& node) override {
+        writer.line("{");
+        branch(&node);
+        writer.line("}");
+    }
+    
+    void visit(IfStatement& node) override {
+        writer.line("if (" + condition(node.condition.get()) + ") {");
+        branch(node.thenBranch.get());
+        if (node.elseBranch) {
+            writer.line("} else {");
+            branch(node.elseBranch.get());
+        }
+        writer.line("}");
+    }
+    
+    void visit(WhileStatement& node) override {
+        writer.line("while (" + condition(node.condition.get()) + ") {");
+        branch(node.body.get());
+        writer.line("}");
+    }
+    
+    void visit(ForStatement& node) override {
+        writer.line("{");
+        writer.depth++;
+        scopes.emplace_back();
+        if (node.initializer) node.initializer->accept(*this);
+        std::string test = node.condition ? condition(node.condition.get()) : "";
+        std::string increment = node.increment ? operand(node.increment.get()).code : "";
+        writer.line("for (; " + test + "; " + increment + ") {");
+        branch(node.body.get());
+        writer.line("}");
+        scopes.pop_back();
+        writer.depth--;
+        writer.line("}");
+    }
+    
+    void visit(ForInStatement& node) override {
+        // `for i in range(...)` counts in a double, as the interpreter does
+        auto call = dynamic_cast<CallExpression*>(node.iterable.get());
+        auto callee = call ? dynamic_cast<IdentifierExpression*>(call->callee.get()) : nullptr;
+        bool counted = callee && callee->name == "range" && !lookup("range") &&
+                       context.bindings.stableNative("range") && !call->arguments.empty() &&
+                       call->arguments.size() <= 3;
+        
+        std::vector<Operand> bounds;
+        std::string iterable;
+        if (counted) {
+            for (const auto& arg : call->arguments) {
+                bounds.push_back(operand(arg.get()));
+            }
+        } else {
+            iterable = operand(node.iterable.get()).code;
+        }
+        
+        writer.line("{");
+        writer.depth++;
+        std::string loop = context.fresh("loop");
+        if (counted) {
+            writer.line("flux::Value bounds_" + loop + "[] = {" + codes(bounds) + "};");
+            writer.line("double " + loop + ", end_" + loop + ", step_" + loop + ";");
+            writer.line("flux::rangeArguments(bounds_" + loop + ", " + std::to_string(bounds.size()) + ", " + loop +
+                        ", end_" + loop + ", step_" + loop + ");");
+        } else {
+            writer.line("auto " + loop + " = flux::iterate(" + iterable + ");");
+        }
+        
+        scopes.emplace_back();
+        bool cell = context.captured.count(&node) > 0;
+        std::string variable = declare(node.variable, cell);
+        if (cell) {
+            writer.line("auto " + variable + " = std::make_shared<flux::Value>();");
+        } else {
+            writer.line("flux::Value " + variable + ";");
+        }
+        
+        if (counted) {
+            writer.line("for (; step_" + loop + " > 0 ? " + loop + " < end_" + loop + " : " + loop + " > end_" +
+                        loop + "; " + loop + " += step_" + loop + ") {");
+            writer.depth++;
+            writer.line((cell ? "*" : "") + variable + " = " + loop + ";");
+            writer.depth--;
+        } else {
+            writer.line("while (" + loop + "->next(" + (cell ? "*" : "") + variable + ")) {");
+        }
+        branch(node.body.get());
+        writer.line("}");
+        scopes.pop_back();
+        writer.depth--;
+        writer.line("}");
+    }
+    
+    void visit(YieldStatement&) override {
+        throw std::runtime_error("Cannot 'yield' outside a generator");
+    }
+    
+    void visit(FunctionDeclaration& node) override {
+        if (node.isGenerator) {
+            throw std::runtime_error("--emit-cpp does not support generators (" + node.name + ")");
+        }
+        
+        if (scopes.empty()) {
+            const std::string& name = context.functionNames.at(&node);
+            emitTopLevelFunction(node, name);
+            
+            std::vector<std::string> arguments;
+            for (size_t i = 0; i < node.parameters.size(); i++) {
+                arguments.push_back("args[" + std::to_string(i) + "]");
+            }
+            writer.line(context.global(node.name) + ".define(flux::function(" + stringLiteral(node.name) + ", " +
+                        std::to_string(node.parameters.size()) + ", [](const flux::Value*" +
+                        (arguments.empty() ? "" : " args") + ", size_t) -> flux::Value { return fn_" + name + "(" +
+                        join(arguments) + "); }));");
+            return;
+        }
+        
+        // Declared before its body so the function can refer to itself
+        bool cell = context.captured.count(&node) > 0;
+        auto existing = scopes.back().find(node.name);
+        std::string local;
+        if (existing != scopes.back().end()) {
+            local = existing->second.name;
+            if (existing->second.cell) writer.line(local + " = std::make_shared<flux::Value>();");
+            cell = existing->second.cell;
+        } else {
+            local = declare(node.name, cell);
+            if (cell) writer.line("auto " + local + " = std::make_shared<flux::Value>();");
+        }
+        
+        std::string closure = emitClosure(node);
+        if (cell) {
+            writer.line("*" + local + " = " + closure + ";");
+        } else if (existing != scopes.back().end()) {
+            writer.line(local + " = " + closure + ";");
+        } else {
+            writer.line("flux::Value " + local + " = " + closure + ";");
+        }
+    }
+    
+    void visit(ReturnStatement& node) override {
+        std::string value = node.value ? operand(node.value.get()).code : "flux::Value(nullptr)";
+        if (function || closures > 0) {
+            writer.line("return " + value + ";");
+        } else {
+            // `return` at the top level ends the unit
+            if (node.value) writer.line(value + ";");
+            writer.line("return;");
+        }
+    }
+    
+    void visit(PrintStatement& node) override {
+        writer.line("flux::print(" + operand(node.expression.get()).code + ");");
+    }
+    
+    void visit(ImportStatement& node) override {
+        writer.line("unit_" + std::to_string(context.loader.imports.at(&node)) + "();");
+    }
+    
+    void visit(Program&) override {}
+
+private:
+    // What evaluating an expression can do, from least to most
+    enum Behavior { Constant, Read, Throws, Effects };
+    
+    struct Operand {
+        std::string code;
+        Behavior behavior;
+    };
+    
+    struct Local {
+        std::string name;
+        bool cell;
+    };
+    
+    Context& context;
+    CodeWriter writer;
+    std::vector<std::unordered_map<std::string, Local>> scopes;
+    Operand value;
+    const FunctionDeclaration* function = nullptr;  // top-level function being emitted
+    int closures = 0;                                // nested functions being emitted
+    
+    void result(const std::string& code, Behavior behavior, const std::vector<Operand>& operands = {}) {
+        for (const auto& op : operands) {
+            if (op.behavior > behavior) behavior = op.behavior;
+        }
+        value = {code, behavior};
+    }
+    
+    Operand operand(Expression* expression) {
+        expression->accept(*this);
+        return value;
+    }
+    
+    std::string condition(Expression* expression) {
+        return "flux::truthy(" + operand(expression).code + ")";
+    }
+    
+    static std::string codes(const std::vector<Operand>& operands) {
+        std::vector<std::string> parts;
+        for (const auto& op : operands) {
+            parts.push_back(op.code);
+        }
+        return join(parts);
+    }
+    
+    // A call of operation on the operands, through a braced list when the
+    // order C++ happened to evaluate them in could be observed: when one has
+    // side effects and another isn't a constant, or two can throw
+    static std::string ordered(const std::string& operation, const std::vector<Operand>& operands) {
+        int variable = 0, throwing = 0, effects = 0;
+        for (const auto& op : operands) {
+            if (op.behavior > Constant) variable++;
+            if (op.behavior >= Throws) throwing++;
+            if (op.behavior == Effects) effects++;
+        }
+        if ((effects > 0 && variable > 1) || throwing > 1) {
+            return "flux::ordered(" + operation + ", {" + codes(operands) + "})";
+        }
+        return operation + "(" + codes(operands) + ")";
+    }
+    
+    std::string declare(const std::string& name, bool cell) {
+        std::string local = context.fresh(name);
+        scopes.back()[name] = Local{local, cell};
+        return local;
+    }
+    
+    const Local* lookup(const std::string& name) const {
+        for (auto it = scopes.rbegin(); it != scopes.rend(); ++it) {
+            auto found = it->find(name);
+            if (found != it->end()) return &found->second;
+        }
+        return nullptr;
+    }
+    
+    void branch(Statement* body) {
+        writer.depth++;
+        scopes.emplace_back();
+        if (auto block = dynamic_cast<BlockStatement*>(body)) {
+            for (auto& stmt : block->statements) {
+                stmt->accept(*this);
+            }
+        } else {
+            body->accept(*this);
+        }
+        scopes.pop_back();
+        writer.depth--;
+    }
+    
+    // Parameters and the body's top-level statements share one scope
+    void emitBody(FunctionDeclaration& node, const std::vector<std::string>& parameters) {
+        writer.line("flux::CallScope call;");
+        for (size_t i = 0; i < node.parameters.size(); i++) {
+            const std::string& param = node.parameters[i];
+            if (context.captured.count(&param)) {
+                std::string cell = declare(param, true);
+                writer.line("auto " + cell + " = std::make_shared<flux::Value>(" + parameters[i] + ");");
+            } else {
+                scopes.back()[param] = Local{parameters[i], false};
+            }
+        }
+        for (auto& stmt : node.body->statements) {
+            stmt->accept(*this);
+        }
+        if (!alwaysReturns(node.body.get())) writer.line("return flux::Value(nullptr);");
+    }
+    
+    // fn_<name> takes its arguments as C++ parameters. A `memo` function
+    // caches body_<name>; a numeric one hands numbers to num_<name>.
+    void emitTopLevelFunction(FunctionDeclaration& node, const std::string& name) {
+        std::vector<std::string> parameters, declarations;
+        for (const auto& param : node.parameters) {
+            parameters.push_back(context.fresh(param));
+            declarations.push_back("flux::Value " + parameters.back());
+        }
+        std::string signature = "(" + join(declarations) + ")";
+        
+        CodeWriter body;
+        body.depth = 1;
+        std::swap(writer, body);
+        const FunctionDeclaration* enclosing = function;
+        function = &node;
+        scopes.emplace_back();
+        
+        if (context.numeric.count(&node)) {
+            std::vector<std::string> tests, numbers;
+            for (const auto& param : parameters) {
+                tests.push_back("flux::isNumber(" + param + ")");
+                numbers.push_back("flux::number(" + param + ")");
+            }
+            std::string call = "return num_" + name + "(" + join(numbers) + ");";
+            if (tests.empty()) {
+                writer.line(call);
+            } else {
+                std::string test = tests[0];
+                for (size_t i = 1; i < tests.size(); i++) {
+                    test += " && " + tests[i];
+                }
+                writer.line("if (" + test + ") {");
+                writer.depth++;
+                writer.line(call);
+                writer.depth--;
+                writer.line("}");
+            }
+        }
+        if (!context.numeric.count(&node) || !parameters.empty()) {
+            emitBody(node, parameters);
+        }
+        
+        scopes.pop_back();
+        function = enclosing;
+        std::swap(writer, body);
+        
+        if (node.memoize) {
+            prototypes.line("static flux::Value body_" + name + signature + ";");
+            definitions.line("static flux::Value fn_" + name + signature + " {");
+            definitions.depth++;
+            definitions.line("static flux::MemoTable memo;");
+            definitions.line("return memo.call({" + join(parameters) + "}, [&] { return body_" + name + "(" +
+                             join(parameters) + "); });");
+            definitions.depth--;
+            definitions.line("}");
+            definitions.line("");
+            definitions.line("static flux::Value body_" + name + signature + " {");
+        } else {
+            definitions.line("static flux::Value fn_" + name + signature + " {");
+        }
+        prototypes.line("static flux::Value fn_" + name + signature + ";");
+        definitions.text += body.text;
+        definitions.line("}");
+        definitions.line("");
+    }
+    
+    std::string emitClosure(FunctionDeclaration& node) {
+        CodeWriter body;
+        body.depth = writer.depth + 1;
+        std::swap(writer, body);
+        closures++;
+        scopes.emplace_back();
+        
+        std::vector<std::string> parameters;
+        for (size_t i = 0; i < node.parameters.size(); i++) {
+            parameters.push_back("args[" + std::to_string(i) + "]");
+        }
+        // Parameters are assignable, so each gets a copy
+        std::vector<std::string> copies;
+        for (size_t i = 0; i < node.parameters.size(); i++) {
+            const std::string& param = node.parameters[i];
+            if (!context.captured.count(&param)) {
+                std::string local = context.fresh(param);
+                writer.line("flux::Value " + local + " = " + parameters[i] + ";");
+                copies.push_back(local);
+            } else {
+                copies.push_back(parameters[i]);
+            }
+        }
+        emitBody(node, copies);
+        
+        scopes.pop_back();
+        closures--;
+        std::swap(writer, body);
+        return "flux::function(" + stringLiteral(node.name) + ", " + std::to_string(node.parameters.size()) +
+               ", [=](const flux::Value*" + (parameters.empty() ? "" : " args") + ", size_t) -> flux::Value {\n" +
+               body.text + writer.indentation() + "})";
+    }
+};
+
+}
+
+void emitCpp(Program& program, const std::string& path, const std::unordered_set<std::string>& pureNatives,
+             std::ostream& out) {
+    UnitLoader loader(pureNatives);
+    loader.add(program, path);
+    
+    CaptureFinder captures;
+    GlobalBindings bindings;
+    for (const auto& unit : loader.units) {
+        unit.program->accept(captures);
+        unit.program->accept(bindings);
+    }
+    
+    Context context{loader, captures.captured, bindings, {}, {}, {}, {}, {}, 0};
+    for (const FunctionDeclaration* function : bindings.declarations) {
+        context.functionNames[function] = context.fresh(function->name);
+    }
+    
+    // Assume every candidate is numeric, then drop the ones that aren't until
+    // the rest only call each other
+    std::vector<FunctionDeclaration*> candidates;
+    for (FunctionDeclaration* function : bindings.declarations) {
+        if (bindings.stableFunction(function->name) == function && !function->memoize && !function->isGenerator) {
+            candidates.push_back(function);
+            context.numeric.insert(function);
+        }
+    }
+    std::vector<std::pair<std::string, std::string>> numericFunctions;  // signature and body
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        numericFunctions.clear();
+        for (FunctionDeclaration* function : candidates) {
+            if (!context.numeric.count(function)) continue;
+            std::string signature, body;
+            NumericEmitter emitter(context, *function);
+            if (emitter.compile(signature, body)) {
+                numericFunctions.emplace_back(signature, body);
+            } else {
+                context.numeric.erase(function);
+                changed = true;
+            }
+        }
+    }
+    
+    CppEmitter emitter(context);
+    for (size_t id = 0; id < loader.units.size(); id++) {
+        emitter.emitUnit(static_cast<int>(id));
+    }
+    
+    out << "// Generated by flux --emit-cpp from " << path << ". Build it against the Flux runtime:\n";
+    out << "//   g++ -std=c++17 -O2 -I<flux> program.cpp <flux>/build/libfluxrt.a -o program\n";
+    out << "#include \"fluxrt.h\"\n\n";
+    
+    for (const auto& name : context.globals) {
+        const NativeInfo* native = findNative(name);
+        if (native) {
+            out << "static flux::Global global_" << name << "(\"" << name << "\", flux::native(\"" << name << "\", "
+                << native->arity << ", flux::natives::" << name << "));\n";
+        } else {
+            out << "static flux::Global global_" << name << "(\"" << name << "\");\n";
+        }
+    }
+    for (const auto& constant : context.constants) {
+        out << "static const flux::Value " << constant.first << " = FluxString(" << stringLiteral(constant.second) << ");\n";
+    }
+    out << "\n";
+    
+    for (const auto& numeric : numericFunctions) {
+        out << numeric.first << ";\n";
+    }
+    out << emitter.prototypes.text << "\n";
+    for (const auto& numeric : numericFunctions) {
+        out << numeric.first << " {\n" << numeric.second << "}\n\n";
+    }
+    out << emitter.definitions.text;
+    out << "int main() {\n";
+    out << "    return flux::run(unit_0);\n";
+    out << "}\n";
+}
@@ -0,0 +1,15 @@
+#pragma once
+#include "ast.h"
+#include <ostream>
+#include <string>
+#include <unordered_set>
+
+// Translates a parsed and analyzed script into a standalone C++ program over
+// the runtime in fluxrt.h. Files the script imports are compiled in, found
+// relative to path as the interpreter would find them. Top-level functions
+// become C++ functions, called directly where their name is never rebound,
+// and those whose locals provably stay numbers get a second version in plain
+// double arithmetic. Throws std::runtime_error for generators, which the
+// backend can't express.
+void emitCpp(Program& program, const std::string& path, const std::unordered_set<std::string>& pureNatives,
+             std::ostream& out);
@@ -0,0 +1,113 @@
+#include "fiber.h"
+#include <stdexcept>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <ucontext.h>
+#include <unistd.h>
+#endif
+
+namespace {
+thread_local Fiber* running = nullptr;
+}
+
+#ifndef _WIN32
+
+struct Fiber::Context {
+    ucontext_t fiber;
+    ucontext_t resumer;
+};
+
+Fiber::Fiber(std::function<void()> body, size_t stackSize)
+    : body(std::move(body)), context(std::make_unique<Context>()), stack(nullptr), stackSize(stackSize),
+      started(false), done(false) {
+    // The lowest page is left inaccessible, so an overflow faults instead of
+    // running into other memory
+    size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    void* mapping = mmap(nullptr, stackSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                         -1, 0);
+    if (mapping == MAP_FAILED) throw std::runtime_error("Could not allocate a fiber stack");
+    stack = static_cast<char*>(mapping);
+    mprotect(stack, page, PROT_NONE);
+    
+    memory.stackBase = reinterpret_cast<uintptr_t>(stack + stackSize);
+    memory.stackBudget = (stackSize - page) / 4 * 3;
+}
+
+Fiber::~Fiber() {
+    munmap(stack, stackSize);
+}
+
+bool Fiber::resume() {
+    if (done) return false;
+    if (!started) {
+        getcontext(&context->fiber);
+        context->fiber.uc_stack.ss_sp = stack;
+        context->fiber.uc_stack.ss_size = stackSize;
+        context->fiber.uc_link = nullptr;
+        makecontext(&context->fiber, &Fiber::entry, 0);
+        started = true;
+    }
+    
+    Fiber* resumer = running;
+    running = this;
+    MemoryContext saved = exchangeMemoryContext(std::move(memory));
+    sourceStack.swap(HeapProfiler::stack());
+    swapcontext(&context->resumer, &context->fiber);
+    sourceStack.swap(HeapProfiler::stack());
+    memory = exchangeMemoryContext(std::move(saved));
+    running = resumer;
+    
+    if (failure) {
+        std::exception_ptr thrown = failure;
+        failure = nullptr;
+        std::rethrow_exception(thrown);
+    }
+    return !done;
+}
+
+bool Fiber::yield() {
+    Fiber* fiber = running;
+    if (!fiber) return false;
+    swapcontext(&fiber->context->fiber, &fiber->context->resumer);
+    return true;
+}
+
+void Fiber::entry() {
+    Fiber* fiber = running;
+    try {
+        fiber->body();
+    } catch (...) {
+        fiber->failure = std::current_exception();
+    }
+    fiber->done = true;
+    // Never returns: the fiber's stack is only freed once it is switched away from
+    swapcontext(&fiber->context->fiber, &fiber->context->resumer);
+}
+
+#else
+
+struct Fiber::Context {};
+
+Fiber::Fiber(std::function<void()> body, size_t stackSize)
+    : body(std::move(body)), stack(nullptr), stackSize(stackSize), started(false), done(false) {
+    throw std::runtime_error("Fibers need ucontext, which is not available on Windows");
+}
+
+Fiber::~Fiber() {}
+
+bool Fiber::resume() {
+    return false;
+}
+
+bool Fiber::yield() {
+    return false;
+}
+
+void Fiber::entry() {}
+
+#endif
+
+Fiber* Fiber::current() {
+    return running;
+}
@@ -0,0 +1,50 @@
+#pragma once
+#include "heapprofile.h"
+#include "memory.h"
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <memory>
+
+// A function running on a stack of its own that can suspend itself with
+// yield() and later be resumed where it left off, so a thread can take turns
+// between many long-running calls. A fiber must always be resumed on the
+// thread that first resumed it, and must have finished before it is
+// destroyed: a suspended fiber's stack is freed without unwinding it.
+class Fiber {
+public:
+    // Only the pages a fiber touches are committed, so it gets the stack of a thread
+    static constexpr size_t DefaultStackSize = 8 << 20;
+    
+    explicit Fiber(std::function<void()> body, size_t stackSize = DefaultStackSize);
+    ~Fiber();
+    
+    Fiber(const Fiber&) = delete;
+    Fiber& operator=(const Fiber&) = delete;
+    
+    // Runs the fiber until it yields or finishes, rethrowing anything its
+    // body threw; true while it has more to run
+    bool resume();
+    bool finished() const { return done; }
+    
+    // Suspends the fiber running on this thread, returning from its resume();
+    // false, without suspending, when called outside a fiber
+    static bool yield();
+    // The fiber running on this thread, or nullptr
+    static Fiber* current();
+    
+private:
+    struct Context;  // the saved registers of the fiber and of its resumer
+    
+    std::function<void()> body;
+    std::unique_ptr<Context> context;
+    char* stack;
+    size_t stackSize;
+    bool started;
+    bool done;
+    std::exception_ptr failure;
+    MemoryContext memory;  // swapped in while the fiber runs
+    SourceStack sourceStack;  // the heap profiler's, likewise
+    
+    static void entry();
+};
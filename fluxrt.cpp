@@ -0,0 +1,391 @@
+#include "fluxrt.h"
+#include "mappedfile.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <string_view>
+
+namespace flux {
+
+namespace {
+
+struct ArrayIterator : Iterator {
+    std::shared_ptr<Array> array;
+    size_t position = 0;
+    
+    explicit ArrayIterator(std::shared_ptr<Array> array) : array(std::move(array)) {}
+    
+    bool next(Value& value) override {
+        if (position >= array->elements.size()) return false;
+        value = array->elements[position++];
+        return true;
+    }
+    
+    std::string toString() const override {
+        return "<array iterator>";
+    }
+};
+
+struct RangeIterator : Iterator {
+    double current;
+    double end;
+    double step;
+    
+    RangeIterator(double start, double end, double step) : current(start), end(end), step(step) {}
+    
+    bool next(Value& value) override {
+        if (step > 0 ? current >= end : current <= end) return false;
+        value = current;
+        current += step;
+        return true;
+    }
+    
+    std::string toString() const override {
+        return "<range>";
+    }
+};
+
+struct LineIterator : Iterator {
+    FluxString contents;
+    size_t position = 0;
+    
+    explicit LineIterator(FluxString contents) : contents(std::move(contents)) {}
+    
+    bool next(Value& value) override {
+        std::string_view text = contents.view();
+        if (position >= text.size()) return false;
+        
+        size_t end = text.find('\n', position);
+        if (end == std::string_view::npos) end = text.size();
+        size_t length = end - position;
+        if (length > 0 && text[end - 1] == '\r') length--;
+        value = contents.slice(position, length);
+        position = end + 1;
+        return true;
+    }
+    
+    std::string toString() const override {
+        return "<lines>";
+    }
+};
+
+// Formats a number the way the interpreter's ostream does: %g, 6 digits
+std::string formatNumber(double value) {
+    char buffer[32];
+    int length = std::snprintf(buffer, sizeof(buffer), "%g", value);
+    return std::string(buffer, static_cast<size_t>(length));
+}
+
+}
+
+void fail(const std::string& message) {
+    throw std::runtime_error(message);
+}
+
+void operandsError(const char* op) {
+    fail(std::string("Operands must be numbers for ") + op);
+}
+
+void operandError(const char* op) {
+    fail(std::string("Operand must be a number for ") + op);
+}
+
+void Global::undefined() const {
+    fail("Undefined variable '" + std::string(name) + "'");
+}
+
+Value function(std::string name, int arity, Code code) {
+    return std::make_shared<Function>(Function{std::move(name), arity, false, std::move(code)});
+}
+
+Value native(std::string name, int arity, Value (*code)(const Value*, size_t)) {
+    return std::make_shared<Function>(Function{std::move(name), arity, true, code});
+}
+
+Value array(std::initializer_list<Value> elements) {
+    return std::make_shared<Array>(Array{std::vector<Value>(elements)});
+}
+
+namespace {
+
+// open holds the arrays being printed around this one, so a cycle prints as [...]
+std::string stringify(const Value& value, std::vector<const Array*>& open) {
+    if (std::holds_alternative<std::nullptr_t>(value)) {
+        return "nil";
+    }
+    if (auto str = std::get_if<FluxString>(&value)) {
+        return str->str();
+    }
+    if (auto num = std::get_if<double>(&value)) {
+        return formatNumber(*num);
+    }
+    if (auto b = std::get_if<bool>(&value)) {
+        return *b ? "true" : "false";
+    }
+    if (auto fn = std::get_if<std::shared_ptr<Function>>(&value)) {
+        return ((*fn)->native ? "<native fn " : "<fn ") + (*fn)->name + ">";
+    }
+    if (auto iterator = std::get_if<std::shared_ptr<Iterator>>(&value)) {
+        return (*iterator)->toString();
+    }
+    if (auto array = std::get_if<std::shared_ptr<Array>>(&value)) {
+        if (std::find(open.begin(), open.end(), array->get()) != open.end()) return "[...]";
+        open.push_back(array->get());
+        std::string result = "[";
+        for (size_t i = 0; i < (*array)->elements.size(); i++) {
+            if (i > 0) result += ", ";
+            result += stringify((*array)->elements[i], open);
+        }
+        open.pop_back();
+        return result + "]";
+    }
+    return "unknown";
+}
+
+}
+
+std::string stringify(const Value& value) {
+    std::vector<const Array*> open;
+    return stringify(value, open);
+}
+
+void print(const Value& value) {
+    if (auto str = std::get_if<FluxString>(&value)) {
+        std::cout << *str << '\n';
+    } else {
+        std::cout << stringify(value) << '\n';
+    }
+}
+
+void print(double value) {
+    std::cout << formatNumber(value) << '\n';
+}
+
+Value concatenate(const Value& left, const Value& right) {
+    auto leftString = std::get_if<FluxString>(&left);
+    auto rightString = std::get_if<FluxString>(&right);
+    if (leftString && rightString) {
+        return FluxString::concat(leftString->view(), rightString->view());
+    }
+    if (leftString) {
+        return FluxString::concat(leftString->view(), stringify(right));
+    }
+    return FluxString::concat(stringify(left), rightString->view());
+}
+
+Value index(const Value& object, const Value& position) {
+    auto array = std::get_if<std::shared_ptr<Array>>(&object);
+    if (!array) {
+        fail("Can only index arrays");
+    }
+    if (!isNumber(position)) operandError("[]");
+    
+    double at = number(position);
+    const auto& elements = (*array)->elements;
+    if (at < 0 || at >= elements.size() || at != std::floor(at)) {
+        fail("Array index out of range: " + stringify(position));
+    }
+    return elements[static_cast<size_t>(at)];
+}
+
+Value call(std::initializer_list<Value> calleeAndArguments) {
+    const Value& callee = *calleeAndArguments.begin();
+    auto fn = std::get_if<std::shared_ptr<Function>>(&callee);
+    if (!fn) {
+        fail("Can only call functions");
+    }
+    
+    size_t count = calleeAndArguments.size() - 1;
+    int arity = (*fn)->arity;
+    if (arity >= 0 && count != static_cast<size_t>(arity)) {
+        fail("Expected " + std::to_string(arity) + " arguments but got " + std::to_string(count));
+    }
+    return (*fn)->code(calleeAndArguments.begin() + 1, count);
+}
+
+std::shared_ptr<Iterator> iterate(const Value& iterable) {
+    if (auto iterator = std::get_if<std::shared_ptr<Iterator>>(&iterable)) {
+        return *iterator;
+    }
+    if (auto array = std::get_if<std::shared_ptr<Array>>(&iterable)) {
+        return std::make_shared<ArrayIterator>(*array);
+    }
+    fail("Can only iterate over arrays and generators");
+}
+
+void rangeArguments(const Value* args, size_t count, double& start, double& end, double& step) {
+    if (count == 0 || count > 3) {
+        fail("range() takes 1 to 3 arguments");
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (!isNumber(args[i])) {
+            fail("range() requires number arguments");
+        }
+    }
+    
+    start = count > 1 ? number(args[0]) : 0;
+    end = number(args[count > 1 ? 1 : 0]);
+    step = count > 2 ? number(args[2]) : 1;
+    checkStep(step);
+}
+
+void checkStep(double step) {
+    if (step == 0) {
+        fail("range() step cannot be zero");
+    }
+}
+
+size_t MemoTable::Hash::operator()(const std::vector<Value>& arguments) const {
+    size_t seed = arguments.size();
+    for (const auto& arg : arguments) {
+        size_t h = 0;
+        if (auto num = std::get_if<double>(&arg)) {
+            h = std::hash<double>()(*num);
+        } else if (auto str = std::get_if<FluxString>(&arg)) {
+            h = str->hash();
+        } else if (auto b = std::get_if<bool>(&arg)) {
+            h = *b ? 0x9e37 : 0x79b9;
+        }
+        seed ^= h + 0x9e3779b97f4a7c15ULL + (seed << 6) + (seed >> 2);
+    }
+    return seed;
+}
+
+bool MemoTable::cacheable(const std::vector<Value>& arguments) {
+    for (const auto& arg : arguments) {
+        if (arg.index() >= 4) return false;
+    }
+    return true;
+}
+
+namespace natives {
+
+Value clock(const Value*, size_t) {
+    auto now = std::chrono::high_resolution_clock::now();
+    auto time = std::chrono::duration_cast<std::chrono::milliseconds>(now.time_since_epoch());
+    return static_cast<double>(time.count()) / 1000.0;
+}
+
+Value sqrt(const Value* args, size_t) {
+    if (!isNumber(args[0])) fail("sqrt() requires a number argument");
+    return std::sqrt(number(args[0]));
+}
+
+Value abs(const Value* args, size_t) {
+    if (!isNumber(args[0])) fail("abs() requires a number argument");
+    return std::abs(number(args[0]));
+}
+
+Value len(const Value* args, size_t) {
+    if (auto array = std::get_if<std::shared_ptr<Array>>(&args[0])) {
+        return static_cast<double>((*array)->elements.size());
+    }
+    if (auto str = std::get_if<FluxString>(&args[0])) {
+        return static_cast<double>(str->size());
+    }
+    fail("len() requires an array or string argument");
+}
+
+Value push(const Value* args, size_t) {
+    if (auto array = std::get_if<std::shared_ptr<Array>>(&args[0])) {
+        (*array)->elements.push_back(args[1]);
+        return args[0];
+    }
+    fail("push() requires an array as first argument");
+}
+
+Value range(const Value* args, size_t count) {
+    double start, end, step;
+    rangeArguments(args, count, start, end, step);
+    return std::make_shared<RangeIterator>(start, end, step);
+}
+
+Value read_file(const Value* args, size_t) {
+    auto path = std::get_if<FluxString>(&args[0]);
+    if (!path) {
+        fail("read_file() requires a path string");
+    }
+    auto file = MappedFile::open(path->str());
+    return FluxString::external(file->data(), file->size(), file);
+}
+
+Value read_lines(const Value* args, size_t) {
+    auto path = std::get_if<FluxString>(&args[0]);
+    if (!path) {
+        fail("read_lines() requires a path string");
+    }
+    auto file = MappedFile::open(path->str());
+    return std::make_shared<LineIterator>(FluxString::external(file->data(), file->size(), file));
+}
+
+Value split_fields(const Value* args, size_t count) {
+    auto line = count == 0 ? nullptr : std::get_if<FluxString>(&args[0]);
+    auto separator = count == 2 ? std::get_if<FluxString>(&args[1]) : nullptr;
+    if (!line || count > 2 || (count == 2 && (!separator || separator->empty()))) {
+        fail("split_fields() requires a string and an optional non-empty separator");
+    }
+    
+    std::string_view text = line->view();
+    auto fields = std::make_shared<Array>();
+    if (separator) {
+        std::string_view delimiter = separator->view();
+        size_t start = 0;
+        while (true) {
+            size_t end = text.find(delimiter, start);
+            if (end == std::string_view::npos) break;
+            fields->elements.push_back(line->slice(start, end - start));
+            start = end + delimiter.size();
+        }
+        fields->elements.push_back(line->slice(start, text.size() - start));
+    } else {
+        size_t start = text.find_first_not_of(" \t");
+        while (start != std::string_view::npos) {
+            size_t end = text.find_first_of(" \t", start);
+            if (end == std::string_view::npos) end = text.size();
+            fields->elements.push_back(line->slice(start, end - start));
+            start = text.find_first_not_of(" \t", end);
+        }
+    }
+    return fields;
+}
+
+// Compiled programs have no worker threads, so the map runs in order on the
+// calling thread; the results are the same for the pure functions it accepts
+Value parallel_map(const Value* args, size_t) {
+    auto fn = std::get_if<std::shared_ptr<Function>>(&args[0]);
+    auto array = std::get_if<std::shared_ptr<Array>>(&args[1]);
+    if (!fn || !array) {
+        fail("parallel_map() requires a function and an array");
+    }
+    if ((*fn)->arity != 1) {
+        fail("parallel_map() requires a function of one argument");
+    }
+    
+    auto results = std::make_shared<Array>();
+    results->elements.reserve((*array)->elements.size());
+    for (const auto& element : (*array)->elements) {
+        results->elements.push_back((*fn)->code(&element, 1));
+    }
+    return results;
+}
+
+}
+
+uintptr_t CallScope::floor = 0;
+
+int run(void (*program)()) {
+    std::ios::sync_with_stdio(false);
+    // Sets the base the stack budget is measured from; nothing is charged
+    MemoryScope scope(nullptr);
+    CallScope::floor = MemoryAccount::stackFloor();
+    try {
+        program();
+    } catch (const std::exception& e) {
+        std::cerr << "Runtime error: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+}
@@ -0,0 +1,270 @@
+#pragma once
+#include <atomic>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <initializer_list>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <variant>
+#include <vector>
+#include "fluxstring.h"
+#include "memory.h"
+
+// Runtime for programs compiled by `flux --emit-cpp`. The generated code
+// calls these helpers for everything it can't prove the types of; values,
+// truthiness, equality, printing and error messages all match the
+// interpreter. Link the generated file with libfluxrt.a (`make runtime`).
+namespace flux {
+
+struct Function;
+struct Array;
+struct Iterator;
+
+// Same alternatives in the same order as the interpreter's FluxValue
+using Value = std::variant<double, FluxString, bool, std::nullptr_t, std::shared_ptr<Function>,
+                           std::shared_ptr<Array>, std::shared_ptr<Iterator>>;
+
+// Natives and compiled functions share one calling convention: a pointer to
+// count arguments, already checked against the arity
+using Code = std::function<Value(const Value* args, size_t count)>;
+
+struct Function {
+    std::string name;
+    int arity;  // -1 takes any number of arguments
+    bool native;
+    Code code;
+};
+
+struct Array {
+    std::vector<Value> elements;
+};
+
+// Source of values for `for x in ...` loops
+struct Iterator {
+    virtual ~Iterator() = default;
+    virtual bool next(Value& value) = 0;
+    virtual std::string toString() const = 0;
+};
+
+[[noreturn]] void fail(const std::string& message);
+
+Value function(std::string name, int arity, Code code);
+Value native(std::string name, int arity, Value (*code)(const Value*, size_t));
+Value array(std::initializer_list<Value> elements);
+
+std::string stringify(const Value& value);
+void print(const Value& value);
+void print(double value);
+
+// A global variable. Reading or assigning one before its declaration has run
+// is an error, as it is in the interpreter.
+class Global {
+public:
+    explicit Global(const char* name) : name(name), defined(false) {}
+    Global(const char* name, Value value) : name(name), value(std::move(value)), defined(true) {}
+    
+    const Value& get() const {
+        if (!defined) undefined();
+        return value;
+    }
+    
+    const Value& set(Value next) {
+        if (!defined) undefined();
+        return value = std::move(next);
+    }
+    
+    void define(Value initial) {
+        value = std::move(initial);
+        defined = true;
+    }
+    
+    // Checks the global is declared before a direct call to the function it holds
+    void require() const {
+        if (!defined) undefined();
+    }
+
+private:
+    const char* name;
+    Value value;
+    bool defined;
+    
+    [[noreturn]] void undefined() const;
+};
+
+inline bool isNumber(const Value& value) {
+    return value.index() == 0;
+}
+
+inline double number(const Value& value) {
+    return *std::get_if<double>(&value);
+}
+
+inline bool truthy(const Value& value) {
+    if (std::holds_alternative<std::nullptr_t>(value)) return false;
+    if (auto b = std::get_if<bool>(&value)) return *b;
+    return true;
+}
+
+inline bool equal(const Value& left, const Value& right) {
+    return left == right;
+}
+
+Value concatenate(const Value& left, const Value& right);
+[[noreturn]] void operandsError(const char* op);
+[[noreturn]] void operandError(const char* op);
+
+inline Value add(const Value& left, const Value& right) {
+    if (isNumber(left) && isNumber(right)) return number(left) + number(right);
+    if (std::holds_alternative<FluxString>(left) || std::holds_alternative<FluxString>(right)) {
+        return concatenate(left, right);
+    }
+    fail("Operands must be two numbers or include a string");
+}
+
+inline double divideNumbers(double left, double right) {
+    if (right == 0) fail("Division by zero");
+    return left / right;
+}
+
+#define FLUX_NUMBER_OPERATOR(name, op, expression)                            \
+    inline Value name(const Value& left, const Value& right) {               \
+        if (!isNumber(left) || !isNumber(right)) operandsError(op);          \
+        double l = number(left), r = number(right);                           \
+        return expression;                                                    \
+    }
+
+FLUX_NUMBER_OPERATOR(subtract, "-", l - r)
+FLUX_NUMBER_OPERATOR(multiply, "*", l * r)
+FLUX_NUMBER_OPERATOR(divide, "/", divideNumbers(l, r))
+FLUX_NUMBER_OPERATOR(modulo, "%", std::fmod(l, r))
+FLUX_NUMBER_OPERATOR(greater, ">", l > r)
+FLUX_NUMBER_OPERATOR(greaterEqual, ">=", l >= r)
+FLUX_NUMBER_OPERATOR(less, "<", l < r)
+FLUX_NUMBER_OPERATOR(lessEqual, "<=", l <= r)
+
+#undef FLUX_NUMBER_OPERATOR
+
+inline Value notEqual(const Value& left, const Value& right) {
+    return !equal(left, right);
+}
+
+inline Value isEqual(const Value& left, const Value& right) {
+    return equal(left, right);
+}
+
+inline Value negate(const Value& operand) {
+    if (!isNumber(operand)) operandError("-");
+    return -number(operand);
+}
+
+// `and` and `or` return an operand, and only evaluate the right one if needed
+template <typename Right>
+Value logicalAnd(Value left, Right right) {
+    return truthy(left) ? right() : left;
+}
+
+template <typename Right>
+Value logicalOr(Value left, Right right) {
+    return truthy(left) ? left : right();
+}
+
+Value index(const Value& object, const Value& position);
+
+// Calls a value with arguments; the callee comes first in the list, so it is
+// evaluated before the arguments, as in the interpreter
+Value call(std::initializer_list<Value> calleeAndArguments);
+
+// Function arguments are evaluated in no particular order in C++, but the
+// elements of a braced list are evaluated left to right. Operands that can
+// have side effects are passed to their operation through one.
+template <typename Operation, size_t N, size_t... I>
+Value orderedCall(Operation& operation, Value (&arguments)[N], std::index_sequence<I...>) {
+    return operation(std::move(arguments[I])...);
+}
+
+template <typename Operation, size_t N>
+Value ordered(Operation&& operation, Value (&&arguments)[N]) {
+    return orderedCall(operation, arguments, std::make_index_sequence<N>());
+}
+
+// Calls a native directly, skipping the lookup of its global
+inline Value callNative(Value (*native)(const Value*, size_t), std::initializer_list<Value> arguments) {
+    return native(arguments.begin(), arguments.size());
+}
+
+// Iterates an array or iterator value
+std::shared_ptr<Iterator> iterate(const Value& iterable);
+
+// The bounds of range(...), checked as the interpreter checks them
+void rangeArguments(const Value* args, size_t count, double& start, double& end, double& step);
+
+void checkStep(double step);
+
+// Results of a `memo` function by argument value. Calls with an argument that
+// can't be a key, like an array, are not cached, and neither are results a
+// caller could change or use up, like arrays and iterators.
+class MemoTable {
+public:
+    template <typename Compute>
+    Value call(std::vector<Value> arguments, Compute compute) {
+        if (!cacheable(arguments)) return compute();
+        auto found = entries.find(arguments);
+        if (found != entries.end()) return found->second;
+        Value result = compute();
+        if (result.index() < 4) entries.emplace(std::move(arguments), result);
+        return result;
+    }
+
+private:
+    struct Hash {
+        size_t operator()(const std::vector<Value>& arguments) const;
+    };
+    
+    std::unordered_map<std::vector<Value>, Value, Hash> entries;
+    
+    static bool cacheable(const std::vector<Value>& arguments);
+};
+
+// The interpreter's built-in functions
+namespace natives {
+Value clock(const Value* args, size_t count);
+Value sqrt(const Value* args, size_t count);
+Value abs(const Value* args, size_t count);
+Value len(const Value* args, size_t count);
+Value push(const Value* args, size_t count);
+Value range(const Value* args, size_t count);
+Value read_file(const Value* args, size_t count);
+Value read_lines(const Value* args, size_t count);
+Value split_fields(const Value* args, size_t count);
+Value parallel_map(const Value* args, size_t count);
+}
+
+// Opens the body of every compiled function, so recursion deep enough to use
+// up the stack fails as it does in the interpreter: "Stack limit of N bytes
+// exceeded". The fence on the way out keeps a recursive call out of tail
+// position, where the C++ compiler could turn it into a loop that never fails.
+// Compiled programs run on one thread, whose stack floor run() records.
+class CallScope {
+public:
+    CallScope() {
+        char here;
+        if (reinterpret_cast<uintptr_t>(&here) < floor) MemoryAccount::checkStack();
+    }
+    ~CallScope() { std::atomic_signal_fence(std::memory_order_seq_cst); }
+    
+    CallScope(const CallScope&) = delete;
+    CallScope& operator=(const CallScope&) = delete;
+    
+    static uintptr_t floor;
+};
+
+// Runs a compiled program's top level, reporting a runtime error the way the
+// interpreter does; returns the process exit status
+int run(void (*program)());
+
+}
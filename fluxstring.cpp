@@ -0,0 +1,186 @@
+#include "fluxstring.h"
+#include "memory.h"
+#include <cstring>
+#include <functional>
+#include <new>
+
+FluxString::FluxString() noexcept {
+    storage[0] = '\0';
+    storage[InlineCapacity + 1] = 0;
+}
+
+FluxString::FluxString(std::string_view text) {
+    if (text.size() <= InlineCapacity) {
+        std::memcpy(storage, text.data(), text.size());
+        storage[text.size()] = '\0';
+        storage[InlineCapacity + 1] = static_cast<char>(text.size());
+        return;
+    }
+    
+    Heap* block = allocate(text.size());
+    std::memcpy(block->data, text.data(), text.size());
+    setHeap(block);
+}
+
+FluxString::FluxString(const FluxString& other) noexcept {
+    std::memcpy(storage, other.storage, sizeof(storage));
+    if (isHeap()) heap()->refs.fetch_add(1, std::memory_order_relaxed);
+}
+
+FluxString::FluxString(FluxString&& other) noexcept {
+    std::memcpy(storage, other.storage, sizeof(storage));
+    other.storage[0] = '\0';
+    other.storage[InlineCapacity + 1] = 0;
+}
+
+FluxString& FluxString::operator=(const FluxString& other) noexcept {
+    if (this != &other) {
+        if (other.isHeap()) other.heap()->refs.fetch_add(1, std::memory_order_relaxed);
+        release();
+        std::memcpy(storage, other.storage, sizeof(storage));
+    }
+    return *this;
+}
+
+FluxString& FluxString::operator=(FluxString&& other) noexcept {
+    if (this != &other) {
+        release();
+        std::memcpy(storage, other.storage, sizeof(storage));
+        other.storage[0] = '\0';
+        other.storage[InlineCapacity + 1] = 0;
+    }
+    return *this;
+}
+
+FluxString::~FluxString() {
+    release();
+}
+
+FluxString FluxString::concat(std::string_view left, std::string_view right) {
+    size_t size = left.size() + right.size();
+    if (size <= InlineCapacity) {
+        char buffer[InlineCapacity];
+        std::memcpy(buffer, left.data(), left.size());
+        std::memcpy(buffer + left.size(), right.data(), right.size());
+        return FluxString(std::string_view(buffer, size));
+    }
+    
+    FluxString result;
+    Heap* block = allocate(size);
+    std::memcpy(block->data, left.data(), left.size());
+    std::memcpy(block->data + left.size(), right.data(), right.size());
+    result.setHeap(block);
+    return result;
+}
+
+FluxString FluxString::external(const char* chars, size_t size, std::shared_ptr<const void> owner) {
+    if (size <= InlineCapacity) return FluxString(std::string_view(chars, size));
+    
+    FluxString result;
+    Heap* block = allocate(0);
+    block->size = size;
+    block->chars = chars;
+    block->owner = std::move(owner);
+    result.setHeap(block);
+    return result;
+}
+
+FluxString FluxString::slice(size_t offset, size_t length) const {
+    std::string_view characters = view().substr(offset, length);
+    if (characters.size() <= InlineCapacity || characters.size() == size()) {
+        return characters.size() == size() ? *this : FluxString(characters);
+    }
+    
+    FluxString result;
+    Heap* block = allocate(0);
+    Heap* parent = heap();
+    parent->refs.fetch_add(1, std::memory_order_relaxed);
+    block->size = characters.size();
+    block->chars = characters.data();
+    block->parent = parent;
+    result.setHeap(block);
+    return result;
+}
+
+const char* FluxString::data() const noexcept {
+    return isHeap() ? heap()->chars : storage;
+}
+
+size_t FluxString::size() const noexcept {
+    return isHeap() ? heap()->size : static_cast<unsigned char>(storage[InlineCapacity + 1]);
+}
+
+size_t FluxString::hash() const noexcept {
+    if (!isHeap()) return std::hash<std::string_view>()(view());
+    
+    // Computed on demand so views of large files aren't read just to be made
+    Heap* block = heap();
+    size_t hash = block->hash.load(std::memory_order_relaxed);
+    if (hash == 0) {
+        hash = std::hash<std::string_view>()(view());
+        block->hash.store(hash, std::memory_order_relaxed);
+    }
+    return hash;
+}
+
+bool operator==(const FluxString& left, const FluxString& right) noexcept {
+    if (left.isHeap() && right.isHeap()) {
+        FluxString::Heap* a = left.heap();
+        FluxString::Heap* b = right.heap();
+        if (a == b) return true;
+        if (a->size != b->size) return false;
+        size_t hashA = a->hash.load(std::memory_order_relaxed);
+        size_t hashB = b->hash.load(std::memory_order_relaxed);
+        if (hashA && hashB && hashA != hashB) return false;
+        return std::memcmp(a->chars, b->chars, a->size) == 0;
+    }
+    return left.view() == right.view();
+}
+
+FluxString::Heap* FluxString::heap() const noexcept {
+    Heap* block;
+    std::memcpy(&block, storage, sizeof(block));
+    return block;
+}
+
+void FluxString::setHeap(Heap* block) noexcept {
+    std::memcpy(storage, &block, sizeof(block));
+    storage[InlineCapacity + 1] = static_cast<char>(HeapTag);
+}
+
+// Charged to the context building the string, if any, and credited back to
+// the same one however long the string outlives it
+FluxString::Heap* FluxString::allocate(size_t size) {
+    const std::shared_ptr<MemoryAccount>& account = MemoryAccount::active();
+    if (account) account->charge(sizeof(Heap) + size);
+    void* memory;
+    try {
+        memory = ::operator new(sizeof(Heap) + size);
+    } catch (...) {
+        if (account) account->release(sizeof(Heap) + size);
+        throw;
+    }
+    Heap* block = new (memory) Heap{{1}, {0}, size, nullptr, nullptr, nullptr, account, {}};
+    block->chars = block->data;
+    return block;
+}
+
+void FluxString::release(Heap* block) noexcept {
+    // Parents are released iteratively, so long chains of slices can't overflow the stack
+    while (block && block->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        Heap* parent = block->parent;
+        std::shared_ptr<MemoryAccount> account = std::move(block->account);
+        if (account) account->release(sizeof(Heap) + (block->chars == block->data ? block->size : 0));
+        block->~Heap();
+        ::operator delete(block);
+        block = parent;
+    }
+}
+
+void FluxString::release() noexcept {
+    if (isHeap()) release(heap());
+}
+
+std::ostream& operator<<(std::ostream& out, const FluxString& string) {
+    return out.write(string.data(), static_cast<std::streamsize>(string.size()));
+}
@@ -0,0 +1,83 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <string_view>
+
+class MemoryAccount;
+
+// Immutable string value. Strings of up to 22 bytes live inline in the
+// object; longer ones share one refcounted heap block that also caches the
+// hash. Either way copying a FluxString never copies characters beyond the
+// inline buffer, so passing, returning and storing strings is O(1).
+//
+// A heap block may also view characters it doesn't own: a slice of another
+// string, which keeps that string's block alive, or a range of external
+// memory such as a mapped file, kept alive by a shared owner. The characters
+// are therefore not NUL-terminated.
+class FluxString {
+public:
+    static constexpr size_t InlineCapacity = 22;
+    
+    FluxString() noexcept;
+    FluxString(std::string_view text);
+    FluxString(const std::string& text) : FluxString(std::string_view(text)) {}
+    FluxString(const char* text) : FluxString(std::string_view(text)) {}
+    FluxString(const FluxString& other) noexcept;
+    FluxString(FluxString&& other) noexcept;
+    FluxString& operator=(const FluxString& other) noexcept;
+    FluxString& operator=(FluxString&& other) noexcept;
+    ~FluxString();
+    
+    // Builds left + right with a single allocation
+    static FluxString concat(std::string_view left, std::string_view right);
+    // Views size characters at chars, which owner keeps valid
+    static FluxString external(const char* chars, size_t size, std::shared_ptr<const void> owner);
+    
+    // The characters [offset, offset + length), sharing this string's storage
+    // unless they fit inline
+    FluxString slice(size_t offset, size_t length) const;
+    
+    const char* data() const noexcept;
+    size_t size() const noexcept;
+    bool empty() const noexcept { return size() == 0; }
+    std::string_view view() const noexcept { return std::string_view(data(), size()); }
+    std::string str() const { return std::string(view()); }
+    size_t hash() const noexcept;
+    
+    friend bool operator==(const FluxString& left, const FluxString& right) noexcept;
+    friend bool operator!=(const FluxString& left, const FluxString& right) noexcept { return !(left == right); }
+    
+private:
+    struct Heap {
+        std::atomic<size_t> refs;
+        std::atomic<size_t> hash;  // 0 until first asked for
+        size_t size;
+        const char* chars;         // data, or characters of parent or owner
+        Heap* parent;              // block this one slices, or nullptr
+        std::shared_ptr<const void> owner;
+        std::shared_ptr<MemoryAccount> account;  // charged for the block, or nullptr
+        char data[1];
+    };
+    
+    // Inline: the characters, a NUL, and the length in the last byte.
+    // Heap: a Heap* at the start and HeapTag in the last byte.
+    static constexpr unsigned char HeapTag = 0xFF;
+    alignas(Heap*) char storage[InlineCapacity + 2];
+    
+    bool isHeap() const noexcept { return static_cast<unsigned char>(storage[InlineCapacity + 1]) == HeapTag; }
+    Heap* heap() const noexcept;
+    void setHeap(Heap* block) noexcept;
+    static Heap* allocate(size_t size);
+    static void release(Heap* block) noexcept;
+    void release() noexcept;
+};
+
+std::ostream& operator<<(std::ostream& out, const FluxString& string);
+
+template <>
+struct std::hash<FluxString> {
+    size_t operator()(const FluxString& string) const noexcept { return string.hash(); }
+};
@@ -0,0 +1,213 @@
+#include "heapprofile.h"
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <random>
+#include <unordered_map>
+
+namespace {
+
+// Encodes the few protobuf wire types profile.proto uses
+class ProtoWriter {
+public:
+    void varint(uint64_t value) {
+        while (value >= 0x80) {
+            bytes.push_back(static_cast<char>(value | 0x80));
+            value >>= 7;
+        }
+        bytes.push_back(static_cast<char>(value));
+    }
+    
+    void integer(int field, uint64_t value) {
+        if (value == 0) return;  // the default, which proto3 leaves out
+        varint(static_cast<uint64_t>(field) << 3);
+        varint(value);
+    }
+    
+    void text(int field, const std::string& value) {
+        varint(static_cast<uint64_t>(field) << 3 | 2);
+        varint(value.size());
+        bytes += value;
+    }
+    
+    void message(int field, const ProtoWriter& value) { text(field, value.bytes); }
+    
+    void packed(int field, const std::vector<uint64_t>& values) {
+        ProtoWriter body;
+        for (uint64_t value : values) {
+            body.varint(value);
+        }
+        message(field, body);
+    }
+    
+    std::string bytes;
+};
+
+// Indexes into the profile's string table, which starts with ""
+class StringTable {
+public:
+    StringTable() { index(""); }
+    
+    uint64_t index(const std::string& text) {
+        auto found = indices.find(text);
+        if (found != indices.end()) return found->second;
+        indices.emplace(text, strings.size());
+        strings.push_back(text);
+        return strings.size() - 1;
+    }
+    
+    std::vector<std::string> strings;
+    
+private:
+    std::unordered_map<std::string, uint64_t> indices;
+};
+
+struct Sampler {
+    std::minstd_rand random{std::random_device{}()};
+    int64_t remaining = -1;  // bytes until the next sample, drawn on first use
+    
+    int64_t next(uint64_t rate) {
+        std::exponential_distribution<double> interval(1.0 / static_cast<double>(rate));
+        return static_cast<int64_t>(interval(random));
+    }
+};
+
+Sampler& threadSampler() {
+    thread_local Sampler sampler;
+    return sampler;
+}
+
+uint64_t nanosecondsSinceEpoch() {
+    auto elapsed = std::chrono::system_clock::now().time_since_epoch();
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+}
+
+const std::string unattributed = "[native]";
+
+}
+
+std::atomic<bool> HeapProfiler::active{false};
+std::string HeapProfiler::outputPath;
+uint64_t HeapProfiler::sampleRate = HeapProfiler::DefaultRate;
+uint64_t HeapProfiler::startTime = 0;
+std::mutex HeapProfiler::sitesMutex;
+std::map<HeapProfiler::Site, HeapProfiler::Totals> HeapProfiler::sites;
+
+void HeapProfiler::start(const std::string& path, uint64_t rate) {
+    outputPath = path;
+    sampleRate = rate > 0 ? rate : 1;
+    startTime = nanosecondsSinceEpoch();
+    active.store(true, std::memory_order_relaxed);
+}
+
+SourceStack& HeapProfiler::stack() {
+    thread_local SourceStack frames;
+    return frames;
+}
+
+void HeapProfiler::allocated(size_t bytes) {
+    Sampler& sampler = threadSampler();
+    if (sampler.remaining < 0) sampler.remaining = sampler.next(sampleRate);
+    sampler.remaining -= static_cast<int64_t>(bytes);
+    if (sampler.remaining >= 0) return;
+    sampler.remaining = sampler.next(sampleRate);
+    record(bytes);
+}
+
+void HeapProfiler::record(size_t bytes) {
+    Site site;
+    const SourceStack& frames = stack();
+    for (auto frame = frames.rbegin(); frame != frames.rend(); ++frame) {
+        site.push_back({*frame->function, *frame->file, frame->line});
+    }
+    if (site.empty()) site.push_back({unattributed, "", 0});
+    
+    // An allocation of n bytes is sampled with probability 1 - e^(-n/rate)
+    double chance = 1 - std::exp(-static_cast<double>(bytes) / static_cast<double>(sampleRate));
+    double weight = chance > 0 ? 1 / chance : 1;
+    
+    std::lock_guard<std::mutex> lock(sitesMutex);
+    Totals& totals = sites[site];
+    totals.objects += weight;
+    totals.bytes += weight * static_cast<double>(bytes);
+}
+
+bool HeapProfiler::finish() {
+    if (!enabled()) return true;
+    active.store(false, std::memory_order_relaxed);
+    
+    std::lock_guard<std::mutex> lock(sitesMutex);
+    StringTable strings;
+    ProtoWriter profile;
+    
+    // Field numbers are those of perftools.profiles.Profile
+    auto valueType = [&](int field, const char* type, const char* unit) {
+        ProtoWriter value;
+        value.integer(1, strings.index(type));
+        value.integer(2, strings.index(unit));
+        profile.message(field, value);
+    };
+    valueType(1, "alloc_objects", "count");
+    valueType(1, "alloc_space", "bytes");
+    
+    // Every distinct (function, file, line) is a location of its own, since
+    // Flux has no addresses; ids start at 1
+    std::map<std::pair<std::string, std::string>, uint64_t> functions;
+    std::map<Location, uint64_t> locations;
+    for (const auto& [site, totals] : sites) {
+        std::vector<uint64_t> ids;
+        for (const auto& frame : site) {
+            auto found = locations.find(frame);
+            if (found == locations.end()) {
+                found = locations.emplace(frame, locations.size() + 1).first;
+            }
+            ids.push_back(found->second);
+            functions.emplace(std::make_pair(frame.function, frame.file), functions.size() + 1);
+        }
+        
+        ProtoWriter sample;
+        sample.packed(1, ids);
+        sample.packed(2, {static_cast<uint64_t>(std::llround(totals.objects)),
+                          static_cast<uint64_t>(std::llround(totals.bytes))});
+        profile.message(2, sample);
+    }
+    
+    for (const auto& [frame, id] : locations) {
+        ProtoWriter line;
+        line.integer(1, functions[{frame.function, frame.file}]);
+        line.integer(2, static_cast<uint64_t>(frame.line));
+        ProtoWriter location;
+        location.integer(1, id);
+        location.message(4, line);
+        profile.message(4, location);
+    }
+    
+    for (const auto& [function, id] : functions) {
+        ProtoWriter entry;
+        entry.integer(1, id);
+        entry.integer(2, strings.index(function.first));
+        entry.integer(3, strings.index(function.first));
+        entry.integer(4, strings.index(function.second));
+        profile.message(5, entry);
+    }
+    
+    uint64_t now = nanosecondsSinceEpoch();
+    uint64_t defaultType = strings.index("alloc_space");
+    ProtoWriter periodType;
+    periodType.integer(1, strings.index("space"));
+    periodType.integer(2, strings.index("bytes"));
+    
+    for (const auto& text : strings.strings) {
+        profile.text(6, text);
+    }
+    profile.integer(9, startTime);
+    profile.integer(10, now - startTime);
+    profile.message(11, periodType);
+    profile.integer(12, sampleRate);
+    profile.integer(14, defaultType);
+    
+    std::ofstream out(outputPath, std::ios::binary);
+    if (!out.is_open()) return false;
+    out << profile.bytes;
+    return static_cast<bool>(out);
+}
@@ -0,0 +1,96 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+// One Flux call in progress, as the heap profiler sees it
+struct SourceFrame {
+    const std::string* function;  // owned by the declaration, which outlives the call
+    const std::string* file;      // likewise
+    int line;                     // of the statement running in the call
+};
+
+using SourceStack = std::vector<SourceFrame>;
+
+// Samples the bytes charged to MemoryAccounts and attributes them to the
+// Flux call stack and source line that allocated them. About one allocation
+// is sampled per rate bytes, at exponentially distributed intervals as in
+// tcmalloc and Go, and each sample is scaled up by the inverse of its
+// chance of being taken, so the totals estimate everything allocated.
+// finish() writes the totals as an uncompressed pprof profile
+// (profile.proto), with alloc_objects and alloc_space sample types.
+//
+// Each thread keeps its own call stack, which the interpreter updates only
+// while profiling is on; a Fiber carries its own and swaps it in.
+class HeapProfiler {
+public:
+    static constexpr uint64_t DefaultRate = 512 << 10;
+    
+    static void start(const std::string& path, uint64_t rate = DefaultRate);
+    // Writes the profile file; false if it couldn't be written
+    static bool finish();
+    
+    static bool enabled() { return active.load(std::memory_order_relaxed); }
+    
+    // Counts bytes charged on this thread towards the next sample
+    static void allocated(size_t bytes);
+    
+    // The Flux call stack of this thread, innermost call last
+    static SourceStack& stack();
+    static void atLine(int line) {
+        SourceStack& frames = stack();
+        if (line != 0 && !frames.empty()) frames.back().line = line;
+    }
+    
+private:
+    struct Totals {
+        double objects = 0;
+        double bytes = 0;
+    };
+    // A frame of a sampled call stack
+    struct Location {
+        std::string function;
+        std::string file;
+        int line;
+        
+        bool operator<(const Location& other) const {
+            return std::tie(function, file, line) < std::tie(other.function, other.file, other.line);
+        }
+    };
+    // A sampled call stack, innermost first
+    using Site = std::vector<Location>;
+    
+    static std::atomic<bool> active;
+    static std::string outputPath;
+    static uint64_t sampleRate;
+    static uint64_t startTime;  // ns since the epoch
+    static std::mutex sitesMutex;
+    static std::map<Site, Totals> sites;
+    
+    static void record(size_t bytes);
+};
+
+// Puts a call on this thread's SourceStack from construction to destruction
+// when heap profiling is on. The names must outlive the scope.
+class SourceFrameScope {
+public:
+    SourceFrameScope(const std::string& function, const std::string& file, int line)
+        : entered(HeapProfiler::enabled()) {
+        if (entered) HeapProfiler::stack().push_back({&function, &file, line});
+    }
+    ~SourceFrameScope() {
+        if (entered) HeapProfiler::stack().pop_back();
+    }
+    
+    SourceFrameScope(const SourceFrameScope&) = delete;
+    SourceFrameScope& operator=(const SourceFrameScope&) = delete;
+    
+private:
+    bool entered;
+};
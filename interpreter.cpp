@@ -1,13 +1,22 @@
 #include "interpreter.h"
+#include "fiber.h"
+#include "heapprofile.h"
+#include "mappedfile.h"
+#include "trace.h"
 #include <iostream>
 #include <stdexcept>
 #include <sstream>
 #include <cmath>
 #include <chrono>
+#include <thread>
+#include <algorithm>
+#include <filesystem>
 
 // Environment implementation
 Environment::Environment(std::shared_ptr<Environment> parent) : enclosing(parent) {}
 
+Environment::Environment(const Bindings& bindings) : values(bindings) {}
+
 void Environment::define(const std::string& name, FluxValue value) {
     values[name] = value;
 }
@@ -40,28 +49,140 @@ void Environment::assign(const std::string& name, FluxValue value) {
     throw std::runtime_error("Undefined variable '" + name + "'");
 }
 
+const Environment::Bindings& Environment::bindings() const {
+    return values;
+}
+
+void Environment::clear() {
+    values.clear();
+}
+
+FluxValue* Environment::lookupLocal(const std::string& name) {
+    auto it = values.find(name);
+    return it != values.end() ? &it->second : nullptr;
+}
+
+FluxValue* Environment::lookup(const std::string& name) {
+    for (Environment* scope = this; scope; scope = scope->enclosing.get()) {
+        if (FluxValue* value = scope->lookupLocal(name)) return value;
+    }
+    return nullptr;
+}
+
+// ArrayIterator implementation
+ArrayIterator::ArrayIterator(std::shared_ptr<FluxArray> arr) : array(arr), position(0) {}
+
+bool ArrayIterator::next(Interpreter&, FluxValue& value) {
+    if (position >= array->elements.size()) return false;
+    value = array->elements[position++];
+    return true;
+}
+
+std::string ArrayIterator::toString() const {
+    return "<array iterator>";
+}
+
+// RangeIterator implementation
+RangeIterator::RangeIterator(double start, double end, double step) : current(start), end(end), step(step) {}
+
+bool RangeIterator::next(Interpreter&, FluxValue& value) {
+    if (step > 0 ? current >= end : current <= end) return false;
+    value = current;
+    current += step;
+    return true;
+}
+
+std::string RangeIterator::toString() const {
+    return "<range>";
+}
+
+// LineIterator implementation
+LineIterator::LineIterator(FluxString contents) : contents(std::move(contents)), position(0) {}
+
+bool LineIterator::next(Interpreter&, FluxValue& value) {
+    std::string_view text = contents.view();
+    if (position >= text.size()) return false;
+    
+    size_t end = text.find('\n', position);
+    if (end == std::string_view::npos) end = text.size();
+    size_t length = end - position;
+    if (length > 0 && text[end - 1] == '\r') length--;
+    value = contents.slice(position, length);
+    position = end + 1;
+    return true;
+}
+
+std::string LineIterator::toString() const {
+    return "<lines>";
+}
+
+// FluxGenerator implementation
+FluxGenerator::FluxGenerator(FunctionDeclaration* decl, std::shared_ptr<Environment> environment)
+    : declaration(decl), running(false), finished(false) {
+    frames.push_back({decl->body.get(), environment, 0, nullptr});
+}
+
+bool FluxGenerator::next(Interpreter& interpreter, FluxValue& value) {
+    return interpreter.resumeGenerator(*this, value);
+}
+
+std::string FluxGenerator::toString() const {
+    return "<generator " + declaration->name + ">";
+}
+
 // FluxFunction implementation
-FluxFunction::FluxFunction(FunctionDeclaration* decl, std::shared_ptr<Environment> closure) 
-    : declaration(decl), closure(closure) {}
+FluxFunction::FluxFunction(FunctionDeclaration* decl, std::shared_ptr<Environment> closure,
+                           std::shared_ptr<MemoCache> memo)
+    : declaration(decl), closure(closure), memo(memo) {}
 
 int FluxFunction::arity() const {
     return declaration->parameters.size();
 }
 
 FluxValue FluxFunction::call(Interpreter& interpreter, const std::vector<FluxValue>& arguments) {
-    auto environment = std::make_shared<Environment>(closure);
+    MemoryAccount::checkStack();
+    interpreter.stats.functionCalls++;
+    CallDepthScope depth(interpreter.stats);
+    TraceScope trace(declaration->name, Tracer::FunctionCategory, &interpreter.stats);
+    SourceFrameScope frame(declaration->name, declaration->path, declaration->line);
+    
+    // A later REPL input can take a function's purity away after the fact
+    if (memo && declaration->memoize && MemoCache::isCacheable(arguments)) {
+        FluxValue cached;
+        if (memo->lookup(arguments, cached)) {
+            interpreter.stats.memoHits++;
+            return cached;
+        }
+        
+        FluxValue result = invoke(interpreter, arguments);
+        memo->insert(arguments, result);
+        return result;
+    }
+    
+    return invoke(interpreter, arguments);
+}
+
+FluxValue FluxFunction::invoke(Interpreter& interpreter, const std::vector<FluxValue>& arguments) {
+    if (declaration->lazyBody) interpreter.loadFunctionBody(*declaration);
+    
+    if (declaration->framed) {
+        return interpreter.executeFramed(*this, arguments);
+    }
+    
+    auto environment = interpreter.newEnvironment(closure);
     
     for (size_t i = 0; i < declaration->parameters.size(); i++) {
         environment->define(declaration->parameters[i], arguments[i]);
     }
     
-    try {
-        interpreter.executeBlock(declaration->body->statements, environment);
-    } catch (const ReturnException& returnValue) {
-        return returnValue.value;
+    if (declaration->isGenerator) {
+        auto generator = makeAccounted<FluxGenerator>(declaration, environment);
+        interpreter.stats.generators++;
+        generator->upvalues = upvalues;
+        return generator;
     }
     
-    return nullptr;
+    return interpreter.executeFunctionBody(declaration, environment);
 }
 
 std::string FluxFunction::toString() const {
@@ -69,14 +190,23 @@ std::string FluxFunction::toString() const {
 }
 
 // NativeFunction implementation
-NativeFunction::NativeFunction(const std::string& n, int params, std::function<FluxValue(const std::vector<FluxValue>&)> func) 
-    : name(n), paramCount(params), function(func) {}
+NativeFunction::NativeFunction(const std::string& n, int params, std::function<FluxValue(const std::vector<FluxValue>&)> func,
+                               bool isPure)
+    : function(func), paramCount(params), name(n), pure(isPure) {}
+
+NativeFunction::NativeFunction(const std::string& n, int params,
+                               std::function<FluxValue(Interpreter&, const std::vector<FluxValue>&)> func)
+    : contextFunction(func), paramCount(params), name(n), pure(false) {}
 
 int NativeFunction::arity() const {
     return paramCount;
 }
 
 FluxValue NativeFunction::call(Interpreter& interpreter, const std::vector<FluxValue>& arguments) {
+    interpreter.stats.nativeCalls++;
+    NativeTimer timer(interpreter.stats);
+    TraceScope trace(name, Tracer::NativeCategory);
+    if (contextFunction) return contextFunction(interpreter, arguments);
     return function(arguments);
 }
 
@@ -85,12 +215,23 @@ std::string NativeFunction::toString() const {
 }
 
 // Interpreter implementation
-Interpreter::Interpreter() {
-    globals = std::make_shared<Environment>();
+Interpreter::Interpreter() : Interpreter(nullptr, std::make_shared<MemoryAccount>()) {
+    MemoryScope scope(memory);
+    globals = makeAccounted<Environment>();
     environment = globals;
     defineNativeFunctions();
 }
 
+Interpreter::Interpreter(std::shared_ptr<Environment> globalsSnapshot, std::shared_ptr<MemoryAccount> account)
+    : memory(account), frameStack(AccountingAllocator<FluxValue>(account)), frameBase(0),
+      numberStack(AccountingAllocator<double>(account)), numberBase(0),
+      cellStack(AccountingAllocator<std::shared_ptr<Upvalue>>(account)), cellBase(0), upvalues(nullptr),
+      returning(false), fuel(INT64_MAX), quantum(0), output(&std::cout), errors(&std::cerr), threadCount(0),
+      optimization(0) {
+    globals = globalsSnapshot;
+    environment = globals;
+}
+
 void Interpreter::defineNativeFunctions() {
     // Clock function
     globals->define("clock", std::make_shared<NativeFunction>("clock", 0, 
@@ -107,7 +248,7 @@ void Interpreter::defineNativeFunctions() {
                 return std::sqrt(*num);
             }
             throw std::runtime_error("sqrt() requires a number argument");
-        }));
+        }, true));
         
     globals->define("abs", std::make_shared<NativeFunction>("abs", 1,
         [](const std::vector<FluxValue>& args) -> FluxValue {
@@ -115,14 +256,274 @@ void Interpreter::defineNativeFunctions() {
                 return std::abs(*num);
             }
             throw std::runtime_error("abs() requires a number argument");
+        }, true));
+    
+    // Array functions
+    globals->define("len", std::make_shared<NativeFunction>("len", 1,
+        [](const std::vector<FluxValue>& args) -> FluxValue {
+            if (auto array = std::get_if<std::shared_ptr<FluxArray>>(&args[0])) {
+                return static_cast<double>((*array)->elements.size());
+            }
+            if (auto str = std::get_if<FluxString>(&args[0])) {
+                return static_cast<double>(str->size());
+            }
+            throw std::runtime_error("len() requires an array or string argument");
+        }, true));
+    
+    globals->define("push", std::make_shared<NativeFunction>("push", 2,
+        [](const std::vector<FluxValue>& args) -> FluxValue {
+            if (auto array = std::get_if<std::shared_ptr<FluxArray>>(&args[0])) {
+                (*array)->elements.push_back(args[1]);
+                return args[0];
+            }
+            throw std::runtime_error("push() requires an array as first argument");
+        }));
+    
+    // range(end), range(start, end) or range(start, end, step). Not pure:
+    // each call returns a fresh iterator, which iterating uses up
+    globals->define("range", std::make_shared<NativeFunction>("range", -1,
+        [](const std::vector<FluxValue>& args) -> FluxValue {
+            double start, end, step;
+            rangeArguments(args, start, end, step);
+            return std::make_shared<RangeIterator>(start, end, step);
+        }));
+    
+    // File functions. Strings read from a file view its mapping rather than
+    // copying it, and so do the fields split from them.
+    globals->define("read_file", std::make_shared<NativeFunction>("read_file", 1,
+        [](const std::vector<FluxValue>& args) -> FluxValue {
+            auto path = std::get_if<FluxString>(&args[0]);
+            if (!path) {
+                throw std::runtime_error("read_file() requires a path string");
+            }
+            auto file = MappedFile::open(path->str());
+            return FluxString::external(file->data(), file->size(), file);
+        }));
+    
+    globals->define("read_lines", std::make_shared<NativeFunction>("read_lines", 1,
+        [](const std::vector<FluxValue>& args) -> FluxValue {
+            auto path = std::get_if<FluxString>(&args[0]);
+            if (!path) {
+                throw std::runtime_error("read_lines() requires a path string");
+            }
+            auto file = MappedFile::open(path->str());
+            return std::make_shared<LineIterator>(FluxString::external(file->data(), file->size(), file));
+        }));
+    
+    // split_fields(line) splits on runs of blanks, split_fields(line, separator) on each
+    // separator. Not pure, since each call returns a new array the caller can change.
+    globals->define("split_fields", std::make_shared<NativeFunction>("split_fields", -1,
+        [](const std::vector<FluxValue>& args) -> FluxValue {
+            auto line = args.empty() ? nullptr : std::get_if<FluxString>(&args[0]);
+            auto separator = args.size() == 2 ? std::get_if<FluxString>(&args[1]) : nullptr;
+            if (!line || args.size() > 2 || (args.size() == 2 && (!separator || separator->empty()))) {
+                throw std::runtime_error("split_fields() requires a string and an optional non-empty separator");
+            }
+            
+            std::string_view text = line->view();
+            std::vector<FluxValue> fields;
+            if (separator) {
+                std::string_view delimiter = separator->view();
+                size_t start = 0;
+                while (true) {
+                    size_t end = text.find(delimiter, start);
+                    if (end == std::string_view::npos) break;
+                    fields.push_back(line->slice(start, end - start));
+                    start = end + delimiter.size();
+                }
+                fields.push_back(line->slice(start, text.size() - start));
+            } else {
+                size_t start = text.find_first_not_of(" \t");
+                while (start != std::string_view::npos) {
+                    size_t end = text.find_first_of(" \t", start);
+                    if (end == std::string_view::npos) end = text.size();
+                    fields.push_back(line->slice(start, end - start));
+                    start = text.find_first_not_of(" \t", end);
+                }
+            }
+            return makeAccounted<FluxArray>(std::move(fields));
+        }));
+    
+    // Parallel functions
+    globals->define("parallel_map", std::make_shared<NativeFunction>("parallel_map", 2,
+        [](Interpreter& interpreter, const std::vector<FluxValue>& args) -> FluxValue {
+            auto function = std::get_if<std::shared_ptr<FluxCallable>>(&args[0]);
+            auto array = std::get_if<std::shared_ptr<FluxArray>>(&args[1]);
+            if (!function || !array) {
+                throw std::runtime_error("parallel_map() requires a function and an array");
+            }
+            const auto& elements = (*array)->elements;
+            std::vector<FluxValue> inputs(elements.begin(), elements.end());
+            return makeAccounted<FluxArray>(interpreter.parallelMap(*function, inputs));
         }));
 }
 
+bool Interpreter::isPureCallable(const std::shared_ptr<FluxCallable>& callable) const {
+    if (auto function = std::dynamic_pointer_cast<FluxFunction>(callable)) {
+        if (function->declaration->lazyBody) loadFunctionBody(*function->declaration);
+        return function->declaration->pure;
+    }
+    if (auto native = std::dynamic_pointer_cast<NativeFunction>(callable)) {
+        return native->pure;
+    }
+    return false;
+}
+
+void Interpreter::setScriptPath(const std::string& path) {
+    scriptPath = path;
+    moduleDirectory = std::filesystem::path(path).parent_path().string();
+}
+
+void Interpreter::loadFunctionBody(FunctionDeclaration& declaration) const {
+    if (declaration.lazyBody->parsed.load(std::memory_order_acquire)) return;
+    ensureFunctionBody(declaration, pureNativeNames(), optimization);
+}
+
+void Interpreter::setThreadCount(size_t threads) {
+    threadCount = threads;
+    pool.reset();
+}
+
+void Interpreter::stopWorkerThreads() {
+    pool.reset();
+}
+
+void Interpreter::setQuantum(uint64_t fuel) {
+    quantum = fuel;
+    this->fuel = quantum > 0 ? static_cast<int64_t>(std::min<uint64_t>(quantum, INT64_MAX)) : INT64_MAX;
+}
+
+void Interpreter::setOutput(std::ostream& out, std::ostream& errorOutput) {
+    output = &out;
+    errors = &errorOutput;
+}
+
+void Interpreter::refuel() {
+    setQuantum(quantum);
+    if (quantum > 0) Fiber::yield();
+}
+
+WorkStealingPool& Interpreter::workerPool() {
+    if (!pool) {
+        size_t threads = threadCount;
+        if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+        pool = std::make_unique<WorkStealingPool>(threads);
+    }
+    return *pool;
+}
+
+std::vector<FluxValue> Interpreter::parallelMap(const std::shared_ptr<FluxCallable>& function,
+                                                const std::vector<FluxValue>& inputs) {
+    if (!isPureCallable(function)) {
+        throw std::runtime_error("parallel_map() requires a pure function, " + function->toString() + " is not");
+    }
+    if (function->arity() != 1) {
+        throw std::runtime_error("parallel_map() requires a function of one argument");
+    }
+    
+    // A map nested in a worker's call runs inline on that worker, in its own
+    // context, rather than on a pool of its own
+    if (WorkStealingPool::onWorkerThread()) {
+        std::vector<FluxValue> results;
+        results.reserve(inputs.size());
+        for (const auto& input : inputs) {
+            results.push_back(function->call(*this, {input}));
+        }
+        return results;
+    }
+    
+    // Globals are snapshotted once; functions closed over the live globals are
+    // rebound to the snapshot so workers never touch this interpreter's state
+    Environment::Bindings snapshot = globals->bindings();
+    auto rebind = [this](const std::shared_ptr<FluxCallable>& callable,
+                         const std::shared_ptr<Environment>& env) -> std::shared_ptr<FluxCallable> {
+        auto fn = std::dynamic_pointer_cast<FluxFunction>(callable);
+        if (fn && fn->closure == globals) {
+            auto rebound = makeAccounted<FluxFunction>(fn->declaration, env, fn->memo);
+            rebound->upvalues = fn->upvalues;
+            return rebound;
+        }
+        return callable;
+    };
+    
+    WorkStealingPool& workers = workerPool();
+    std::vector<std::unique_ptr<Interpreter>> contexts(workers.size());
+    std::vector<std::shared_ptr<FluxCallable>> workerFunctions(workers.size());
+    std::vector<FluxValue> results(inputs.size());
+    
+    workers.parallelFor(inputs.size(), [&](size_t worker, size_t i) {
+        MemoryScope scope(memory);
+        auto& context = contexts[worker];
+        if (!context) {
+            auto env = makeAccounted<Environment>(snapshot);
+            for (auto& binding : snapshot) {
+                if (auto callable = std::get_if<std::shared_ptr<FluxCallable>>(&binding.second)) {
+                    env->define(binding.first, rebind(*callable, env));
+                }
+            }
+            context = std::make_unique<Interpreter>(env, memory);
+            context->stats.timeNatives = stats.timeNatives;
+            context->optimization = optimization;
+            workerFunctions[worker] = rebind(function, env);
+        }
+        results[i] = workerFunctions[worker]->call(*context, {inputs[i]});
+    });
+    
+    for (const auto& context : contexts) {
+        if (!context) continue;
+        for (size_t i = 0; i < superinstructionHits.size(); i++) {
+            superinstructionHits[i] += context->superinstructionHits[i];
+        }
+        stats.merge(context->stats);
+    }
+    
+    return results;
+}
+
+std::unordered_set<std::string> Interpreter::pureNativeNames() const {
+    std::unordered_set<std::string> names;
+    for (const auto& binding : globals->bindings()) {
+        auto callable = std::get_if<std::shared_ptr<FluxCallable>>(&binding.second);
+        if (!callable) continue;
+        auto native = std::dynamic_pointer_cast<NativeFunction>(*callable);
+        if (native && native->pure) names.insert(binding.first);
+    }
+    return names;
+}
+
+void Interpreter::printProfile(std::ostream& out) const {
+    out << "Memoization:" << std::endl;
+    if (memoCaches.empty()) {
+        out << "  (no memoized functions)" << std::endl;
+    }
+    for (const auto& entry : memoCaches) {
+        const MemoCache& cache = *entry.second;
+        out << "  " << entry.first << ": " << cache.hits << " hits, " << cache.misses << " misses, "
+            << cache.evictions << " evictions (" << cache.size() << "/" << cache.capacity() << " entries)" << std::endl;
+    }
+    
+    out << "Superinstructions:" << std::endl;
+    for (size_t i = 1; i < superinstructionHits.size(); i++) {
+        out << "  " << superinstructionName(static_cast<Superinstruction>(i)) << ": "
+            << superinstructionHits[i] << " hits" << std::endl;
+    }
+    out << "Cached expressions (-O): " << cachedHits << " hits" << std::endl;
+    out << "Memory: " << memory->peak() << " bytes at peak, " << memory->used() << " held now" << std::endl;
+}
+
+std::shared_ptr<Environment> Interpreter::newEnvironment(std::shared_ptr<Environment> parent) {
+    stats.environments++;
+    return makeAccounted<Environment>(std::move(parent));
+}
+
 void Interpreter::interpret(Program& program) {
+    static const std::string topLevel = "[script]";
+    MemoryScope scope(memory);
+    SourceFrameScope frame(topLevel, scriptPath, 0);
     try {
         program.accept(*this);
     } catch (const std::exception& e) {
-        std::cerr << "Runtime error: " << e.what() << std::endl;
+        *errors << "Runtime error: " << e.what() << std::endl;
     }
 }
 
@@ -133,6 +534,7 @@ void Interpreter::executeBlock(const std::vector<std::unique_ptr<Statement>>& st
     try {
         for (const auto& statement : statements) {
             execute(statement.get());
+            if (returning) break;
         }
     } catch (...) {
         environment = previous;
@@ -142,12 +544,216 @@ void Interpreter::executeBlock(const std::vector<std::unique_ptr<Statement>>& st
     environment = previous;
 }
 
+FluxValue Interpreter::executeFunctionBody(FunctionDeclaration* declaration, std::shared_ptr<Environment> env) {
+    spendFuel();
+    executeBlock(declaration->body->statements, env);
+    
+    if (!returning) return nullptr;
+    returning = false;
+    return std::move(returnValue);
+}
+
+FluxValue Interpreter::executeFramed(FluxFunction& function, const std::vector<FluxValue>& arguments) {
+    FunctionDeclaration* declaration = function.declaration;
+    size_t previousBase = frameBase;
+    size_t previousNumberBase = numberBase;
+    size_t previousCellBase = cellBase;
+    auto previousUpvalues = upvalues;
+    
+    size_t base = frameStack.size();
+    size_t numbers = numberStack.size();
+    size_t cells = cellStack.size();
+    
+    auto restore = [&]() {
+        frameStack.resize(base);
+        numberStack.resize(numbers);
+        cellStack.resize(cells);
+        frameBase = previousBase;
+        numberBase = previousNumberBase;
+        cellBase = previousCellBase;
+        upvalues = previousUpvalues;
+    };
+    
+    // Names that aren't locals (globals, functions) still resolve through the closure
+    FluxValue result;
+    try {
+        // Growing the stacks can hit the memory limit too
+        frameStack.resize(base + declaration->frameSize);
+        for (size_t i = 0; i < arguments.size(); i++) {
+            frameStack[base + i] = arguments[i];
+        }
+        numberStack.resize(numbers + declaration->numberCount);
+        cellStack.resize(cells + declaration->cellCount);
+        for (size_t i = 0; i < declaration->parameterCells.size(); i++) {
+            if (declaration->parameterCells[i] >= 0) {
+                cellStack[cells + declaration->parameterCells[i]] = makeAccounted<Upvalue>(Upvalue{arguments[i]});
+            }
+        }
+        frameBase = base;
+        numberBase = numbers;
+        cellBase = cells;
+        upvalues = &function.upvalues;
+        
+        result = executeFunctionBody(declaration, function.closure);
+    } catch (...) {
+        restore();
+        throw;
+    }
+    
+    restore();
+    return result;
+}
+
 FluxValue Interpreter::evaluate(Expression* expr) {
+    if (expr->cached) return evaluateCached(expr);
     expr->accept(*this);
     return lastValue;
 }
 
+// Value of an expression the Optimizer caches: computed where its owner
+// first reaches it, then reused for the rest of the owner's run if nothing
+// it depends on can change under it
+const FluxValue& Interpreter::evaluateCached(Expression* expr) {
+    const CachedValue& cache = *expr->cached;
+    if (numberStack[numberBase + cache.flag] == 1) {
+        cachedHits++;
+        return lastValue = frameStack[frameBase + cache.slot];
+    }
+    
+    expr->accept(*this);
+    if (numberStack[numberBase + cache.flag] == 0) {
+        bool keep = lastValue.index() < 4;  // a number, string, bool or nil
+        for (int slot : cache.locals) {
+            if (frameStack[frameBase + slot].index() >= 4) keep = false;
+        }
+        for (const auto& name : cache.natives) {
+            FluxValue* value = environment->lookup(name);
+            auto callable = value ? std::get_if<std::shared_ptr<FluxCallable>>(value) : nullptr;
+            auto native = callable ? std::dynamic_pointer_cast<NativeFunction>(*callable) : nullptr;
+            if (!native || !native->pure) keep = false;
+        }
+        numberStack[numberBase + cache.flag] = keep ? 1 : 2;
+        if (keep) frameStack[frameBase + cache.slot] = lastValue;
+    }
+    return lastValue;
+}
+
+static bool compareNumbers(BinaryOp op, double left, double right) {
+    switch (op) {
+        case BinaryOp::Less: return left < right;
+        case BinaryOp::LessEqual: return left <= right;
+        case BinaryOp::Greater: return left > right;
+        case BinaryOp::GreaterEqual: return left >= right;
+        case BinaryOp::Equal: return left == right;
+        case BinaryOp::NotEqual: return left != right;
+        default: return false;
+    }
+}
+
+// Test-and-branch form of a condition: comparisons and logical operators
+// produce a C++ bool directly instead of materializing a bool FluxValue
+bool Interpreter::evaluateCondition(Expression* expr) {
+    if (expr->cached) return isTruthy(evaluateCached(expr));
+    if (expr->form == UnboxedForm::Compare) {
+        auto binary = static_cast<BinaryExpression*>(expr);
+        bool result;
+        if (binary->fused != Superinstruction::None && testFused(*binary, result)) return result;
+        double left = evaluateNumber(binary->left.get());
+        return compareNumbers(binary->op, left, evaluateNumber(binary->right.get()));
+    }
+    if (expr->form == UnboxedForm::Local && expr->type == StaticType::Bool) {
+        return numberStack[numberBase + static_cast<IdentifierExpression*>(expr)->numberSlot] != 0;
+    }
+    
+    if (auto binary = dynamic_cast<BinaryExpression*>(expr)) {
+        bool result;
+        if (binary->fused != Superinstruction::None && testFused(*binary, result)) return result;
+        
+        switch (binary->op) {
+            case BinaryOp::Less:
+            case BinaryOp::LessEqual:
+            case BinaryOp::Greater:
+            case BinaryOp::GreaterEqual:
+            case BinaryOp::Equal:
+            case BinaryOp::NotEqual: {
+                FluxValue left = evaluate(binary->left.get());
+                FluxValue right = evaluate(binary->right.get());
+                const double* l = std::get_if<double>(&left);
+                const double* r = std::get_if<double>(&right);
+                if (l && r) return compareNumbers(binary->op, *l, *r);
+                if (binary->op == BinaryOp::Equal) return isEqual(left, right);
+                if (binary->op == BinaryOp::NotEqual) return !isEqual(left, right);
+                checkNumberOperands(binary->operator_, left, right);
+                return false;
+            }
+            default:
+                return isTruthy(evaluate(expr));
+        }
+    }
+    
+    if (auto logical = dynamic_cast<LogicalExpression*>(expr)) {
+        if (logical->op == LogicalOp::And) {
+            return evaluateCondition(logical->left.get()) && evaluateCondition(logical->right.get());
+        }
+        return evaluateCondition(logical->left.get()) || evaluateCondition(logical->right.get());
+    }
+    
+    if (auto unary = dynamic_cast<UnaryExpression*>(expr)) {
+        if (unary->operator_ == "not" || unary->operator_ == "!") {
+            return !evaluateCondition(unary->operand.get());
+        }
+    }
+    
+    return isTruthy(evaluate(expr));
+}
+
+// Value of an expression the TypeAnalyzer proved a number
+double Interpreter::evaluateNumber(Expression* expr) {
+    if (expr->cached) return *std::get_if<double>(&evaluateCached(expr));
+    return unboxedNumber(expr);
+}
+
+// Its unboxed forms combine operands that are numbers too, so they need no
+// type checks; any other expression goes through the visitor and is unwrapped
+double Interpreter::unboxedNumber(Expression* expr) {
+    switch (expr->form) {
+        case UnboxedForm::Local:
+            return numberStack[numberBase + static_cast<IdentifierExpression*>(expr)->numberSlot];
+        case UnboxedForm::Constant:
+            return *std::get_if<double>(&static_cast<LiteralExpression*>(expr)->value);
+        case UnboxedForm::Negate:
+            return -evaluateNumber(static_cast<UnaryExpression*>(expr)->operand.get());
+        case UnboxedForm::Arithmetic: {
+            auto binary = static_cast<BinaryExpression*>(expr);
+            double left = evaluateNumber(binary->left.get());
+            double right = evaluateNumber(binary->right.get());
+            switch (binary->op) {
+                case BinaryOp::Add: return left + right;
+                case BinaryOp::Subtract: return left - right;
+                case BinaryOp::Multiply: return left * right;
+                case BinaryOp::Divide:
+                    if (right == 0) throw std::runtime_error("Division by zero");
+                    return left / right;
+                default: return std::fmod(left, right);
+            }
+        }
+        default:
+            expr->accept(*this);
+            return *std::get_if<double>(&lastValue);
+    }
+}
+
+// What an unboxed slot holds for an expression proven a number or a bool
+double Interpreter::evaluateUnboxed(Expression* expr) {
+    if (expr->type == StaticType::Bool) return evaluateCondition(expr) ? 1 : 0;
+    return evaluateNumber(expr);
+}
+
 void Interpreter::execute(Statement* stmt) {
+    if (HeapProfiler::enabled()) HeapProfiler::atLine(stmt->line);
+    for (int flag : stmt->cacheFlags) {
+        numberStack[numberBase + flag] = 0;
+    }
     stmt->accept(*this);
 }
 
@@ -161,12 +767,17 @@ bool Interpreter::isEqual(FluxValue left, FluxValue right) {
     return left == right;
 }
 
-std::string Interpreter::stringify(FluxValue value) {
+std::string Interpreter::stringify(const FluxValue& value) {
+    std::vector<const FluxArray*> open;
+    return stringify(value, open);
+}
+
+std::string Interpreter::stringify(const FluxValue& value, std::vector<const FluxArray*>& open) {
     if (std::holds_alternative<std::nullptr_t>(value)) {
         return "nil";
     }
-    if (auto str = std::get_if<std::string>(&value)) {
-        return *str;
+    if (auto str = std::get_if<FluxString>(&value)) {
+        return str->str();
     }
     if (auto num = std::get_if<double>(&value)) {
         std::ostringstream oss;
@@ -179,9 +790,40 @@ std::string Interpreter::stringify(FluxValue value) {
     if (auto callable = std::get_if<std::shared_ptr<FluxCallable>>(&value)) {
         return (*callable)->toString();
     }
+    if (auto iterator = std::get_if<std::shared_ptr<FluxIterator>>(&value)) {
+        return (*iterator)->toString();
+    }
+    if (auto array = std::get_if<std::shared_ptr<FluxArray>>(&value)) {
+        if (std::find(open.begin(), open.end(), array->get()) != open.end()) return "[...]";
+        open.push_back(array->get());
+        std::string result = "[";
+        for (size_t i = 0; i < (*array)->elements.size(); i++) {
+            if (i > 0) result += ", ";
+            result += stringify((*array)->elements[i], open);
+        }
+        open.pop_back();
+        return result + "]";
+    }
     return "unknown";
 }
 
+// Only the non-string side is formatted; string operands are read in place
+FluxValue Interpreter::concatenate(const FluxValue& left, const FluxValue& right) {
+    stats.strings++;
+    auto leftString = std::get_if<FluxString>(&left);
+    auto rightString = std::get_if<FluxString>(&right);
+    if (leftString && rightString) {
+        return FluxString::concat(leftString->view(), rightString->view());
+    }
+    if (leftString) {
+        return FluxString::concat(leftString->view(), stringify(right));
+    }
+    if (rightString) {
+        return FluxString::concat(stringify(left), rightString->view());
+    }
+    return FluxString(stringify(left) + stringify(right));
+}
+
 void Interpreter::checkNumberOperand(const std::string& op, FluxValue operand) {
     if (!std::holds_alternative<double>(operand)) {
         throw std::runtime_error("Operand must be a number for " + op);
@@ -200,116 +842,267 @@ void Interpreter::visit(LiteralExpression& node) {
 }
 
 void Interpreter::visit(IdentifierExpression& node) {
-    lastValue = environment->get(node.name);
-}
-
-void Interpreter::visit(BinaryExpression& node) {
-    FluxValue left = evaluate(node.left.get());
-    FluxValue right = evaluate(node.right.get());
-    
-    if (node.operator_ == "=") {
-        if (auto identifier = dynamic_cast<IdentifierExpression*>(node.left.get())) {
-            environment->assign(identifier->name, right);
-            lastValue = right;
-            return;
-        }
-        throw std::runtime_error("Invalid assignment target");
-    }
-    
-    if (node.operator_ == "+") {
-        if (std::holds_alternative<double>(left) && std::holds_alternative<double>(right)) {
-            lastValue = std::get<double>(left) + std::get<double>(right);
-            return;
-        }
-        if (std::holds_alternative<std::string>(left) && std::holds_alternative<std::string>(right)) {
-            lastValue = std::get<std::string>(left) + std::get<std::string>(right);
-            return;
+    if (node.numberSlot >= 0) {
+        double value = numberStack[numberBase + node.numberSlot];
+        if (node.type == StaticType::Bool) {
+            lastValue = value != 0;
+        } else {
+            lastValue = value;
         }
-        throw std::runtime_error("Operands must be two numbers or two strings");
-    }
-    
-    if (node.operator_ == "-") {
-        checkNumberOperands(node.operator_, left, right);
-        lastValue = std::get<double>(left) - std::get<double>(right);
         return;
     }
-    
-    if (node.operator_ == "*") {
-        checkNumberOperands(node.operator_, left, right);
-        lastValue = std::get<double>(left) * std::get<double>(right);
+    if (node.slot >= 0) {
+        lastValue = frameStack[frameBase + node.slot];
         return;
     }
-    
-    if (node.operator_ == "/") {
-        checkNumberOperands(node.operator_, left, right);
-        double rightVal = std::get<double>(right);
-        if (rightVal == 0) throw std::runtime_error("Division by zero");
-        lastValue = std::get<double>(left) / rightVal;
+    if (node.cell >= 0) {
+        lastValue = cellStack[cellBase + node.cell]->value;
         return;
     }
-    
-    if (node.operator_ == "%") {
-        checkNumberOperands(node.operator_, left, right);
-        lastValue = std::fmod(std::get<double>(left), std::get<double>(right));
+    if (node.upvalue >= 0) {
+        lastValue = (*upvalues)[node.upvalue]->value;
         return;
     }
+    lastValue = environment->get(node.name);
+}
+
+// Number held by a superinstruction operand, or nullptr if the local isn't one
+const double* Interpreter::fusedNumber(const FusedOperand& operand) const {
+    if (operand.numberSlot >= 0) return &numberStack[numberBase + operand.numberSlot];
+    if (operand.slot < 0) return &operand.constant;
+    return std::get_if<double>(&frameStack[frameBase + operand.slot]);
+}
+
+// Runs a fused comparison or modulo test; false when an operand isn't a number
+bool Interpreter::testFused(BinaryExpression& node, bool& result) {
+    const double* l = fusedNumber(node.fusedLeft);
+    const double* r = fusedNumber(node.fusedRight);
+    if (!l || !r) return false;
     
-    if (node.operator_ == ">") {
-        checkNumberOperands(node.operator_, left, right);
-        lastValue = std::get<double>(left) > std::get<double>(right);
+    if (node.fused == Superinstruction::CompareLocal) {
+        result = compareNumbers(node.op, *l, *r);
+    } else if (node.fused == Superinstruction::ModuloTest) {
+        result = (std::fmod(*l, *r) == 0) == (node.op == BinaryOp::Equal);
+    } else {
+        return false;
+    }
+    superinstructionHits[static_cast<size_t>(node.fused)]++;
+    return true;
+}
+
+void Interpreter::visit(BinaryExpression& node) {
+    if (node.form == UnboxedForm::Arithmetic) {
+        lastValue = unboxedNumber(&node);
         return;
     }
-    
-    if (node.operator_ == ">=") {
-        checkNumberOperands(node.operator_, left, right);
-        lastValue = std::get<double>(left) >= std::get<double>(right);
+    if (node.form == UnboxedForm::Compare && node.fused == Superinstruction::None) {
+        double left = evaluateNumber(node.left.get());
+        lastValue = compareNumbers(node.op, left, evaluateNumber(node.right.get()));
         return;
     }
     
-    if (node.operator_ == "<") {
-        checkNumberOperands(node.operator_, left, right);
-        lastValue = std::get<double>(left) < std::get<double>(right);
+    if (node.fused == Superinstruction::IncrementLocal && node.fusedLeft.numberSlot >= 0) {
+        double& local = numberStack[numberBase + node.fusedLeft.numberSlot];
+        local += node.fusedRight.constant;
+        lastValue = local;
+        superinstructionHits[static_cast<size_t>(Superinstruction::IncrementLocal)]++;
         return;
     }
+    if (node.fused == Superinstruction::IncrementLocal) {
+        FluxValue& local = frameStack[frameBase + node.fusedLeft.slot];
+        if (auto number = std::get_if<double>(&local)) {
+            *number += node.fusedRight.constant;
+            lastValue = *number;
+            superinstructionHits[static_cast<size_t>(Superinstruction::IncrementLocal)]++;
+            return;
+        }
+    } else if (node.fused != Superinstruction::None) {
+        bool result;
+        if (testFused(node, result)) {
+            lastValue = result;
+            return;
+        }
+    }
     
-    if (node.operator_ == "<=") {
-        checkNumberOperands(node.operator_, left, right);
-        lastValue = std::get<double>(left) <= std::get<double>(right);
-        return;
+    if (node.op == BinaryOp::Assign) {
+        auto identifier = dynamic_cast<IdentifierExpression*>(node.left.get());
+        if (identifier && identifier->numberSlot >= 0) {
+            double value = evaluateUnboxed(node.right.get());
+            numberStack[numberBase + identifier->numberSlot] = value;
+            identifier->accept(*this);
+            return;
+        }
+        
+        FluxValue value = evaluate(node.right.get());
+        if (identifier) {
+            if (identifier->slot >= 0) {
+                frameStack[frameBase + identifier->slot] = value;
+            } else if (identifier->cell >= 0) {
+                cellStack[cellBase + identifier->cell]->value = value;
+            } else if (identifier->upvalue >= 0) {
+                (*upvalues)[identifier->upvalue]->value = value;
+            } else {
+                environment->assign(identifier->name, value);
+            }
+            lastValue = value;
+            return;
+        }
+        throw std::runtime_error("Invalid assignment target");
     }
     
-    if (node.operator_ == "!=") {
-        lastValue = !isEqual(left, right);
-        return;
+    FluxValue left = evaluate(node.left.get());
+    FluxValue right = evaluate(node.right.get());
+    
+    // Specialized fast paths: a single type test on each operand, no operator dispatch
+    const double* l = std::get_if<double>(&left);
+    const double* r = std::get_if<double>(&right);
+    BinaryKind kind = node.kind.load(std::memory_order_relaxed);
+    switch (kind) {
+        case BinaryKind::NumberAdd:
+            if (l && r) { lastValue = *l + *r; return; }
+            break;
+        case BinaryKind::NumberSubtract:
+            if (l && r) { lastValue = *l - *r; return; }
+            break;
+        case BinaryKind::NumberMultiply:
+            if (l && r) { lastValue = *l * *r; return; }
+            break;
+        case BinaryKind::NumberDivide:
+            if (l && r && *r != 0) { lastValue = *l / *r; return; }
+            break;
+        case BinaryKind::NumberModulo:
+            if (l && r) { lastValue = std::fmod(*l, *r); return; }
+            break;
+        case BinaryKind::NumberGreater:
+            if (l && r) { lastValue = *l > *r; return; }
+            break;
+        case BinaryKind::NumberGreaterEqual:
+            if (l && r) { lastValue = *l >= *r; return; }
+            break;
+        case BinaryKind::NumberLess:
+            if (l && r) { lastValue = *l < *r; return; }
+            break;
+        case BinaryKind::NumberLessEqual:
+            if (l && r) { lastValue = *l <= *r; return; }
+            break;
+        case BinaryKind::StringConcat:
+            if (std::holds_alternative<FluxString>(left) || std::holds_alternative<FluxString>(right)) {
+                lastValue = concatenate(left, right);
+                return;
+            }
+            break;
+        case BinaryKind::Uninitialized:
+        case BinaryKind::Generic:
+            break;
     }
     
-    if (node.operator_ == "==") {
-        lastValue = isEqual(left, right);
-        return;
+    // Slow path: rewrite the node for the types seen, or give up on specializing it
+    if (kind == BinaryKind::Uninitialized) {
+        node.kind.store(specializeBinary(node.op, left, right), std::memory_order_relaxed);
+    } else if (kind != BinaryKind::Generic) {
+        node.kind.store(BinaryKind::Generic, std::memory_order_relaxed);
     }
     
-    if (node.operator_ == "and") {
-        if (!isTruthy(left)) {
-            lastValue = left;
-        } else {
-            lastValue = right;
+    lastValue = binaryGeneric(node, left, right);
+}
+
+BinaryKind Interpreter::specializeBinary(BinaryOp op, const FluxValue& left, const FluxValue& right) {
+    bool numbers = std::holds_alternative<double>(left) && std::holds_alternative<double>(right);
+    
+    switch (op) {
+        case BinaryOp::Add:
+            if (numbers) return BinaryKind::NumberAdd;
+            if (std::holds_alternative<FluxString>(left) || std::holds_alternative<FluxString>(right)) {
+                return BinaryKind::StringConcat;
+            }
+            return BinaryKind::Generic;
+        case BinaryOp::Subtract: return numbers ? BinaryKind::NumberSubtract : BinaryKind::Generic;
+        case BinaryOp::Multiply: return numbers ? BinaryKind::NumberMultiply : BinaryKind::Generic;
+        case BinaryOp::Divide: return numbers ? BinaryKind::NumberDivide : BinaryKind::Generic;
+        case BinaryOp::Modulo: return numbers ? BinaryKind::NumberModulo : BinaryKind::Generic;
+        case BinaryOp::Greater: return numbers ? BinaryKind::NumberGreater : BinaryKind::Generic;
+        case BinaryOp::GreaterEqual: return numbers ? BinaryKind::NumberGreaterEqual : BinaryKind::Generic;
+        case BinaryOp::Less: return numbers ? BinaryKind::NumberLess : BinaryKind::Generic;
+        case BinaryOp::LessEqual: return numbers ? BinaryKind::NumberLessEqual : BinaryKind::Generic;
+        default:
+            return BinaryKind::Generic;
+    }
+}
+
+FluxValue Interpreter::binaryGeneric(BinaryExpression& node, const FluxValue& left, const FluxValue& right) {
+    switch (node.op) {
+        case BinaryOp::Add:
+            if (std::holds_alternative<double>(left) && std::holds_alternative<double>(right)) {
+                return std::get<double>(left) + std::get<double>(right);
+            }
+            if (std::holds_alternative<FluxString>(left) || std::holds_alternative<FluxString>(right)) {
+                return concatenate(left, right);
+            }
+            throw std::runtime_error("Operands must be two numbers or include a string");
+            
+        case BinaryOp::Subtract:
+            checkNumberOperands(node.operator_, left, right);
+            return std::get<double>(left) - std::get<double>(right);
+            
+        case BinaryOp::Multiply:
+            checkNumberOperands(node.operator_, left, right);
+            return std::get<double>(left) * std::get<double>(right);
+            
+        case BinaryOp::Divide: {
+            checkNumberOperands(node.operator_, left, right);
+            double rightVal = std::get<double>(right);
+            if (rightVal == 0) throw std::runtime_error("Division by zero");
+            return std::get<double>(left) / rightVal;
         }
-        return;
+            
+        case BinaryOp::Modulo:
+            checkNumberOperands(node.operator_, left, right);
+            return std::fmod(std::get<double>(left), std::get<double>(right));
+            
+        case BinaryOp::Greater:
+            checkNumberOperands(node.operator_, left, right);
+            return std::get<double>(left) > std::get<double>(right);
+            
+        case BinaryOp::GreaterEqual:
+            checkNumberOperands(node.operator_, left, right);
+            return std::get<double>(left) >= std::get<double>(right);
+            
+        case BinaryOp::Less:
+            checkNumberOperands(node.operator_, left, right);
+            return std::get<double>(left) < std::get<double>(right);
+            
+        case BinaryOp::LessEqual:
+            checkNumberOperands(node.operator_, left, right);
+            return std::get<double>(left) <= std::get<double>(right);
+            
+        case BinaryOp::NotEqual:
+            return !isEqual(left, right);
+            
+        case BinaryOp::Equal:
+            return isEqual(left, right);
+            
+        default:
+            throw std::runtime_error("Unknown binary operator: " + node.operator_);
     }
+}
+
+void Interpreter::visit(LogicalExpression& node) {
+    FluxValue left = evaluate(node.left.get());
     
-    if (node.operator_ == "or") {
-        if (isTruthy(left)) {
-            lastValue = left;
-        } else {
-            lastValue = right;
-        }
+    if (node.op == LogicalOp::And ? !isTruthy(left) : isTruthy(left)) {
+        lastValue = left;
         return;
     }
     
-    throw std::runtime_error("Unknown binary operator: " + node.operator_);
+    lastValue = evaluate(node.right.get());
 }
 
 void Interpreter::visit(UnaryExpression& node) {
+    if (node.form == UnboxedForm::Negate) {
+        lastValue = unboxedNumber(&node);
+        return;
+    }
+    
     FluxValue right = evaluate(node.operand.get());
     
     if (node.operator_ == "-") {
@@ -334,17 +1127,68 @@ void Interpreter::visit(CallExpression& node) {
         arguments.push_back(evaluate(arg.get()));
     }
     
+    lastValue = callValue(callee, arguments);
+}
+
+FluxValue Interpreter::callValue(const FluxValue& callee, const std::vector<FluxValue>& arguments) {
     auto callable = std::get_if<std::shared_ptr<FluxCallable>>(&callee);
     if (!callable) {
         throw std::runtime_error("Can only call functions");
     }
     
-    if (arguments.size() != (*callable)->arity()) {
-        throw std::runtime_error("Expected " + std::to_string((*callable)->arity()) + 
+    int arity = (*callable)->arity();
+    if (arity >= 0 && arguments.size() != static_cast<size_t>(arity)) {
+        throw std::runtime_error("Expected " + std::to_string(arity) + 
                                 " arguments but got " + std::to_string(arguments.size()));
     }
     
-    lastValue = (*callable)->call(*this, arguments);
+    return (*callable)->call(*this, arguments);
+}
+
+void Interpreter::rangeArguments(const std::vector<FluxValue>& arguments, double& start, double& end, double& step) {
+    if (arguments.empty() || arguments.size() > 3) {
+        throw std::runtime_error("range() takes 1 to 3 arguments");
+    }
+    for (const auto& arg : arguments) {
+        if (!std::holds_alternative<double>(arg)) {
+            throw std::runtime_error("range() requires number arguments");
+        }
+    }
+    
+    start = arguments.size() > 1 ? std::get<double>(arguments[0]) : 0;
+    end = std::get<double>(arguments[arguments.size() > 1 ? 1 : 0]);
+    step = arguments.size() > 2 ? std::get<double>(arguments[2]) : 1;
+    if (step == 0) {
+        throw std::runtime_error("range() step cannot be zero");
+    }
+}
+
+void Interpreter::visit(ArrayExpression& node) {
+    FluxArray::Elements elements;
+    elements.reserve(node.elements.size());
+    for (const auto& element : node.elements) {
+        elements.push_back(evaluate(element.get()));
+    }
+    lastValue = makeAccounted<FluxArray>(std::move(elements));
+    stats.arrays++;
+}
+
+void Interpreter::visit(IndexExpression& node) {
+    FluxValue object = evaluate(node.object.get());
+    FluxValue index = evaluate(node.index.get());
+    
+    auto array = std::get_if<std::shared_ptr<FluxArray>>(&object);
+    if (!array) {
+        throw std::runtime_error("Can only index arrays");
+    }
+    checkNumberOperand("[]", index);
+    
+    double position = std::get<double>(index);
+    const auto& elements = (*array)->elements;
+    if (position < 0 || position >= elements.size() || position != std::floor(position)) {
+        throw std::runtime_error("Array index out of range: " + stringify(index));
+    }
+    lastValue = elements[static_cast<size_t>(position)];
 }
 
 void Interpreter::visit(ExpressionStatement& node) {
@@ -352,21 +1196,41 @@ void Interpreter::visit(ExpressionStatement& node) {
 }
 
 void Interpreter::visit(VarDeclaration& node) {
+    if (node.numberSlot >= 0) {
+        double value = evaluateUnboxed(node.initializer.get());
+        numberStack[numberBase + node.numberSlot] = value;
+        return;
+    }
+    
     FluxValue value = nullptr;
     if (node.initializer) {
         value = evaluate(node.initializer.get());
     }
-    environment->define(node.name, value);
+    
+    if (node.slot >= 0) {
+        frameStack[frameBase + node.slot] = value;
+    } else if (node.cell >= 0) {
+        // A fresh cell per execution, so closures made in different loop
+        // iterations capture different variables
+        cellStack[cellBase + node.cell] = makeAccounted<Upvalue>(Upvalue{value});
+    } else {
+        environment->define(node.name, value);
+    }
 }
 
 void Interpreter::visit(BlockStatement& node) {
-    executeBlock(node.statements, std::make_shared<Environment>(environment));
+    if (!node.needsEnvironment) {
+        for (const auto& statement : node.statements) {
+            execute(statement.get());
+            if (returning) return;
+        }
+        return;
+    }
+    executeBlock(node.statements, newEnvironment(environment));
 }
 
 void Interpreter::visit(IfStatement& node) {
-    FluxValue condition = evaluate(node.condition.get());
-    
-    if (isTruthy(condition)) {
+    if (evaluateCondition(node.condition.get())) {
         execute(node.thenBranch.get());
     } else if (node.elseBranch) {
         execute(node.elseBranch.get());
@@ -374,14 +1238,359 @@ void Interpreter::visit(IfStatement& node) {
 }
 
 void Interpreter::visit(WhileStatement& node) {
-    while (isTruthy(evaluate(node.condition.get()))) {
+    while (evaluateCondition(node.condition.get())) {
         execute(node.body.get());
+        if (returning) return;
+        if (HeapProfiler::enabled()) HeapProfiler::atLine(node.line);
+        spendFuel();
+    }
+}
+
+void Interpreter::executeLoopBody(Statement* body, bool reuseEnvironment, std::shared_ptr<Environment>& bodyEnvironment) {
+    auto block = static_cast<BlockStatement*>(body);
+    if (!reuseEnvironment || !block->needsEnvironment) {
+        execute(body);
+        return;
+    }
+    
+    // Emptied for each iteration, so a `let` doesn't carry over to the next
+    if (bodyEnvironment) {
+        bodyEnvironment->clear();
+    } else {
+        bodyEnvironment = newEnvironment(environment);
+    }
+    executeBlock(block->statements, bodyEnvironment);
+}
+
+void Interpreter::visit(ForStatement& node) {
+    if (!node.needsEnvironment) {
+        runForLoop(node);
+        return;
+    }
+    
+    auto previous = environment;
+    environment = newEnvironment(environment);
+    
+    try {
+        runForLoop(node);
+    } catch (...) {
+        environment = previous;
+        throw;
+    }
+    
+    environment = previous;
+}
+
+void Interpreter::runForLoop(ForStatement& node) {
+    if (node.initializer) execute(node.initializer.get());
+    
+    // Counted loops keep the counter in a double and write it straight into
+    // its slot; they fall back to the general clauses whenever the counter or
+    // the bound stops being a number. A frame slot is re-addressed on every
+    // use because calls in the body can grow the frame stack.
+    auto counterDeclaration = node.counter.empty() ? nullptr : static_cast<VarDeclaration*>(node.initializer.get());
+    if (counterDeclaration && counterDeclaration->numberSlot >= 0) {
+        runNumberForLoop(node, counterDeclaration->numberSlot);
+        return;
+    }
+    int counterSlot = counterDeclaration ? counterDeclaration->slot : -1;
+    FluxValue* counterLocal = nullptr;
+    if (counterDeclaration && counterDeclaration->cell >= 0) {
+        counterLocal = &cellStack[cellBase + counterDeclaration->cell]->value;
+    } else if (counterDeclaration && counterSlot < 0) {
+        counterLocal = environment->lookupLocal(node.counter);
+    }
+    auto counter = [&]() -> FluxValue* {
+        return counterSlot >= 0 ? &frameStack[frameBase + counterSlot] : counterLocal;
+    };
+    std::shared_ptr<Environment> bodyEnvironment;
+    
+    while (true) {
+        FluxValue* storage = counter();
+        const double* value = storage ? std::get_if<double>(storage) : nullptr;
+        if (value) {
+            double current = *value;
+            FluxValue bound = evaluate(node.counterBound);
+            auto limit = std::get_if<double>(&bound);
+            if (limit ? !compareNumbers(node.counterCompare, current, *limit)
+                      : !evaluateCondition(node.condition.get())) {
+                break;
+            }
+        } else if (node.condition && !evaluateCondition(node.condition.get())) {
+            break;
+        }
+        
+        executeLoopBody(node.body.get(), node.reuseBodyEnvironment, bodyEnvironment);
+        if (returning) return;
+        // The increment and the next test belong to the loop's line, not its body's last
+        if (HeapProfiler::enabled()) HeapProfiler::atLine(node.line);
+        
+        storage = counter();
+        value = storage ? std::get_if<double>(storage) : nullptr;
+        if (value) {
+            *storage = *value + node.counterStep;
+        } else if (node.increment) {
+            evaluate(node.increment.get());
+        }
+        spendFuel();
+    }
+}
+
+// Counted loop whose counter the TypeAnalyzer proved a number: it stays in
+// its unboxed slot, and only the bound can still be something else
+void Interpreter::runNumberForLoop(ForStatement& node, int counterSlot) {
+    std::shared_ptr<Environment> bodyEnvironment;
+    while (evaluateCondition(node.condition.get())) {
+        executeLoopBody(node.body.get(), node.reuseBodyEnvironment, bodyEnvironment);
+        if (returning) return;
+        numberStack[numberBase + counterSlot] += node.counterStep;
+        spendFuel();
+    }
+}
+
+void Interpreter::visit(ForInStatement& node) {
+    // The loop variable lives in a frame slot, a cell or its own loop environment
+    std::shared_ptr<Environment> loopEnvironment = environment;
+    FluxValue* local = nullptr;
+    if (node.cell >= 0) {
+        auto& cell = cellStack[cellBase + node.cell];
+        cell = makeAccounted<Upvalue>();
+        local = &cell->value;
+    } else if (node.slot < 0) {
+        loopEnvironment = newEnvironment(environment);
+        loopEnvironment->define(node.variable, nullptr);
+        local = loopEnvironment->lookupLocal(node.variable);
+    }
+    auto variable = [&]() -> FluxValue& {
+        return node.slot >= 0 ? frameStack[frameBase + node.slot] : *local;
+    };
+    std::shared_ptr<Environment> bodyEnvironment;
+    
+    // `for i in range(...)`: count in a double instead of boxing through a RangeIterator
+    std::shared_ptr<FluxIterator> iterator;
+    if (auto call = dynamic_cast<CallExpression*>(node.iterable.get())) {
+        FluxValue callee = evaluate(call->callee.get());
+        std::vector<FluxValue> arguments;
+        for (const auto& arg : call->arguments) {
+            arguments.push_back(evaluate(arg.get()));
+        }
+        
+        auto callable = std::get_if<std::shared_ptr<FluxCallable>>(&callee);
+        auto native = callable ? std::dynamic_pointer_cast<NativeFunction>(*callable) : nullptr;
+        if (native && native->name == "range") {
+            double start, end, step;
+            rangeArguments(arguments, start, end, step);
+            
+            auto previous = environment;
+            environment = loopEnvironment;
+            try {
+                for (double i = start; step > 0 ? i < end : i > end; i += step) {
+                    variable() = i;
+                    executeLoopBody(node.body.get(), node.reuseBodyEnvironment, bodyEnvironment);
+                    if (returning) break;
+                    spendFuel();
+                }
+            } catch (...) {
+                environment = previous;
+                throw;
+            }
+            environment = previous;
+            return;
+        }
+        
+        iterator = iterate(callValue(callee, arguments));
+    } else {
+        iterator = iterate(evaluate(node.iterable.get()));
+    }
+    
+    auto previous = environment;
+    try {
+        FluxValue item;
+        while (iterator->next(*this, item)) {
+            variable() = item;
+            environment = loopEnvironment;
+            executeLoopBody(node.body.get(), node.reuseBodyEnvironment, bodyEnvironment);
+            if (returning) break;
+            if (HeapProfiler::enabled()) HeapProfiler::atLine(node.line);
+            spendFuel();
+        }
+    } catch (...) {
+        environment = previous;
+        throw;
+    }
+    
+    environment = previous;
+}
+
+void Interpreter::visit(YieldStatement&) {
+    throw std::runtime_error("Cannot 'yield' outside a generator");
+}
+
+std::shared_ptr<FluxIterator> Interpreter::iterate(const FluxValue& iterable) {
+    if (auto iterator = std::get_if<std::shared_ptr<FluxIterator>>(&iterable)) {
+        return *iterator;
+    }
+    if (auto array = std::get_if<std::shared_ptr<FluxArray>>(&iterable)) {
+        return std::make_shared<ArrayIterator>(*array);
     }
+    throw std::runtime_error("Can only iterate over arrays and generators");
+}
+
+bool Interpreter::resumeGenerator(FluxGenerator& generator, FluxValue& value) {
+    if (generator.finished) return false;
+    if (generator.running) {
+        throw std::runtime_error("Generator " + generator.declaration->name + " is already running");
+    }
+    
+    SourceFrameScope frame(generator.declaration->name, generator.declaration->path, generator.declaration->line);
+    generator.running = true;
+    auto previous = environment;
+    auto previousUpvalues = upvalues;
+    upvalues = &generator.upvalues;
+    bool yielded = false;
+    
+    try {
+        yielded = runGenerator(generator, value);
+    } catch (...) {
+        generator.frames.clear();
+        generator.finished = true;
+        generator.running = false;
+        environment = previous;
+        upvalues = previousUpvalues;
+        throw;
+    }
+    
+    if (!yielded) {
+        // Ran off the end or hit `return`; either way the generator is done
+        returning = false;
+        generator.frames.clear();
+        generator.finished = true;
+    }
+    generator.running = false;
+    environment = previous;
+    upvalues = previousUpvalues;
+    return yielded;
+}
+
+bool Interpreter::runGenerator(FluxGenerator& generator, FluxValue& value) {
+    while (!generator.frames.empty() && !returning) {
+        GeneratorFrame& frame = generator.frames.back();
+        environment = frame.environment;
+        if (HeapProfiler::enabled()) HeapProfiler::atLine(frame.statement->line);
+        
+        if (auto block = dynamic_cast<BlockStatement*>(frame.statement)) {
+            if (frame.index >= block->statements.size()) {
+                generator.frames.pop_back();
+                continue;
+            }
+            Statement* next = block->statements[frame.index++].get();
+            if (enterGeneratorStatement(generator, next, value)) return true;
+        } else if (auto loop = dynamic_cast<WhileStatement*>(frame.statement)) {
+            spendFuel();
+            if (!evaluateCondition(loop->condition.get())) {
+                generator.frames.pop_back();
+                continue;
+            }
+            if (enterGeneratorStatement(generator, loop->body.get(), value)) return true;
+        } else if (auto forLoop = dynamic_cast<ForStatement*>(frame.statement)) {
+            spendFuel();
+            // index counts completed iterations; each later one starts with the increment
+            if (frame.index++ > 0 && forLoop->increment) evaluate(forLoop->increment.get());
+            if (forLoop->condition && !evaluateCondition(forLoop->condition.get())) {
+                generator.frames.pop_back();
+                continue;
+            }
+            if (enterGeneratorStatement(generator, forLoop->body.get(), value)) return true;
+        } else if (auto forIn = dynamic_cast<ForInStatement*>(frame.statement)) {
+            spendFuel();
+            FluxValue item;
+            if (!frame.iterator->next(*this, item)) {
+                generator.frames.pop_back();
+                continue;
+            }
+            frame.environment->define(forIn->variable, item);
+            environment = frame.environment;
+            if (enterGeneratorStatement(generator, forIn->body.get(), value)) return true;
+        } else {
+            generator.frames.pop_back();
+        }
+    }
+    
+    return false;
+}
+
+bool Interpreter::enterGeneratorStatement(FluxGenerator& generator, Statement* stmt, FluxValue& value) {
+    // Statements that cannot yield run straight through on the C++ stack
+    if (!generator.declaration->suspendPoints.count(stmt)) {
+        execute(stmt);
+        return false;
+    }
+    if (HeapProfiler::enabled()) HeapProfiler::atLine(stmt->line);
+    
+    if (auto yield = dynamic_cast<YieldStatement*>(stmt)) {
+        value = yield->value ? evaluate(yield->value.get()) : nullptr;
+        return true;
+    }
+    
+    if (auto ifStmt = dynamic_cast<IfStatement*>(stmt)) {
+        Statement* branch = evaluateCondition(ifStmt->condition.get()) ? ifStmt->thenBranch.get()
+                                                                        : ifStmt->elseBranch.get();
+        return branch ? enterGeneratorStatement(generator, branch, value) : false;
+    }
+    
+    if (dynamic_cast<BlockStatement*>(stmt)) {
+        generator.frames.push_back({stmt, newEnvironment(environment), 0, nullptr});
+    } else if (dynamic_cast<WhileStatement*>(stmt)) {
+        generator.frames.push_back({stmt, environment, 0, nullptr});
+    } else if (auto forLoop = dynamic_cast<ForStatement*>(stmt)) {
+        environment = newEnvironment(environment);
+        if (forLoop->initializer) execute(forLoop->initializer.get());
+        generator.frames.push_back({stmt, environment, 0, nullptr});
+    } else if (auto forIn = dynamic_cast<ForInStatement*>(stmt)) {
+        auto iterator = iterate(evaluate(forIn->iterable.get()));
+        auto loopEnvironment = newEnvironment(environment);
+        loopEnvironment->define(forIn->variable, nullptr);
+        generator.frames.push_back({stmt, loopEnvironment, 0, iterator});
+    }
+    
+    return false;
+}
+
+std::shared_ptr<MemoCache> Interpreter::memoCacheFor(FunctionDeclaration& declaration) {
+    if (!declaration.memoize) return nullptr;
+    auto memo = std::make_shared<MemoCache>();
+    memoCaches.emplace_back(declaration.name, memo);
+    return memo;
+}
+
+std::shared_ptr<FluxFunction> Interpreter::topLevelFunction(FunctionDeclaration& declaration) {
+    stats.closures++;
+    return makeAccounted<FluxFunction>(&declaration, globals, memoCacheFor(declaration));
 }
 
 void Interpreter::visit(FunctionDeclaration& node) {
-    auto function = std::make_shared<FluxFunction>(&node, environment);
-    environment->define(node.name, function);
+    std::shared_ptr<MemoCache> memo = memoCacheFor(node);
+    
+    // A captured function gets its cell first so it can capture itself
+    std::shared_ptr<Upvalue> cell;
+    if (node.cell >= 0) {
+        cell = cellStack[cellBase + node.cell] = makeAccounted<Upvalue>();
+    }
+    
+    auto function = makeAccounted<FluxFunction>(&node, environment, memo);
+    stats.closures++;
+    function->upvalues.reserve(node.upvalues.size());
+    for (const auto& source : node.upvalues) {
+        function->upvalues.push_back(source.fromCell ? cellStack[cellBase + source.index] : (*upvalues)[source.index]);
+    }
+    
+    if (node.slot >= 0) {
+        frameStack[frameBase + node.slot] = function;
+    } else if (cell) {
+        cell->value = function;
+    } else {
+        environment->define(node.name, function);
+    }
 }
 
 void Interpreter::visit(ReturnStatement& node) {
@@ -389,16 +1598,51 @@ void Interpreter::visit(ReturnStatement& node) {
     if (node.value) {
         value = evaluate(node.value.get());
     }
-    throw ReturnException(value);
+    
+    // Unwinds by flag rather than by exception: every statement sequence and
+    // loop stops as soon as it sees `returning`, and the call clears it
+    returnValue = std::move(value);
+    returning = true;
 }
 
 void Interpreter::visit(PrintStatement& node) {
     FluxValue value = evaluate(node.expression.get());
-    std::cout << stringify(value) << std::endl;
+    if (auto str = std::get_if<FluxString>(&value)) {
+        *output << *str << '\n';
+    } else {
+        *output << stringify(value) << '\n';
+    }
+}
+
+void Interpreter::visit(ImportStatement& node) {
+    std::filesystem::path path(node.path);
+    if (path.is_relative() && !moduleDirectory.empty()) {
+        path = std::filesystem::path(moduleDirectory) / path;
+    }
+    
+    Module* module = modules.load(path.string(), pureNativeNames(), optimization);
+    if (!module) return;
+    
+    // Imports are top-level only, so the module runs in the globals; its own
+    // imports resolve against its directory
+    std::string previousDirectory = moduleDirectory;
+    moduleDirectory = std::filesystem::path(module->path).parent_path().string();
+    SourceFrameScope frame(module->path, module->path, 0);
+    try {
+        visit(*module->program);
+    } catch (...) {
+        moduleDirectory = previousDirectory;
+        throw;
+    }
+    moduleDirectory = previousDirectory;
 }
 
 void Interpreter::visit(Program& node) {
     for (const auto& statement : node.statements) {
         execute(statement.get());
+        if (returning) {
+            returning = false;
+            break;
+        }
     }
 }
\ No newline at end of file
@@ -1,33 +1,114 @@
 #pragma once
 #include "ast.h"
+#include "memo.h"
+#include "memory.h"
+#include "module.h"
+#include "stats.h"
+#include "threadpool.h"
+#include <array>
+#include <cstdint>
 #include <unordered_map>
+#include <unordered_set>
 #include <string>
 #include <memory>
 #include <functional>
+#include <iterator>
+#include <ostream>
 
 // Forward declaration
 class FluxFunction;
-class ReturnException;
 
 // Environment for variable and function storage
 class Environment {
 public:
+    // Charged to the context that made the scope, like everything it holds
+    using Bindings = std::unordered_map<std::string, FluxValue, std::hash<std::string>, std::equal_to<std::string>,
+                                        AccountingAllocator<std::pair<const std::string, FluxValue>>>;
+    
     Environment(std::shared_ptr<Environment> parent = nullptr);
+    explicit Environment(const Bindings& bindings);
     
     void define(const std::string& name, FluxValue value);
     FluxValue get(const std::string& name);
     void assign(const std::string& name, FluxValue value);
+    const Bindings& bindings() const;
+    // Forgets the variables defined in this scope itself, keeping the parent
+    void clear();
+    // Storage of a variable defined in this scope itself, or nullptr; stays
+    // valid while the variable exists, so loops can update it in place
+    FluxValue* lookupLocal(const std::string& name);
+    // The same through the enclosing scopes
+    FluxValue* lookup(const std::string& name);
     
 private:
     std::shared_ptr<Environment> enclosing;
-    std::unordered_map<std::string, FluxValue> values;
+    Bindings values;
+};
+
+// Array value, shared by reference
+class FluxArray {
+public:
+    using Elements = std::vector<FluxValue, AccountingAllocator<FluxValue>>;
+    Elements elements;
+    
+    FluxArray(Elements elems = {}) : elements(std::move(elems)) {}
+    FluxArray(std::vector<FluxValue>&& elems)
+        : elements(std::make_move_iterator(elems.begin()), std::make_move_iterator(elems.end())) {}
+};
+
+// Source of values for `for x in ...` loops
+class FluxIterator {
+public:
+    virtual ~FluxIterator() = default;
+    // Produces the next value into `value`; false once exhausted
+    virtual bool next(class Interpreter& interpreter, FluxValue& value) = 0;
+    virtual std::string toString() const = 0;
+};
+
+// Iterates an array by position, so elements pushed during the loop are seen
+class ArrayIterator : public FluxIterator {
+public:
+    std::shared_ptr<FluxArray> array;
+    size_t position;
+    
+    ArrayIterator(std::shared_ptr<FluxArray> arr);
+    
+    bool next(Interpreter& interpreter, FluxValue& value) override;
+    std::string toString() const override;
+};
+
+// Lazy arithmetic progression produced by range(); for-in loops over a
+// direct range() call skip it and count in a plain double instead
+class RangeIterator : public FluxIterator {
+public:
+    double current;
+    double end;
+    double step;
+    
+    RangeIterator(double start, double end, double step);
+    
+    bool next(Interpreter& interpreter, FluxValue& value) override;
+    std::string toString() const override;
 };
 
-// Exception for return statements
-class ReturnException : public std::exception {
+// Lines of a file produced by read_lines(), each a view into the file's
+// mapping; only the line being handed out is ever touched
+class LineIterator : public FluxIterator {
 public:
+    FluxString contents;
+    size_t position;
+    
+    LineIterator(FluxString contents);
+    
+    bool next(Interpreter& interpreter, FluxValue& value) override;
+    std::string toString() const override;
+};
+
+// Shared storage for a local that a nested function captures. The declaring
+// call and every closure that references the local hold the same cell, so it
+// outlives the call exactly as long as some closure still needs it.
+struct Upvalue {
     FluxValue value;
-    ReturnException(FluxValue val) : value(val) {}
 };
 
 // Callable interface for functions
@@ -44,22 +125,61 @@ class FluxFunction : public FluxCallable {
 public:
     FunctionDeclaration* declaration;
     std::shared_ptr<Environment> closure;
+    std::shared_ptr<MemoCache> memo;  // set for memoized pure functions
+    // Cells of the free variables it references, as listed by declaration->upvalues
+    std::vector<std::shared_ptr<Upvalue>> upvalues;
     
-    FluxFunction(FunctionDeclaration* decl, std::shared_ptr<Environment> closure);
+    FluxFunction(FunctionDeclaration* decl, std::shared_ptr<Environment> closure,
+                 std::shared_ptr<MemoCache> memo = nullptr);
     
     int arity() const override;
     FluxValue call(Interpreter& interpreter, const std::vector<FluxValue>& arguments) override;
     std::string toString() const override;
+    
+private:
+    FluxValue invoke(Interpreter& interpreter, const std::vector<FluxValue>& arguments);
+};
+
+// One statement in progress inside a suspended generator
+struct GeneratorFrame {
+    Statement* statement;
+    std::shared_ptr<Environment> environment;
+    size_t index;                            // next statement of a block
+    std::shared_ptr<FluxIterator> iterator;  // source of a for-in loop
+};
+
+// Suspended call of a generator function. Its body runs as a stackless
+// coroutine: the statements on the path to each yield live on an explicit
+// frame stack rather than the C++ stack, so the generator can stop at a
+// yield and be resumed later from where it left off.
+class FluxGenerator : public FluxIterator {
+public:
+    FunctionDeclaration* declaration;
+    std::vector<GeneratorFrame> frames;
+    std::vector<std::shared_ptr<Upvalue>> upvalues;
+    bool running;
+    bool finished;
+    
+    FluxGenerator(FunctionDeclaration* decl, std::shared_ptr<Environment> environment);
+    
+    bool next(Interpreter& interpreter, FluxValue& value) override;
+    std::string toString() const override;
 };
 
 // Native function
 class NativeFunction : public FluxCallable {
 public:
     std::function<FluxValue(const std::vector<FluxValue>&)> function;
-    int paramCount;
+    // Natives that need the calling interpreter (e.g. to call back into Flux)
+    std::function<FluxValue(Interpreter&, const std::vector<FluxValue>&)> contextFunction;
+    int paramCount;  // -1 for natives that check their own argument count
     std::string name;
+    bool pure;  // result depends only on the arguments
     
-    NativeFunction(const std::string& n, int params, std::function<FluxValue(const std::vector<FluxValue>&)> func);
+    NativeFunction(const std::string& n, int params, std::function<FluxValue(const std::vector<FluxValue>&)> func,
+                   bool isPure = false);
+    NativeFunction(const std::string& n, int params,
+                   std::function<FluxValue(Interpreter&, const std::vector<FluxValue>&)> func);
     
     int arity() const override;
     FluxValue call(Interpreter& interpreter, const std::vector<FluxValue>& arguments) override;
@@ -70,39 +190,163 @@ public:
 class Interpreter : public Visitor {
 public:
     Interpreter();
+    // Isolated context over an existing globals snapshot, used by parallel
+    // workers; its allocations are charged to account
+    Interpreter(std::shared_ptr<Environment> globalsSnapshot, std::shared_ptr<MemoryAccount> account);
     
     void interpret(Program& program);
     void executeBlock(const std::vector<std::unique_ptr<Statement>>& statements, std::shared_ptr<Environment> environment);
     
+    // Names of the global natives that are safe to call from pure functions
+    std::unordered_set<std::string> pureNativeNames() const;
+    void printProfile(std::ostream& out) const;
+    
+    // Batch API: applies a pure function to every input on the worker pool,
+    // each worker running its own interpreter over a snapshot of the globals.
+    // Results come back in input order.
+    std::vector<FluxValue> parallelMap(const std::shared_ptr<FluxCallable>& function,
+                                       const std::vector<FluxValue>& inputs);
+    void setThreadCount(size_t threads);
+    // Joins the worker threads, e.g. before a fork; they restart on demand
+    void stopWorkerThreads();
+    
+    // Preemption, for running many scripts time-sliced by a Scheduler. With a
+    // quantum, every Flux call and loop iteration spends one unit of fuel,
+    // and each time the quantum is spent the interpreter yields the Fiber it
+    // runs on, to carry on when the fiber is resumed. 0, the default, never
+    // yields.
+    void setQuantum(uint64_t fuel);
+    // Where print and runtime errors go instead of stdout and stderr
+    void setOutput(std::ostream& out, std::ostream& errors);
+    
+    // Directory that relative imports of the main script resolve against
+    void setScriptPath(const std::string& path);
+    // The -O level imported modules and lazily parsed bodies are optimized at;
+    // see optimizer.h
+    void setOptimization(int level) { optimization = level; }
+    int optimizationLevel() const { return optimization; }
+    // Modules loaded by import, or restored from a snapshot
+    ModuleCache& moduleCache() { return modules; }
+    // Parses a lazily loaded function's body before its first call
+    void loadFunctionBody(FunctionDeclaration& declaration) const;
+    
+    // The value running a top-level function declaration binds to its name
+    std::shared_ptr<FluxFunction> topLevelFunction(FunctionDeclaration& declaration);
+    
+    // The text print shows for a value
+    std::string stringify(const FluxValue& value);
+    
+    // Calls a Flux or native function after checking its arity
+    FluxValue callValue(const FluxValue& callee, const std::vector<FluxValue>& arguments);
+    
+    // Scope chained to parent, counted in stats
+    std::shared_ptr<Environment> newEnvironment(std::shared_ptr<Environment> parent);
+    
+    // Runs a function body in env and returns what it returned (nil if nothing)
+    FluxValue executeFunctionBody(FunctionDeclaration* declaration, std::shared_ptr<Environment> env);
+    // Runs a framed function with its parameters and locals in a fresh frame
+    FluxValue executeFramed(FluxFunction& function, const std::vector<FluxValue>& arguments);
+    
+    // Runs a generator until its next yield; false once it has finished
+    bool resumeGenerator(FluxGenerator& generator, FluxValue& value);
+    
     // Visitor methods
     void visit(LiteralExpression& node) override;
     void visit(IdentifierExpression& node) override;
     void visit(BinaryExpression& node) override;
+    void visit(LogicalExpression& node) override;
     void visit(UnaryExpression& node) override;
     void visit(CallExpression& node) override;
+    void visit(ArrayExpression& node) override;
+    void visit(IndexExpression& node) override;
     void visit(ExpressionStatement& node) override;
     void visit(VarDeclaration& node) override;
     void visit(BlockStatement& node) override;
     void visit(IfStatement& node) override;
     void visit(WhileStatement& node) override;
+    void visit(ForStatement& node) override;
+    void visit(ForInStatement& node) override;
+    void visit(YieldStatement& node) override;
     void visit(FunctionDeclaration& node) override;
     void visit(ReturnStatement& node) override;
     void visit(PrintStatement& node) override;
+    void visit(ImportStatement& node) override;
     void visit(Program& node) override;
     
     std::shared_ptr<Environment> globals;
     std::shared_ptr<Environment> environment;
+    // Counters of this run, readable by embedders; see stats.h
+    RuntimeStats stats;
+    // What this context holds and may hold; see memory.h. Only allocations
+    // made while a MemoryScope for it is active are charged: interpret()
+    // opens one, and hosts that call into the context open their own.
+    std::shared_ptr<MemoryAccount> memory;
     
 private:
     FluxValue lastValue;
+    // Locals of framed functions; a call's slots start at frameBase
+    std::vector<FluxValue, AccountingAllocator<FluxValue>> frameStack;
+    size_t frameBase;
+    // Unboxed slots of the locals the TypeAnalyzer proved numbers or bools
+    // (as 0 and 1), per call like the frame stack
+    std::vector<double, AccountingAllocator<double>> numberStack;
+    size_t numberBase;
+    // Cells of captured locals, per call like the frame stack, and the
+    // upvalues of the closure that is running (nullptr at top level)
+    std::vector<std::shared_ptr<Upvalue>, AccountingAllocator<std::shared_ptr<Upvalue>>> cellStack;
+    size_t cellBase;
+    const std::vector<std::shared_ptr<Upvalue>>* upvalues;
+    // Pending `return`: set by a return statement, cleared by the call it exits
+    bool returning;
+    FluxValue returnValue;
+    std::vector<std::pair<std::string, std::shared_ptr<MemoCache>>> memoCaches;
+    std::array<size_t, static_cast<size_t>(Superinstruction::Count)> superinstructionHits{};
+    size_t cachedHits = 0;
+    // Fuel left until the next yield; see setQuantum
+    int64_t fuel;
+    uint64_t quantum;
+    std::ostream* output;
+    std::ostream* errors;
+    std::unique_ptr<WorkStealingPool> pool;
+    size_t threadCount;
+    int optimization;
+    ModuleCache modules;
+    std::string scriptPath;       // of the main script, for heap profiles
+    std::string moduleDirectory;  // of the file whose top level is running
     
     FluxValue evaluate(Expression* expr);
+    bool evaluateCondition(Expression* expr);
+    const FluxValue& evaluateCached(Expression* expr);
+    double evaluateNumber(Expression* expr);
+    double unboxedNumber(Expression* expr);
+    double evaluateUnboxed(Expression* expr);
     void execute(Statement* stmt);
+    // At every call and loop back-edge
+    void spendFuel() {
+        if (--fuel <= 0) refuel();
+    }
+    void refuel();
     bool isTruthy(FluxValue value);
     bool isEqual(FluxValue left, FluxValue right);
-    std::string stringify(FluxValue value);
+    FluxValue concatenate(const FluxValue& left, const FluxValue& right);
+    // open holds the arrays being printed around this one, so a cycle prints as [...]
+    std::string stringify(const FluxValue& value, std::vector<const FluxArray*>& open);
     void checkNumberOperand(const std::string& op, FluxValue operand);
     void checkNumberOperands(const std::string& op, FluxValue left, FluxValue right);
+    BinaryKind specializeBinary(BinaryOp op, const FluxValue& left, const FluxValue& right);
+    FluxValue binaryGeneric(BinaryExpression& node, const FluxValue& left, const FluxValue& right);
+    const double* fusedNumber(const FusedOperand& operand) const;
+    bool testFused(BinaryExpression& node, bool& result);
     
     void defineNativeFunctions();
+    std::shared_ptr<MemoCache> memoCacheFor(FunctionDeclaration& declaration);
+    bool isPureCallable(const std::shared_ptr<FluxCallable>& callable) const;
+    WorkStealingPool& workerPool();
+    std::shared_ptr<FluxIterator> iterate(const FluxValue& iterable);
+    static void rangeArguments(const std::vector<FluxValue>& arguments, double& start, double& end, double& step);
+    void executeLoopBody(Statement* body, bool reuseEnvironment, std::shared_ptr<Environment>& bodyEnvironment);
+    void runForLoop(ForStatement& node);
+    void runNumberForLoop(ForStatement& node, int counterSlot);
+    bool runGenerator(FluxGenerator& generator, FluxValue& value);
+    bool enterGeneratorStatement(FluxGenerator& generator, Statement* stmt, FluxValue& value);
 };
\ No newline at end of file
@@ -1,36 +1,205 @@
 #include "lexer.h"
-#include <cctype>
+#include <algorithm>
+#include <cstring>
 #include <iostream>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
-std::unordered_map<std::string, TokenType> Lexer::keywords = {
-    {"let", TokenType::LET},
-    {"fun", TokenType::FUN},
-    {"if", TokenType::IF},
-    {"else", TokenType::ELSE},
-    {"while", TokenType::WHILE},
-    {"for", TokenType::FOR},
-    {"true", TokenType::TRUE},
-    {"false", TokenType::FALSE},
-    {"nil", TokenType::NIL},
-    {"return", TokenType::RETURN},
-    {"print", TokenType::PRINT},
-    {"and", TokenType::AND},
-    {"or", TokenType::OR},
-    {"not", TokenType::NOT}
+namespace {
+
+// Character classes, looked up by table instead of <cctype> calls
+enum CharClass : unsigned char {
+    BLANK = 1,        // ' ', '\t', '\r'
+    DIGIT = 2,
+    IDENT_START = 4,  // letters and '_'
+    IDENT = 8,        // letters, digits and '_'
+    NUMBER = 16       // digits and '.'
+};
+
+struct CharTable {
+    unsigned char classes[256];
+    
+    constexpr CharTable() : classes() {
+        classes[static_cast<unsigned char>(' ')] = BLANK;
+        classes[static_cast<unsigned char>('\t')] = BLANK;
+        classes[static_cast<unsigned char>('\r')] = BLANK;
+        for (int c = '0'; c <= '9'; c++) classes[c] = DIGIT | IDENT | NUMBER;
+        for (int c = 'a'; c <= 'z'; c++) classes[c] = IDENT_START | IDENT;
+        for (int c = 'A'; c <= 'Z'; c++) classes[c] = IDENT_START | IDENT;
+        classes[static_cast<unsigned char>('_')] = IDENT_START | IDENT;
+        classes[static_cast<unsigned char>('.')] = NUMBER;
+    }
+};
+
+constexpr CharTable charTable;
+
+inline bool hasClass(char c, unsigned char charClass) {
+    return charTable.classes[static_cast<unsigned char>(c)] & charClass;
+}
+
+// Length of the run of characters of charClass starting at p. With SSE2 each
+// class is tested as a few byte-range compares over 16 bytes; the scalar loop
+// finishes the tail.
+size_t classRun(const char* p, const char* end, unsigned char charClass) {
+    const char* start = p;
+#if defined(__SSE2__)
+    while (end - p >= 16) {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        __m128i match;
+        if (charClass == BLANK) {
+            match = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, _mm_set1_epi8(' ')),
+                                              _mm_cmpeq_epi8(chunk, _mm_set1_epi8('\t'))),
+                                 _mm_cmpeq_epi8(chunk, _mm_set1_epi8('\r')));
+        } else {
+            // Signed compares: bytes >= 0x80 are negative and never match
+            __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(chunk, _mm_set1_epi8('0' - 1)),
+                                          _mm_cmplt_epi8(chunk, _mm_set1_epi8('9' + 1)));
+            if (charClass == NUMBER) {
+                match = _mm_or_si128(digit, _mm_cmpeq_epi8(chunk, _mm_set1_epi8('.')));
+            } else {
+                // Setting bit 5 folds upper case onto lower case without
+                // moving any non-letter into 'a'..'z'
+                __m128i folded = _mm_or_si128(chunk, _mm_set1_epi8(0x20));
+                __m128i letter = _mm_and_si128(_mm_cmpgt_epi8(folded, _mm_set1_epi8('a' - 1)),
+                                               _mm_cmplt_epi8(folded, _mm_set1_epi8('z' + 1)));
+                match = _mm_or_si128(_mm_or_si128(letter, digit), _mm_cmpeq_epi8(chunk, _mm_set1_epi8('_')));
+            }
+        }
+        unsigned mismatch = ~static_cast<unsigned>(_mm_movemask_epi8(match)) & 0xFFFF;
+        if (mismatch) return (p - start) + __builtin_ctz(mismatch);
+        p += 16;
+    }
+#endif
+    while (p < end && hasClass(*p, charClass)) p++;
+    return p - start;
+}
+
+// Operator and delimiter tokens by first character; withEqual is the token
+// the character forms when followed by '=' (==, !=, <=, >=)
+struct OperatorTokens {
+    TokenType single;
+    TokenType withEqual;
+};
+
+struct OperatorTable {
+    OperatorTokens entries[256];
+    
+    constexpr OperatorTable() : entries() {
+        for (auto& entry : entries) entry = {TokenType::INVALID, TokenType::INVALID};
+        set('(', TokenType::LEFT_PAREN);
+        set(')', TokenType::RIGHT_PAREN);
+        set('{', TokenType::LEFT_BRACE);
+        set('}', TokenType::RIGHT_BRACE);
+        set('[', TokenType::LEFT_BRACKET);
+        set(']', TokenType::RIGHT_BRACKET);
+        set(',', TokenType::COMMA);
+        set(';', TokenType::SEMICOLON);
+        set('+', TokenType::PLUS);
+        set('-', TokenType::MINUS);
+        set('*', TokenType::MULTIPLY);
+        set('/', TokenType::DIVIDE);
+        set('%', TokenType::MODULO);
+        set('=', TokenType::ASSIGN, TokenType::EQUAL);
+        set('!', TokenType::NOT, TokenType::NOT_EQUAL);
+        set('<', TokenType::LESS, TokenType::LESS_EQUAL);
+        set('>', TokenType::GREATER, TokenType::GREATER_EQUAL);
+    }
+    
+    constexpr void set(char c, TokenType single, TokenType withEqual = TokenType::INVALID) {
+        entries[static_cast<unsigned char>(c)] = {single, withEqual};
+    }
+};
+
+constexpr OperatorTable operatorTable;
+
+struct Keyword {
+    const char* text;
+    size_t length;
+    TokenType type;
+};
+
+constexpr Keyword keywordList[] = {
+    {"let", 3, TokenType::LET},
+    {"fun", 3, TokenType::FUN},
+    {"if", 2, TokenType::IF},
+    {"else", 4, TokenType::ELSE},
+    {"while", 5, TokenType::WHILE},
+    {"for", 3, TokenType::FOR},
+    {"true", 4, TokenType::TRUE},
+    {"false", 5, TokenType::FALSE},
+    {"nil", 3, TokenType::NIL},
+    {"return", 6, TokenType::RETURN},
+    {"print", 5, TokenType::PRINT},
+    {"memo", 4, TokenType::MEMO},
+    {"yield", 5, TokenType::YIELD},
+    {"in", 2, TokenType::IN},
+    {"and", 3, TokenType::AND},
+    {"or", 2, TokenType::OR},
+    {"not", 3, TokenType::NOT},
+    {"import", 6, TokenType::IMPORT}
+};
+
+// Perfect hash over the keywords: first and last character plus length. Any
+// identifier hashes to at most one keyword, which is then compared in full.
+constexpr size_t KEYWORD_TABLE_SIZE = 64;
+
+constexpr size_t keywordHash(const char* text, size_t length) {
+    return (static_cast<unsigned char>(text[0]) * 2 + static_cast<unsigned char>(text[length - 1]) * 23 + length) &
+           (KEYWORD_TABLE_SIZE - 1);
+}
+
+struct KeywordTable {
+    int slots[KEYWORD_TABLE_SIZE];  // index into keywordList, -1 when empty
+    bool perfect;
+    
+    constexpr KeywordTable() : slots(), perfect(true) {
+        for (size_t i = 0; i < KEYWORD_TABLE_SIZE; i++) slots[i] = -1;
+        for (size_t i = 0; i < sizeof(keywordList) / sizeof(keywordList[0]); i++) {
+            size_t hash = keywordHash(keywordList[i].text, keywordList[i].length);
+            if (slots[hash] >= 0) perfect = false;
+            slots[hash] = static_cast<int>(i);
+        }
+    }
 };
 
+constexpr KeywordTable keywordTable;
+static_assert(keywordTable.perfect, "keyword hash has a collision; adjust keywordHash's multipliers");
+
+TokenType keywordOrIdentifier(const char* text, size_t length) {
+    int index = keywordTable.slots[keywordHash(text, length)];
+    if (index < 0) return TokenType::IDENTIFIER;
+    const Keyword& keyword = keywordList[index];
+    if (keyword.length != length || std::memcmp(keyword.text, text, length) != 0) return TokenType::IDENTIFIER;
+    return keyword.type;
+}
+
+}
+
 Lexer::Lexer(const std::string& source) 
     : source(source), current(0), line(1), column(1) {}
 
 std::vector<Token> Lexer::tokenize() {
     std::vector<Token> tokens;
+    tokens.reserve(source.size() / 3 + 1);
+    // Newlines inside parentheses and brackets don't end a statement, so
+    // argument lists and array literals can span lines
+    int nesting = 0;
     
-    while (!isAtEnd()) {
+    while (true) {
         skipWhitespace();
-        
         if (isAtEnd()) break;
         
-        char c = peek();
+        const char* start = source.data() + current;
+        char c = *start;
+        
+        if (c == '\n') {
+            if (nesting == 0) tokens.emplace_back(TokenType::NEWLINE, "\\n", line, column);
+            current++;
+            line++;
+            column = 1;
+            continue;
+        }
         
         // Skip comments
         if (c == '/' && peekNext() == '/') {
@@ -38,81 +207,27 @@ std::vector<Token> Lexer::tokenize() {
             continue;
         }
         
-        Token token(TokenType::INVALID, "", line, column);
-        
-        switch (c) {
-            case '(': token = makeToken(TokenType::LEFT_PAREN, "("); advance(); break;
-            case ')': token = makeToken(TokenType::RIGHT_PAREN, ")"); advance(); break;
-            case '{': token = makeToken(TokenType::LEFT_BRACE, "{"); advance(); break;
-            case '}': token = makeToken(TokenType::RIGHT_BRACE, "}"); advance(); break;
-            case ',': token = makeToken(TokenType::COMMA, ","); advance(); break;
-            case ';': token = makeToken(TokenType::SEMICOLON, ";"); advance(); break;
-            case '+': token = makeToken(TokenType::PLUS, "+"); advance(); break;
-            case '-': token = makeToken(TokenType::MINUS, "-"); advance(); break;
-            case '*': token = makeToken(TokenType::MULTIPLY, "*"); advance(); break;
-            case '/': token = makeToken(TokenType::DIVIDE, "/"); advance(); break;
-            case '%': token = makeToken(TokenType::MODULO, "%"); advance(); break;
-            case '\n': token = makeToken(TokenType::NEWLINE, "\\n"); advance(); line++; column = 1; break;
-            
-            case '=':
-                advance();
-                if (peek() == '=') {
-                    token = makeToken(TokenType::EQUAL, "==");
-                    advance();
-                } else {
-                    token = makeToken(TokenType::ASSIGN, "=");
-                }
-                break;
-                
-            case '!':
-                advance();
-                if (peek() == '=') {
-                    token = makeToken(TokenType::NOT_EQUAL, "!=");
-                    advance();
-                } else {
-                    token = makeToken(TokenType::NOT, "!");
-                }
-                break;
-                
-            case '<':
-                advance();
-                if (peek() == '=') {
-                    token = makeToken(TokenType::LESS_EQUAL, "<=");
-                    advance();
-                } else {
-                    token = makeToken(TokenType::LESS, "<");
-                }
-                break;
-                
-            case '>':
-                advance();
-                if (peek() == '=') {
-                    token = makeToken(TokenType::GREATER_EQUAL, ">=");
-                    advance();
-                } else {
-                    token = makeToken(TokenType::GREATER, ">");
-                }
-                break;
-                
-            case '"':
-                token = makeString();
-                break;
-                
-            default:
-                if (std::isdigit(c)) {
-                    token = makeNumber();
-                } else if (std::isalpha(c) || c == '_') {
-                    token = makeIdentifier();
-                } else {
-                    std::cerr << "Unexpected character: " << c << " at line " << line << std::endl;
-                    advance();
-                    continue;
-                }
-                break;
-        }
-        
-        if (token.type != TokenType::INVALID) {
-            tokens.push_back(token);
+        const OperatorTokens& op = operatorTable.entries[static_cast<unsigned char>(c)];
+        if (op.single != TokenType::INVALID) {
+            size_t length = op.withEqual != TokenType::INVALID && peekNext() == '=' ? 2 : 1;
+            TokenType type = length == 2 ? op.withEqual : op.single;
+            tokens.emplace_back(type, std::string_view(start, length), line, column);
+            advanceBy(length);
+            if (type == TokenType::LEFT_PAREN || type == TokenType::LEFT_BRACKET) {
+                nesting++;
+            } else if ((type == TokenType::RIGHT_PAREN || type == TokenType::RIGHT_BRACKET) && nesting > 0) {
+                nesting--;
+            }
+        } else if (c == '"') {
+            Token token = makeString();
+            if (token.type != TokenType::INVALID) tokens.push_back(token);
+        } else if (hasClass(c, DIGIT)) {
+            tokens.push_back(makeNumber());
+        } else if (hasClass(c, IDENT_START)) {
+            tokens.push_back(makeIdentifier());
+        } else {
+            std::cerr << "Unexpected character: " << c << " at line " << line << std::endl;
+            advance();
         }
     }
     
@@ -135,51 +250,56 @@ char Lexer::peek() const {
     return source[current];
 }
 
+void Lexer::advanceBy(size_t count) {
+    current += count;
+    column += static_cast<int>(count);
+}
+
 char Lexer::peekNext() const {
     if (current + 1 >= source.length()) return '\0';
     return source[current + 1];
 }
 
 void Lexer::skipWhitespace() {
-    while (!isAtEnd()) {
-        char c = peek();
-        if (c == ' ' || c == '\t' || c == '\r') {
-            advance();
-        } else {
-            break;
-        }
-    }
+    // Most gaps are a single space; only longer runs go to the vector scan
+    if (isAtEnd() || !hasClass(source[current], BLANK)) return;
+    const char* text = source.data();
+    advanceBy(classRun(text + current, text + source.size(), BLANK));
 }
 
 void Lexer::skipComment() {
-    while (!isAtEnd() && peek() != '\n') {
-        advance();
-    }
+    // Comments run to the end of the line; memchr scans a word at a time
+    const char* start = source.data() + current;
+    const void* newline = std::memchr(start, '\n', source.size() - current);
+    advanceBy(newline ? static_cast<const char*>(newline) - start : source.size() - current);
 }
 
 Token Lexer::makeNumber() {
+    const char* text = source.data();
+    size_t start = current;
     int startColumn = column;
-    std::string number;
-    
-    while (!isAtEnd() && (std::isdigit(peek()) || peek() == '.')) {
-        number += advance();
-    }
-    
-    return Token(TokenType::NUMBER, number, line, startColumn);
+    advanceBy(classRun(text + current, text + source.size(), NUMBER));
+    return Token(TokenType::NUMBER, std::string_view(text + start, current - start), line, startColumn);
 }
 
 Token Lexer::makeString() {
     int startColumn = column;
     advance(); // Skip opening quote
     
-    std::string value;
-    while (!isAtEnd() && peek() != '"') {
-        if (peek() == '\n') {
-            line++;
-            column = 1;
-        }
-        value += advance();
+    size_t start = current;
+    const void* quote = std::memchr(source.data() + start, '"', source.size() - start);
+    size_t end = quote ? static_cast<const char*>(quote) - source.data() : source.size();
+    std::string_view value(source.data() + start, end - start);
+    
+    // Strings may span lines
+    size_t lastNewline = value.rfind('\n');
+    if (lastNewline == std::string_view::npos) {
+        column += static_cast<int>(value.size());
+    } else {
+        line += static_cast<int>(std::count(value.begin(), value.end(), '\n'));
+        column = static_cast<int>(value.size() - lastNewline);
     }
+    current = end;
     
     if (isAtEnd()) {
         std::cerr << "Unterminated string at line " << line << std::endl;
@@ -191,20 +311,15 @@ Token Lexer::makeString() {
 }
 
 Token Lexer::makeIdentifier() {
+    const char* text = source.data();
+    size_t start = current;
     int startColumn = column;
-    std::string identifier;
-    
-    while (!isAtEnd() && (std::isalnum(peek()) || peek() == '_')) {
-        identifier += advance();
-    }
-    
-    // Check if it's a keyword
-    auto it = keywords.find(identifier);
-    TokenType type = (it != keywords.end()) ? it->second : TokenType::IDENTIFIER;
+    advanceBy(classRun(text + current, text + source.size(), IDENT));
     
-    return Token(type, identifier, line, startColumn);
+    std::string_view identifier(text + start, current - start);
+    return Token(keywordOrIdentifier(identifier.data(), identifier.size()), identifier, line, startColumn);
 }
 
-Token Lexer::makeToken(TokenType type, const std::string& lexeme) {
+Token Lexer::makeToken(TokenType type, std::string_view lexeme) {
     return Token(type, lexeme, line, column);
 }
\ No newline at end of file
@@ -1,7 +1,7 @@
 #pragma once
 #include <string>
+#include <string_view>
 #include <vector>
-#include <unordered_map>
 
 enum class TokenType {
     // Literals
@@ -21,6 +21,10 @@ enum class TokenType {
     NIL,
     RETURN,
     PRINT,
+    MEMO,
+    YIELD,
+    IN,
+    IMPORT,
     
     // Operators
     PLUS,
@@ -44,6 +48,8 @@ enum class TokenType {
     RIGHT_PAREN,
     LEFT_BRACE,
     RIGHT_BRACE,
+    LEFT_BRACKET,
+    RIGHT_BRACKET,
     COMMA,
     SEMICOLON,
     
@@ -53,20 +59,26 @@ enum class TokenType {
     INVALID
 };
 
+// A token's lexeme points into the source held by the Lexer that produced it,
+// so the Lexer must outlive its tokens
 struct Token {
     TokenType type;
-    std::string lexeme;
+    std::string_view lexeme;
     int line;
     int column;
     
-    Token(TokenType t, const std::string& l, int ln, int col) 
+    Token(TokenType t, std::string_view l, int ln, int col) 
         : type(t), lexeme(l), line(ln), column(col) {}
 };
 
+// Scans runs of blanks, identifier and number characters and comment bodies
+// 16 bytes at a time where SSE2 is available, classifies single characters by
+// table and recognizes keywords with a perfect hash checked at compile time.
 class Lexer {
 public:
     Lexer(const std::string& source);
     std::vector<Token> tokenize();
+    const std::string& text() const { return source; }
     
 private:
     std::string source;
@@ -74,8 +86,6 @@ private:
     int line;
     int column;
     
-    static std::unordered_map<std::string, TokenType> keywords;
-    
     bool isAtEnd() const;
     char advance();
     char peek() const;
@@ -85,5 +95,6 @@ private:
     Token makeNumber();
     Token makeString();
     Token makeIdentifier();
-    Token makeToken(TokenType type, const std::string& lexeme = "");
+    Token makeToken(TokenType type, std::string_view lexeme = {});
+    void advanceBy(size_t count);
 };
\ No newline at end of file
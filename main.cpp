@@ -1,28 +1,202 @@
+#include <algorithm>
+#include <cctype>
 #include <iostream>
 #include <fstream>
 #include <sstream>
 #include <string>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "emitcpp.h"
+#include "heapprofile.h"
 #include "lexer.h"
 #include "parser.h"
 #include "interpreter.h"
+#include "module.h"
+#include "purity.h"
+#include "records.h"
+#include "scheduler.h"
+#include "server.h"
+#include "snapshot.h"
+#include "trace.h"
+#include "types.h"
 
 class FluxInterpreter {
 private:
     Interpreter interpreter;
+    // Charges everything run on this thread, including calls from --each and
+    // --serve, to the interpreter's account
+    MemoryScope memoryScope{interpreter.memory};
+    // Everything compiled so far. Functions point into the AST they were
+    // declared in, so each unit lives as long as the interpreter.
+    std::vector<std::unique_ptr<Module>> units;
+    // Purity state across the REPL's inputs; null when running a script
+    std::unique_ptr<PurityAnalyzer> session;
     
 public:
+    bool profile = false;
+    bool stats = false;
+    bool dumpTypes = false;
+    int optimization = 0;  // -O level; see optimizer.h
+    
+    void setOptimization(int level) {
+        optimization = level;
+        interpreter.setOptimization(level);
+    }
+    
+    void setStats(bool enabled) {
+        stats = enabled;
+        interpreter.stats.timeNatives = enabled;
+    }
+    
+    void setThreadCount(size_t threads) {
+        interpreter.setThreadCount(threads);
+    }
+    
+    void setMemoryLimit(size_t bytes) {
+        interpreter.memory->setLimit(bytes);
+    }
+    
+    // Runs the script's top level once, then answers requests with its
+    // handle() function; see server.h
+    int runServer(const std::string& path, const std::string& socketPath, size_t workers) {
+        std::string source;
+        if (!readSource(path, source)) return 1;
+        
+        interpreter.setScriptPath(path);
+        run(source, path);
+        return serve(interpreter, socketPath, workers, std::cin, std::cout);
+    }
+    
+    bool loadSnapshot(const std::string& path) {
+        try {
+            TraceScope trace("snapshot", "compile");
+            readSnapshot(path, interpreter);
+            return true;
+        } catch (const std::exception& e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+            return false;
+        }
+    }
+    
+    bool saveSnapshot(const std::string& path) {
+        try {
+            std::vector<const Module*> ran;
+            for (const auto& unit : units) {
+                ran.push_back(unit.get());
+            }
+            writeSnapshot(path, interpreter, ran);
+            return true;
+        } catch (const std::exception& e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+            return false;
+        }
+    }
+    
     void runFile(const std::string& path) {
-        std::ifstream file(path);
-        if (!file.is_open()) {
-            std::cerr << "Error: Could not open file " << path << std::endl;
-            return;
+        std::string source;
+        if (!readSource(path, source)) return;
+        
+        interpreter.setScriptPath(path);
+        run(source, path);
+        
+        report();
+    }
+    
+    // Runs the script's top level once, then calls its each() function for
+    // every record on stdin with the record also bound to the global
+    // `record`, and finally its finish() function if it has one
+    void runEach(const std::string& path, RecordFormat format) {
+        std::string source;
+        if (!readSource(path, source)) return;
+        
+        interpreter.setScriptPath(path);
+        run(source, path);
+        
+        try {
+            const auto& globals = interpreter.globals->bindings();
+            if (!globals.count("each")) {
+                throw std::runtime_error("--each requires the script to define a function each(record)");
+            }
+            FluxValue handler = globals.at("each");
+            auto callable = std::get_if<std::shared_ptr<FluxCallable>>(&handler);
+            bool passRecord = !callable || (*callable)->arity() != 0;
+            
+            interpreter.globals->define("record", nullptr);
+            FluxValue* slot = interpreter.globals->lookupLocal("record");
+            // Untied, so reading a record doesn't flush what earlier ones printed
+            std::cin.tie(nullptr);
+            RecordReader reader(std::cin, format);
+            std::vector<FluxValue> arguments;
+            FluxValue record;
+            while (reader.next(record)) {
+                *slot = record;
+                arguments.clear();
+                if (passRecord) arguments.push_back(std::move(record));
+                interpreter.callValue(handler, arguments);
+            }
+            
+            if (globals.count("finish")) {
+                interpreter.callValue(globals.at("finish"), {});
+            }
+        } catch (const std::exception& e) {
+            std::cerr << "Runtime error: " << e.what() << std::endl;
         }
         
-        std::stringstream buffer;
-        buffer << file.rdbuf();
-        std::string source = buffer.str();
+        report();
+    }
+    
+    // Runs the script as one of the tasks of a Scheduler: it yields its
+    // thread every `quantum` calls and loop iterations, and writes its
+    // output and errors to out and err
+    void runScheduled(const std::string& path, uint64_t quantum, std::ostream& out, std::ostream& err) {
+        std::unique_ptr<Module> unit;
+        {
+            // The lexer and parser report errors straight to stderr
+            static std::mutex compileMutex;
+            std::lock_guard<std::mutex> lock(compileMutex);
+            std::string source;
+            if (!readSource(path, source)) return;
+            interpreter.setScriptPath(path);
+            unit = compile(source, path);
+        }
+        if (!unit) return;
         
-        run(source);
+        interpreter.setOutput(out, err);
+        interpreter.setQuantum(quantum);
+        Program& program = *unit->program;
+        units.push_back(std::move(unit));
+        interpreter.interpret(program);
+        report(err);
+    }
+    
+    // Translates the script to C++ without running it; see emitcpp.h
+    bool emitCpp(const std::string& path, const std::string& outputPath) {
+        std::string source;
+        if (!readSource(path, source)) return false;
+        
+        try {
+            auto unit = compile(source, path);
+            if (!unit) return false;
+            
+            std::ostringstream code;
+            ::emitCpp(*unit->program, path, interpreter.pureNativeNames(), code);
+            if (outputPath.empty()) {
+                std::cout << code.str();
+                return true;
+            }
+            
+            std::ofstream file(outputPath);
+            if (!file.is_open()) {
+                throw std::runtime_error("Could not write " + outputPath);
+            }
+            file << code.str();
+            return true;
+        } catch (const std::exception& e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+            return false;
+        }
     }
     
     void runPrompt() {
@@ -30,69 +204,386 @@ public:
         std::cout << "Type 'exit' to quit the REPL" << std::endl;
         std::cout << std::endl;
         
+        session = std::make_unique<PurityAnalyzer>(interpreter.pureNativeNames());
+        std::string source;
         std::string line;
         while (true) {
-            std::cout << "flux> ";
+            std::cout << (source.empty() ? "flux> " : "  ... ");
             if (!std::getline(std::cin, line)) {
                 break;
             }
             
-            if (line == "exit" || line == "quit") {
-                break;
+            if (source.empty()) {
+                if (line == "exit" || line == "quit") {
+                    break;
+                }
+                if (line.empty()) continue;
             }
             
-            if (line.empty()) continue;
+            // Input with open brackets or an open string continues on the next line
+            source += line;
+            source += '\n';
+            if (isIncomplete(source)) continue;
             
-            run(line);
+            run(source, "<stdin>");
+            source.clear();
         }
         
+        report();
         std::cout << "Goodbye!" << std::endl;
     }
     
 private:
-    void run(const std::string& source) {
-        try {
-            // Tokenize
-            Lexer lexer(source);
-            auto tokens = lexer.tokenize();
-            
-            // Parse
-            Parser parser(tokens);
-            auto program = parser.parse();
-            
-            if (!program) {
-                std::cerr << "Parsing failed" << std::endl;
-                return;
+    void report(std::ostream& out = std::cerr) {
+        if (profile) interpreter.printProfile(out);
+        if (stats) {
+            interpreter.stats.peakMemory = interpreter.memory->peak();
+            interpreter.stats.writeJson(out);
+        }
+    }
+    
+    static bool readSource(const std::string& path, std::string& source) {
+        std::ifstream file(path);
+        if (!file.is_open()) {
+            std::cerr << "Error: Could not open file " << path << std::endl;
+            return false;
+        }
+        
+        std::stringstream buffer;
+        buffer << file.rdbuf();
+        source = buffer.str();
+        return true;
+    }
+    
+    // Lexes, parses and analyzes source; nullptr if it doesn't parse
+    std::unique_ptr<Module> compile(const std::string& source, const std::string& name) {
+        auto unit = std::make_unique<Module>();
+        unit->path = name;
+        unit->lexer = std::make_unique<Lexer>(source);
+        
+        // Tokenize
+        std::vector<Token> tokens;
+        {
+            TraceScope trace("lex", "compile");
+            tokens = unit->lexer->tokenize();
+        }
+        
+        // Parse
+        {
+            TraceScope trace("parse", "compile");
+            Parser parser(tokens, false, name);
+            unit->program = parser.parse();
+        }
+        
+        if (!unit->program) {
+            std::cerr << "Parsing failed" << std::endl;
+            return nullptr;
+        }
+        
+        // Analyze
+        {
+            TraceScope trace("analyze", "compile");
+            if (session) {
+                analyzeUnit(*unit->program, *session, optimization);
+            } else {
+                analyzeProgram(*unit->program, interpreter.pureNativeNames(), optimization);
             }
+        }
+        if (dumpTypes) ::dumpTypes(*unit->program, std::cerr);
+        return unit;
+    }
+    
+    void run(const std::string& source, const std::string& name) {
+        try {
+            auto unit = compile(source, name);
+            if (!unit) return;
             
             // Interpret
-            interpreter.interpret(*program);
+            Program& program = *unit->program;
+            units.push_back(std::move(unit));
+            TraceScope trace("execute", "run", &interpreter.stats);
+            interpreter.interpret(program);
             
         } catch (const std::exception& e) {
             std::cerr << "Error: " << e.what() << std::endl;
         }
     }
+    
+    // True while brackets are unbalanced or a string is unterminated
+    static bool isIncomplete(const std::string& source) {
+        int depth = 0;
+        bool inString = false;
+        for (size_t i = 0; i < source.size(); i++) {
+            char c = source[i];
+            if (inString) {
+                if (c == '"') inString = false;
+            } else if (c == '"') {
+                inString = true;
+            } else if (c == '/' && i + 1 < source.size() && source[i + 1] == '/') {
+                i = source.find('\n', i);
+                if (i == std::string::npos) break;
+            } else if (c == '(' || c == '{' || c == '[') {
+                depth++;
+            } else if (c == ')' || c == '}' || c == ']') {
+                depth--;
+            }
+        }
+        return inString || depth > 0;
+    }
 };
 
+// A byte count with an optional K, M or G suffix, e.g. 64M
+bool parseByteCount(const std::string& text, size_t& bytes) {
+    // std::stoull would skip spaces and wrap a minus sign around
+    if (text.empty() || !std::isdigit(static_cast<unsigned char>(text[0]))) return false;
+    size_t end = 0;
+    try {
+        bytes = std::stoull(text, &end);
+    } catch (const std::exception&) {
+        return false;
+    }
+    
+    std::string suffix = text.substr(end);
+    if (suffix == "K" || suffix == "k") {
+        bytes <<= 10;
+    } else if (suffix == "M" || suffix == "m") {
+        bytes <<= 20;
+    } else if (suffix == "G" || suffix == "g") {
+        bytes <<= 30;
+    } else if (!suffix.empty()) {
+        return false;
+    }
+    return bytes > 0;
+}
+
+// A count in plain decimal digits, e.g. the 4 of --threads=4
+bool parseCount(const std::string& text, size_t& count) {
+    if (text.empty() || text.find_first_not_of("0123456789") != std::string::npos) return false;
+    try {
+        count = std::stoull(text);
+    } catch (const std::exception&) {
+        return false;
+    }
+    return true;
+}
+
 void printUsage() {
-    std::cout << "Usage: flux [script]" << std::endl;
+    std::cout << "Usage: flux [options] [script]" << std::endl;
+    std::cout << "       flux --schedule[=THREADS] [options] script..." << std::endl;
     std::cout << "  script: Path to a .flux file to execute" << std::endl;
     std::cout << "  (no args): Start interactive REPL" << std::endl;
+    std::cout << "Options:" << std::endl;
+    std::cout << "  --profile: Print memoization and superinstruction statistics to stderr after the run" << std::endl;
+    std::cout << "  --stats: Print run counters (calls, allocations, call depth, native time, peak memory) as JSON to stderr after the run" << std::endl;
+    std::cout << "  --memory-limit=BYTES: Stop the script with a runtime error once it holds more than BYTES (K, M or G suffix)" << std::endl;
+    std::cout << "  -O[0|1|2]: Cache loop invariants (1) and repeated subexpressions too (2, the default for -O)" << std::endl;
+    std::cout << "  --dump-types: Print the inferred type of every function's locals to stderr before running" << std::endl;
+    std::cout << "  --trace=FILE: Write a Chrome trace of calls and compile phases to FILE" << std::endl;
+    std::cout << "  --heap-profile=FILE: Write a pprof profile of the bytes allocated by each function and line to FILE" << std::endl;
+    std::cout << "  --heap-profile-rate=BYTES: Sample about one allocation per BYTES allocated (default: 512K)" << std::endl;
+    std::cout << "  --each[=lines|csv|jsonl]: Call the script's each(record) for every record on stdin" << std::endl;
+    std::cout << "  --emit-cpp[=FILE]: Translate the script to a C++ program on stdout or in FILE instead of running it" << std::endl;
+    std::cout << "  --snapshot-out=FILE: Save the globals to FILE after the script has run" << std::endl;
+    std::cout << "  --snapshot-in=FILE: Start from the globals saved in FILE" << std::endl;
+    std::cout << "  --serve[=SOCKET]: Answer requests, one per line, with the script's handle(request)," << std::endl;
+    std::cout << "      from stdin or from workers forked to serve a Unix socket" << std::endl;
+    std::cout << "  --workers=N: Worker processes for --serve=SOCKET (default: one per core)" << std::endl;
+    std::cout << "  --threads=N: Worker threads for parallel_map (default: one per core)" << std::endl;
+    std::cout << "  --schedule[=THREADS]: Run several scripts at once, time-sliced over THREADS threads (default: one per core)" << std::endl;
+    std::cout << "  --quantum=N: Calls and loop iterations per time slice for --schedule (default: 10000)" << std::endl;
+}
+
+// Writes the trace and heap profile asked for; false, having said so, if one couldn't be written
+bool finishProfiles() {
+    bool written = true;
+    if (!Tracer::finish()) {
+        std::cerr << "Error: Could not write trace file" << std::endl;
+        written = false;
+    }
+    if (!HeapProfiler::finish()) {
+        std::cerr << "Error: Could not write heap profile" << std::endl;
+        written = false;
+    }
+    return written;
 }
 
 int main(int argc, char* argv[]) {
+    // Output is flushed when the program ends or before reading input, not per line
+    std::ios::sync_with_stdio(false);
+    
     FluxInterpreter fluxInterpreter;
+    std::string script;
+    bool each = false;
+    RecordFormat format = RecordFormat::Lines;
+    std::string snapshotIn;
+    std::string snapshotOut;
+    bool server = false;
+    std::string socketPath;
+    size_t workers = 0;
+    bool emit = false;
+    std::string emitPath;
+    bool schedule = false;
+    size_t scheduleThreads = 0;
+    uint64_t quantum = 10000;
+    std::vector<std::string> scripts;
+    size_t memoryLimit = 0;
+    size_t poolThreads = 0;
+    std::string heapProfilePath;
+    size_t heapProfileRate = HeapProfiler::DefaultRate;
     
-    if (argc > 2) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--profile") {
+            fluxInterpreter.profile = true;
+        } else if (arg == "--stats") {
+            fluxInterpreter.setStats(true);
+        } else if (arg == "-O" || arg == "-O0" || arg == "-O1" || arg == "-O2") {
+            fluxInterpreter.setOptimization(arg == "-O" ? 2 : arg[2] - '0');
+        } else if (arg == "--dump-types") {
+            fluxInterpreter.dumpTypes = true;
+        } else if (arg == "--each" || arg == "--each=lines") {
+            each = true;
+        } else if (arg == "--each=csv") {
+            each = true;
+            format = RecordFormat::Csv;
+        } else if (arg == "--each=jsonl") {
+            each = true;
+            format = RecordFormat::Jsonl;
+        } else if (arg == "--emit-cpp") {
+            emit = true;
+        } else if (arg.rfind("--emit-cpp=", 0) == 0) {
+            emit = true;
+            emitPath = arg.substr(11);
+        } else if (arg == "--serve") {
+            server = true;
+        } else if (arg.rfind("--serve=", 0) == 0) {
+            server = true;
+            socketPath = arg.substr(8);
+        } else if (arg.rfind("--workers=", 0) == 0) {
+            if (!parseCount(arg.substr(10), workers)) {
+                printUsage();
+                return 1;
+            }
+        } else if (arg.rfind("--snapshot-in=", 0) == 0) {
+            snapshotIn = arg.substr(14);
+        } else if (arg.rfind("--snapshot-out=", 0) == 0) {
+            snapshotOut = arg.substr(15);
+        } else if (arg.rfind("--trace=", 0) == 0) {
+            Tracer::start(arg.substr(8));
+        } else if (arg.rfind("--heap-profile=", 0) == 0) {
+            heapProfilePath = arg.substr(15);
+        } else if (arg.rfind("--heap-profile-rate=", 0) == 0) {
+            if (!parseByteCount(arg.substr(20), heapProfileRate)) {
+                printUsage();
+                return 1;
+            }
+        } else if (arg.rfind("--memory-limit=", 0) == 0) {
+            size_t limit;
+            if (!parseByteCount(arg.substr(15), limit)) {
+                printUsage();
+                return 1;
+            }
+            fluxInterpreter.setMemoryLimit(limit);
+            memoryLimit = limit;
+        } else if (arg.rfind("--threads=", 0) == 0) {
+            if (!parseCount(arg.substr(10), poolThreads)) {
+                printUsage();
+                return 1;
+            }
+            fluxInterpreter.setThreadCount(poolThreads);
+        } else if (arg == "--schedule") {
+            schedule = true;
+        } else if (arg.rfind("--schedule=", 0) == 0) {
+            schedule = true;
+            if (!parseCount(arg.substr(11), scheduleThreads)) {
+                printUsage();
+                return 1;
+            }
+        } else if (arg.rfind("--quantum=", 0) == 0) {
+            size_t fuel;
+            if (!parseCount(arg.substr(10), fuel)) {
+                printUsage();
+                return 1;
+            }
+            quantum = fuel;
+        } else if (arg.rfind("-", 0) == 0) {
+            printUsage();
+            return 1;
+        } else {
+            script = arg;
+            scripts.push_back(arg);
+        }
+    }
+    
+    if (scripts.size() > 1 && !schedule) {
         printUsage();
         return 1;
-    } else if (argc == 2) {
+    }
+    
+    if (!heapProfilePath.empty()) HeapProfiler::start(heapProfilePath, heapProfileRate);
+    
+    if (schedule) {
+        if (scripts.empty() || each || server || emit || !snapshotIn.empty() || !snapshotOut.empty() || quantum == 0) {
+            printUsage();
+            return 1;
+        }
+        if (scheduleThreads == 0) scheduleThreads = std::max(1u, std::thread::hardware_concurrency());
+        
+        // Every script gets an interpreter of its own, made on its fiber
+        try {
+            Scheduler scheduler(scheduleThreads);
+            for (const auto& path : scripts) {
+                scheduler.add([&, path](std::ostream& out, std::ostream& err) {
+                    FluxInterpreter task;
+                    task.profile = fluxInterpreter.profile;
+                    task.setStats(fluxInterpreter.stats);
+                    task.setOptimization(fluxInterpreter.optimization);
+                    task.dumpTypes = fluxInterpreter.dumpTypes;
+                    task.setMemoryLimit(memoryLimit);
+                    task.setThreadCount(poolThreads);
+                    task.runScheduled(path, quantum, out, err);
+                });
+            }
+            scheduler.run(std::cout, std::cerr);
+        } catch (const std::exception& e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+            return 1;
+        }
+        return finishProfiles() ? 0 : 1;
+    }
+    
+    if ((each || server || emit) && script.empty()) {
+        printUsage();
+        return 1;
+    }
+    
+    if (!snapshotIn.empty() && !fluxInterpreter.loadSnapshot(snapshotIn)) {
+        return 1;
+    }
+    
+    if (emit) {
+        return fluxInterpreter.emitCpp(script, emitPath) ? 0 : 1;
+    }
+    
+    if (server) {
+        // Answer requests until stdin ends or the server is stopped
+        int status = fluxInterpreter.runServer(script, socketPath, workers);
+        finishProfiles();
+        return status;
+    } else if (each) {
+        // Run once per input record
+        fluxInterpreter.runEach(script, format);
+    } else if (!script.empty()) {
         // Run file
-        fluxInterpreter.runFile(argv[1]);
+        fluxInterpreter.runFile(script);
     } else {
         // Start REPL
         fluxInterpreter.runPrompt();
     }
     
-    return 0;
+    if (!snapshotOut.empty() && !fluxInterpreter.saveSnapshot(snapshotOut)) {
+        return 1;
+    }
+    
+    return finishProfiles() ? 0 : 1;
 }
\ No newline at end of file
@@ -0,0 +1,58 @@
+#include "mappedfile.h"
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+std::shared_ptr<MappedFile> MappedFile::open(const std::string& path) {
+    std::shared_ptr<MappedFile> file(new MappedFile());
+    
+#ifndef _WIN32
+    int descriptor = ::open(path.c_str(), O_RDONLY);
+    if (descriptor < 0) {
+        throw std::runtime_error("Could not open file '" + path + "'");
+    }
+    
+    struct stat info;
+    if (fstat(descriptor, &info) != 0 || !S_ISREG(info.st_mode)) {
+        ::close(descriptor);
+        throw std::runtime_error("Could not read file '" + path + "'");
+    }
+    
+    file->length = static_cast<size_t>(info.st_size);
+    if (file->length > 0) {
+        void* address = mmap(nullptr, file->length, PROT_READ, MAP_PRIVATE, descriptor, 0);
+        if (address == MAP_FAILED) {
+            ::close(descriptor);
+            throw std::runtime_error("Could not map file '" + path + "'");
+        }
+        // Scripts mostly scan front to back; let the kernel read ahead
+        madvise(address, file->length, MADV_SEQUENTIAL);
+        file->begin = static_cast<const char*>(address);
+        file->mapped = true;
+    }
+    ::close(descriptor);
+#else
+    std::ifstream input(path, std::ios::binary);
+    if (!input.is_open()) {
+        throw std::runtime_error("Could not open file '" + path + "'");
+    }
+    file->contents.assign(std::istreambuf_iterator<char>(input), std::istreambuf_iterator<char>());
+    file->begin = file->contents.data();
+    file->length = file->contents.size();
+#endif
+    
+    return file;
+}
+
+MappedFile::~MappedFile() {
+#ifndef _WIN32
+    if (mapped) munmap(const_cast<char*>(begin), length);
+#endif
+}
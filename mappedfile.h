@@ -0,0 +1,29 @@
+#pragma once
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+
+// A file mapped read-only into memory. Strings read from it view the mapping
+// and share ownership of it, so it is unmapped once the last one is gone.
+// Where mmap isn't available the file is read into memory instead.
+class MappedFile {
+public:
+    // Throws std::runtime_error if the file can't be opened or mapped
+    static std::shared_ptr<MappedFile> open(const std::string& path);
+    ~MappedFile();
+    
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    
+    const char* data() const { return begin; }
+    size_t size() const { return length; }
+    
+private:
+    MappedFile() = default;
+    
+    const char* begin = nullptr;
+    size_t length = 0;
+    bool mapped = false;
+    std::vector<char> contents;  // when not mapped
+};
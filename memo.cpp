@@ -0,0 +1,78 @@
+#include "memo.h"
+#include <functional>
+#include <string>
+
+size_t FluxArgumentsHash::operator()(const std::vector<FluxValue>& args) const {
+    size_t seed = args.size();
+    for (const auto& arg : args) {
+        size_t h = 0;
+        if (auto num = std::get_if<double>(&arg)) {
+            h = std::hash<double>()(*num);
+        } else if (auto str = std::get_if<FluxString>(&arg)) {
+            h = str->hash();
+        } else if (auto b = std::get_if<bool>(&arg)) {
+            h = *b ? 0x9e37 : 0x79b9;
+        }
+        seed ^= h + 0x9e3779b97f4a7c15ULL + (seed << 6) + (seed >> 2);
+    }
+    return seed;
+}
+
+MemoCache::MemoCache(size_t capacity)
+    : hits(0), misses(0), evictions(0), maxEntries(capacity > 0 ? capacity : 1) {}
+
+bool MemoCache::isCacheable(const std::vector<FluxValue>& args) {
+    for (const auto& arg : args) {
+        if (!isCacheable(arg)) return false;
+    }
+    return true;
+}
+
+bool MemoCache::isCacheable(const FluxValue& value) {
+    return !std::holds_alternative<std::shared_ptr<FluxCallable>>(value) &&
+           !std::holds_alternative<std::shared_ptr<FluxArray>>(value) &&
+           !std::holds_alternative<std::shared_ptr<FluxIterator>>(value);
+}
+
+bool MemoCache::lookup(const std::vector<FluxValue>& args, FluxValue& result) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = index.find(args);
+    if (it == index.end()) {
+        misses++;
+        return false;
+    }
+    
+    entries.splice(entries.begin(), entries, it->second);
+    result = it->second->second;
+    hits++;
+    return true;
+}
+
+void MemoCache::insert(const std::vector<FluxValue>& args, const FluxValue& result) {
+    if (!isCacheable(result)) return;
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = index.find(args);
+    if (it != index.end()) {
+        it->second->second = result;
+        entries.splice(entries.begin(), entries, it->second);
+        return;
+    }
+    
+    if (entries.size() >= maxEntries) {
+        index.erase(entries.back().first);
+        entries.pop_back();
+        evictions++;
+    }
+    
+    entries.emplace_front(args, result);
+    index[args] = entries.begin();
+}
+
+size_t MemoCache::size() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return entries.size();
+}
+
+size_t MemoCache::capacity() const {
+    return maxEntries;
+}
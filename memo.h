@@ -0,0 +1,46 @@
+#pragma once
+#include "ast.h"
+#include <cstddef>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Hash for argument lists of scalar Flux values (numbers, strings, booleans, nil)
+struct FluxArgumentsHash {
+    size_t operator()(const std::vector<FluxValue>& args) const;
+};
+
+// Bounded LRU cache of results for a memoized pure function, keyed by
+// argument values. Thread-safe so parallel_map workers can share it.
+class MemoCache {
+public:
+    static const size_t DefaultCapacity = 4096;
+    
+    explicit MemoCache(size_t capacity = DefaultCapacity);
+    
+    // Only scalar arguments are cached; callables, arrays and generators have identity, not value
+    static bool isCacheable(const std::vector<FluxValue>& args);
+    static bool isCacheable(const FluxValue& value);
+    
+    bool lookup(const std::vector<FluxValue>& args, FluxValue& result);
+    // Results that aren't scalars are not kept either: every caller must get
+    // an array or iterator of its own, not one an earlier caller changed
+    void insert(const std::vector<FluxValue>& args, const FluxValue& result);
+    
+    size_t size() const;
+    size_t capacity() const;
+    
+    size_t hits;
+    size_t misses;
+    size_t evictions;
+    
+private:
+    using Entry = std::pair<std::vector<FluxValue>, FluxValue>;
+    
+    size_t maxEntries;
+    mutable std::mutex mutex;
+    std::list<Entry> entries;  // most recently used first
+    std::unordered_map<std::vector<FluxValue>, std::list<Entry>::iterator, FluxArgumentsHash> index;
+};
@@ -0,0 +1,82 @@
+#include "memory.h"
+#include "heapprofile.h"
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+namespace {
+
+thread_local std::shared_ptr<MemoryAccount> activeAccount;
+thread_local uintptr_t stackBase = 0;  // address the outermost scope was entered at
+thread_local size_t stackBudget = 0;
+
+size_t threadStackBudget() {
+    static const size_t budget = [] {
+        size_t size = 1 << 20;  // the default on Windows
+#ifndef _WIN32
+        // Threads get the same size as the main thread, or 2 MB when it is unlimited
+        size = 2 << 20;
+        rlimit limit;
+        if (getrlimit(RLIMIT_STACK, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY) {
+            size = static_cast<size_t>(limit.rlim_cur);
+        }
+#endif
+        return size / 4 * 3;
+    }();
+    return budget;
+}
+
+}
+
+void MemoryAccount::charge(size_t bytes) {
+    size_t total = current.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+    size_t cap = limit();
+    if (cap != 0 && total > cap) {
+        current.fetch_sub(bytes, std::memory_order_relaxed);
+        throw MemoryLimitError("Memory limit of " + std::to_string(cap) + " bytes exceeded");
+    }
+    
+    size_t seen = highWater.load(std::memory_order_relaxed);
+    while (total > seen && !highWater.compare_exchange_weak(seen, total, std::memory_order_relaxed)) {}
+    
+    if (HeapProfiler::enabled()) HeapProfiler::allocated(bytes);
+}
+
+const std::shared_ptr<MemoryAccount>& MemoryAccount::active() noexcept {
+    return activeAccount;
+}
+
+void MemoryAccount::checkStack() {
+    char here;
+    if (stackBase != 0 && stackBase - reinterpret_cast<uintptr_t>(&here) > stackBudget) {
+        throw MemoryLimitError("Stack limit of " + std::to_string(stackBudget) + " bytes exceeded");
+    }
+}
+
+uintptr_t MemoryAccount::stackFloor() noexcept {
+    return stackBase != 0 ? stackBase - stackBudget : 0;
+}
+
+MemoryContext exchangeMemoryContext(MemoryContext context) {
+    MemoryContext previous{std::move(activeAccount), stackBase, stackBudget};
+    activeAccount = std::move(context.account);
+    stackBase = context.stackBase;
+    stackBudget = context.stackBudget;
+    return previous;
+}
+
+MemoryScope::MemoryScope(std::shared_ptr<MemoryAccount> account)
+    : previous(std::move(activeAccount)), outermost(stackBase == 0) {
+    activeAccount = std::move(account);
+    if (outermost) {
+        char here;
+        stackBase = reinterpret_cast<uintptr_t>(&here);
+        stackBudget = threadStackBudget();
+    }
+}
+
+MemoryScope::~MemoryScope() {
+    activeAccount = std::move(previous);
+    if (outermost) stackBase = 0;
+}
@@ -0,0 +1,126 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+// Raised when a context would go past its memory limit. It unwinds like any
+// other runtime error, so the script stops with a runtime error while the
+// host and its other contexts carry on.
+class MemoryLimitError : public std::runtime_error {
+public:
+    explicit MemoryLimitError(const std::string& message) : std::runtime_error(message) {}
+};
+
+// Bytes held on behalf of one interpreter context: its environments,
+// strings, closures, arrays and frames. parallel_map workers charge the
+// account of the interpreter that started them, so the counters are atomic.
+class MemoryAccount {
+public:
+    // Throws MemoryLimitError, charging nothing, if bytes would take the
+    // account past its limit
+    void charge(size_t bytes);
+    void release(size_t bytes) noexcept { current.fetch_sub(bytes, std::memory_order_relaxed); }
+    
+    size_t used() const noexcept { return current.load(std::memory_order_relaxed); }
+    size_t peak() const noexcept { return highWater.load(std::memory_order_relaxed); }
+    // 0 when unlimited, the default
+    size_t limit() const noexcept { return max.load(std::memory_order_relaxed); }
+    void setLimit(size_t bytes) noexcept { max.store(bytes, std::memory_order_relaxed); }
+    // Starts measuring the peak of a new run from what is held now
+    void resetPeak() noexcept { highWater.store(used(), std::memory_order_relaxed); }
+    
+    // The account this thread's allocations are charged to, or nullptr
+    static const std::shared_ptr<MemoryAccount>& active() noexcept;
+    
+    // Throws MemoryLimitError once the native stack below this thread's
+    // outermost MemoryScope outgrows its budget, three quarters of the
+    // thread's (or fiber's) stack, so deep recursion fails like an exhausted
+    // heap rather than overflowing the stack
+    static void checkStack();
+    // The lowest address the stack may reach before checkStack throws, 0
+    // outside any MemoryScope
+    static uintptr_t stackFloor() noexcept;
+    
+private:
+    std::atomic<size_t> current{0};
+    std::atomic<size_t> highWater{0};
+    std::atomic<size_t> max{0};
+};
+
+// What the MemoryScopes on a thread have set up. A Fiber carries its own,
+// with the budget of its stack, and swaps it in while it runs.
+struct MemoryContext {
+    std::shared_ptr<MemoryAccount> account;
+    uintptr_t stackBase = 0;  // 0 until the outermost MemoryScope
+    size_t stackBudget = 0;
+};
+
+// Installs context on this thread, returning the one it replaces
+MemoryContext exchangeMemoryContext(MemoryContext context);
+
+// Charges a thread's allocations to account until it goes out of scope. The
+// outermost scope on a thread also marks where its stack budget starts.
+class MemoryScope {
+public:
+    explicit MemoryScope(std::shared_ptr<MemoryAccount> account);
+    ~MemoryScope();
+    
+    MemoryScope(const MemoryScope&) = delete;
+    MemoryScope& operator=(const MemoryScope&) = delete;
+    
+private:
+    std::shared_ptr<MemoryAccount> previous;
+    bool outermost;
+};
+
+// Standard allocator charging the account that was active when it was made,
+// or nothing without one. Containers copied from an accounted one keep
+// charging the same account.
+template <typename T>
+class AccountingAllocator {
+public:
+    using value_type = T;
+    
+    AccountingAllocator() noexcept : account(MemoryAccount::active()) {}
+    explicit AccountingAllocator(std::shared_ptr<MemoryAccount> account) noexcept : account(std::move(account)) {}
+    template <typename U>
+    AccountingAllocator(const AccountingAllocator<U>& other) noexcept : account(other.account) {}
+    
+    T* allocate(size_t count) {
+        if (account) account->charge(count * sizeof(T));
+        try {
+            return static_cast<T*>(::operator new(count * sizeof(T)));
+        } catch (...) {
+            if (account) account->release(count * sizeof(T));
+            throw;
+        }
+    }
+    
+    void deallocate(T* pointer, size_t count) noexcept {
+        if (account) account->release(count * sizeof(T));
+        ::operator delete(pointer);
+    }
+    
+    template <typename U>
+    bool operator==(const AccountingAllocator<U>& other) const noexcept { return account == other.account; }
+    template <typename U>
+    bool operator!=(const AccountingAllocator<U>& other) const noexcept { return account != other.account; }
+    
+private:
+    template <typename U>
+    friend class AccountingAllocator;
+    
+    std::shared_ptr<MemoryAccount> account;
+};
+
+// make_shared for objects a context owns: the object and its control block
+// are charged to the active account
+template <typename T, typename... Args>
+std::shared_ptr<T> makeAccounted(Args&&... args) {
+    return std::allocate_shared<T>(AccountingAllocator<T>(), std::forward<Args>(args)...);
+}
@@ -0,0 +1,143 @@
+#include "module.h"
+#include "optimizer.h"
+#include "parser.h"
+#include "peephole.h"
+#include "purity.h"
+#include "resolver.h"
+#include "trace.h"
+#include "types.h"
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+void analyzeProgram(Program& program, const std::unordered_set<std::string>& pureNatives, int optimization) {
+    Resolver resolver;
+    resolver.resolve(program);
+    
+    TypeAnalyzer types;
+    types.analyze(program);
+    
+    PeepholeOptimizer peephole;
+    peephole.optimize(program);
+    
+    PurityAnalyzer purity(pureNatives);
+    purity.analyze(program);
+    
+    if (optimization > 0) {
+        TraceScope trace("optimize", "compile");
+        Optimizer optimizer(optimization, pureNatives);
+        optimizer.optimize(program);
+    }
+}
+
+void analyzeUnit(Program& unit, PurityAnalyzer& purity, int optimization) {
+    Resolver resolver;
+    resolver.resolve(unit);
+    
+    TypeAnalyzer types;
+    types.analyze(unit);
+    
+    PeepholeOptimizer peephole;
+    peephole.optimize(unit);
+    
+    purity.analyzeUnit(unit);
+    
+    if (optimization > 0) {
+        TraceScope trace("optimize", "compile");
+        Optimizer optimizer(optimization, purity.nativeNames());
+        optimizer.optimize(unit);
+    }
+}
+
+void ensureFunctionBody(FunctionDeclaration& function, const std::unordered_set<std::string>& pureNatives,
+                        int optimization) {
+    LazyBody& lazy = *function.lazyBody;
+    if (lazy.parsed.load(std::memory_order_acquire)) return;
+    
+    std::lock_guard<std::mutex> lock(lazy.mutex);
+    if (lazy.parsed.load(std::memory_order_relaxed)) return;
+    
+    // A top-level function resolves the same alone as within its module
+    TraceScope trace(function.name, "compile");
+    try {
+        Parser::parseFunctionBody(function);
+    } catch (const std::runtime_error& e) {
+        throw std::runtime_error("Could not parse module '" + function.path + "': " + e.what());
+    }
+    Resolver resolver;
+    resolver.resolveFunction(function);
+    TypeAnalyzer types;
+    types.analyzeFunction(function);
+    PeepholeOptimizer peephole;
+    function.accept(peephole);
+    PurityAnalyzer purity(pureNatives);
+    purity.analyzeFunction(function);
+    if (optimization > 0) {
+        Optimizer optimizer(optimization, pureNatives);
+        function.accept(optimizer);
+    }
+    
+    lazy.parsed.store(true, std::memory_order_release);
+}
+
+Module* ModuleCache::load(const std::string& path, const std::unordered_set<std::string>& pureNatives,
+                          int optimization) {
+    std::string key = ModuleCache::key(path);
+    if (modules.count(key)) return nullptr;
+    
+    TraceScope trace(path, "import");
+    std::ifstream file(path);
+    if (!file.is_open()) {
+        throw std::runtime_error("Could not open module '" + path + "'");
+    }
+    std::stringstream buffer;
+    buffer << file.rdbuf();
+    
+    auto module = std::make_unique<Module>();
+    module->path = key;
+    module->lexer = std::make_unique<Lexer>(buffer.str());
+    auto tokens = module->lexer->tokenize();
+    Parser parser(tokens, true, path);
+    module->program = parser.parse();
+    if (!module->program) {
+        throw std::runtime_error("Could not parse module '" + path + "'");
+    }
+    analyzeProgram(*module->program, pureNatives, optimization);
+    
+    // Registered before it runs, so a cyclic import finds it loaded
+    Module* loaded = module.get();
+    modules[key] = std::move(module);
+    return loaded;
+}
+
+void ModuleCache::adopt(std::unique_ptr<Module> module) {
+    // Several REPL inputs share one name; they're kept, but only the first is found
+    if (modules.count(module->path)) {
+        unkeyed.push_back(std::move(module));
+    } else {
+        std::string path = module->path;
+        modules[path] = std::move(module);
+    }
+}
+
+std::vector<const Module*> ModuleCache::loaded() const {
+    std::vector<const Module*> result;
+    for (const auto& entry : modules) {
+        result.push_back(entry.second.get());
+    }
+    for (const auto& module : unkeyed) {
+        result.push_back(module.get());
+    }
+    return result;
+}
+
+std::string ModuleCache::key(const std::string& path) {
+    std::error_code error;
+    std::string key = std::filesystem::weakly_canonical(path, error).string();
+    return error ? path : key;
+}
+
+size_t ModuleCache::size() const {
+    return modules.size();
+}
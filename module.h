@@ -0,0 +1,57 @@
+#pragma once
+#include "ast.h"
+#include "lexer.h"
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+class PurityAnalyzer;
+
+// The passes every parsed program goes through before it runs: slot
+// resolution, type inference, superinstruction fusion and purity analysis,
+// then the Optimizer when optimization, the -O level, is above 0
+void analyzeProgram(Program& program, const std::unordered_set<std::string>& pureNatives, int optimization = 0);
+
+// The same passes over one unit of a program compiled in pieces, like the
+// REPL's inputs. Its purity is solved together with the units before it,
+// whose functions the same analyzer has already seen.
+void analyzeUnit(Program& unit, PurityAnalyzer& purity, int optimization = 0);
+
+// Parses and analyzes the body of a lazily loaded function if that hasn't
+// happened yet. Safe to call from several threads.
+void ensureFunctionBody(FunctionDeclaration& function, const std::unordered_set<std::string>& pureNatives,
+                        int optimization = 0);
+
+// A source file loaded by `import`. It is kept for the life of the
+// interpreter: functions it declared point into its AST, and the bodies
+// still unparsed view into its source.
+struct Module {
+    std::string path;
+    std::unique_ptr<Lexer> lexer;
+    std::unique_ptr<Program> program;
+};
+
+// Loaded modules keyed by canonical path, so each file is read, parsed and run
+// once however many times it is imported
+class ModuleCache {
+public:
+    // Loads the module at path with lazy function bodies; nullptr if it was
+    // loaded before, including a module still running (an import cycle)
+    Module* load(const std::string& path, const std::unordered_set<std::string>& pureNatives, int optimization = 0);
+    // Takes over a module that was parsed elsewhere, such as one restored from
+    // a snapshot, so that importing its path does nothing
+    void adopt(std::unique_ptr<Module> module);
+    
+    // Every module held, in no particular order
+    std::vector<const Module*> loaded() const;
+    size_t size() const;
+    
+    // The key a path is cached under
+    static std::string key(const std::string& path);
+    
+private:
+    std::unordered_map<std::string, std::unique_ptr<Module>> modules;
+    std::vector<std::unique_ptr<Module>> unkeyed;  // adopted under a path already taken
+};
@@ -0,0 +1,334 @@
+#include "optimizer.h"
+#include <algorithm>
+#include <functional>
+#include <sstream>
+#include <unordered_map>
+#include <vector>
+
+namespace {
+
+bool isGlobal(const IdentifierExpression& identifier) {
+    return identifier.slot < 0 && identifier.numberSlot < 0 && identifier.cell < 0 && identifier.upvalue < 0;
+}
+
+// A loop or statement that cached values last one run of: the locals it
+// stores to and the globals it calls
+struct Region {
+    std::unordered_set<int> slots;
+    std::unordered_set<int> numberSlots;
+    std::vector<std::string> natives;
+    bool callsOnlyNatives = true;  // and imports nothing
+};
+
+class RegionScanner : public RecursiveVisitor {
+public:
+    Region region;
+
+    explicit RegionScanner(const std::unordered_set<std::string>& pureNatives) : pureNatives(pureNatives) {}
+
+    void visit(BinaryExpression& node) override {
+        RecursiveVisitor::visit(node);
+        if (node.op != BinaryOp::Assign) return;
+        if (auto target = dynamic_cast<IdentifierExpression*>(node.left.get())) {
+            store(target->slot, target->numberSlot);
+        }
+    }
+
+    void visit(CallExpression& node) override {
+        RecursiveVisitor::visit(node);
+        auto callee = dynamic_cast<IdentifierExpression*>(node.callee.get());
+        if (!callee || !isGlobal(*callee) || !pureNatives.count(callee->name)) {
+            region.callsOnlyNatives = false;
+        } else if (std::find(region.natives.begin(), region.natives.end(), callee->name) == region.natives.end()) {
+            region.natives.push_back(callee->name);
+        }
+    }
+
+    void visit(VarDeclaration& node) override {
+        RecursiveVisitor::visit(node);
+        store(node.slot, node.numberSlot);
+    }
+
+    void visit(ForInStatement& node) override {
+        store(node.slot, -1);
+        RecursiveVisitor::visit(node);
+    }
+
+    void visit(FunctionDeclaration& node) override {
+        store(node.slot, -1);
+    }
+
+    void visit(ImportStatement&) override {
+        region.callsOnlyNatives = false;
+    }
+
+private:
+    const std::unordered_set<std::string>& pureNatives;
+
+    void store(int slot, int numberSlot) {
+        if (slot >= 0) region.slots.insert(slot);
+        if (numberSlot >= 0) region.numberSlots.insert(numberSlot);
+    }
+};
+
+// A pure expression: equal keys compute equal values from equal locals
+struct Pure {
+    std::string key;
+    std::vector<int> slots;        // frame slots it reads
+    std::vector<int> numberSlots;  // unboxed slots it reads
+    int operators = 0;
+    bool calls = false;
+};
+
+std::string literalKey(const FluxValue& value) {
+    std::ostringstream key;
+    if (auto number = std::get_if<double>(&value)) {
+        key << std::hexfloat << *number;
+    } else if (auto str = std::get_if<FluxString>(&value)) {
+        key << '"' << str->size() << ':' << *str;
+    } else if (auto b = std::get_if<bool>(&value)) {
+        key << (*b ? "true" : "false");
+    } else {
+        key << "nil";
+    }
+    return key.str();
+}
+
+bool describe(Expression* expr, const std::unordered_set<std::string>& pureNatives, Pure& pure) {
+    if (auto literal = dynamic_cast<LiteralExpression*>(expr)) {
+        pure.key += literalKey(literal->value);
+        return true;
+    }
+
+    if (auto identifier = dynamic_cast<IdentifierExpression*>(expr)) {
+        if (identifier->numberSlot >= 0) {
+            pure.key += "n" + std::to_string(identifier->numberSlot);
+            pure.numberSlots.push_back(identifier->numberSlot);
+            return true;
+        }
+        if (identifier->slot >= 0) {
+            pure.key += "s" + std::to_string(identifier->slot);
+            pure.slots.push_back(identifier->slot);
+            return true;
+        }
+        return false;
+    }
+
+    if (auto binary = dynamic_cast<BinaryExpression*>(expr)) {
+        if (binary->op == BinaryOp::Assign) return false;
+        pure.key += "(" + binary->operator_ + " ";
+        if (!describe(binary->left.get(), pureNatives, pure)) return false;
+        pure.key += " ";
+        if (!describe(binary->right.get(), pureNatives, pure)) return false;
+        pure.key += ")";
+        pure.operators++;
+        return true;
+    }
+
+    if (auto logical = dynamic_cast<LogicalExpression*>(expr)) {
+        pure.key += "(" + logical->operator_ + " ";
+        if (!describe(logical->left.get(), pureNatives, pure)) return false;
+        pure.key += " ";
+        if (!describe(logical->right.get(), pureNatives, pure)) return false;
+        pure.key += ")";
+        pure.operators++;
+        return true;
+    }
+
+    if (auto unary = dynamic_cast<UnaryExpression*>(expr)) {
+        pure.key += "(" + unary->operator_ + " ";
+        if (!describe(unary->operand.get(), pureNatives, pure)) return false;
+        pure.key += ")";
+        pure.operators++;
+        return true;
+    }
+
+    if (auto call = dynamic_cast<CallExpression*>(expr)) {
+        auto callee = dynamic_cast<IdentifierExpression*>(call->callee.get());
+        if (!callee || !isGlobal(*callee) || !pureNatives.count(callee->name)) return false;
+        pure.key += "(" + callee->name;
+        for (auto& arg : call->arguments) {
+            pure.key += " ";
+            if (!describe(arg.get(), pureNatives, pure)) return false;
+        }
+        pure.key += ")";
+        pure.calls = true;
+        return true;
+    }
+
+    return false;
+}
+
+// Worth a cache lookup, and computing the same value throughout the region
+bool cacheable(const Pure& pure, const Region& region) {
+    if (!pure.calls && pure.operators < 2) return false;
+    if (pure.calls && !region.callsOnlyNatives) return false;
+    for (int slot : pure.slots) {
+        if (region.slots.count(slot)) return false;
+    }
+    for (int slot : pure.numberSlots) {
+        if (region.numberSlots.count(slot)) return false;
+    }
+    return true;
+}
+
+// Calls enter on the expressions of a statement from the outside in, and
+// only descends into those it returns false for. Nested functions are left
+// to their own optimization.
+class ExpressionWalker : public RecursiveVisitor {
+public:
+    explicit ExpressionWalker(std::function<bool(Expression&)> enter) : enter(std::move(enter)) {}
+
+    void visit(LiteralExpression& node) override { if (!enter(node)) RecursiveVisitor::visit(node); }
+    void visit(IdentifierExpression& node) override { if (!enter(node)) RecursiveVisitor::visit(node); }
+    void visit(BinaryExpression& node) override { if (!enter(node)) RecursiveVisitor::visit(node); }
+    void visit(LogicalExpression& node) override { if (!enter(node)) RecursiveVisitor::visit(node); }
+    void visit(UnaryExpression& node) override { if (!enter(node)) RecursiveVisitor::visit(node); }
+    void visit(CallExpression& node) override { if (!enter(node)) RecursiveVisitor::visit(node); }
+    void visit(ArrayExpression& node) override { if (!enter(node)) RecursiveVisitor::visit(node); }
+    void visit(IndexExpression& node) override { if (!enter(node)) RecursiveVisitor::visit(node); }
+    void visit(FunctionDeclaration&) override {}
+
+private:
+    std::function<bool(Expression&)> enter;
+};
+
+// Occurrences of one pure expression within a region
+struct Group {
+    Pure pure;
+    std::vector<Expression*> occurrences;
+};
+
+class FunctionOptimizer : public RecursiveVisitor {
+public:
+    FunctionOptimizer(FunctionDeclaration& function, int level, const std::unordered_set<std::string>& pureNatives)
+        : function(function), level(level), pureNatives(pureNatives) {}
+
+    void run() {
+        for (auto& stmt : function.body->statements) {
+            stmt->accept(*this);
+        }
+    }
+
+    // Outer loops first, so an expression is hoisted as far out as it can go
+    void visit(WhileStatement& node) override {
+        hoist(node);
+        RecursiveVisitor::visit(node);
+    }
+
+    void visit(ForStatement& node) override {
+        hoist(node);
+        RecursiveVisitor::visit(node);
+    }
+
+    void visit(ForInStatement& node) override {
+        hoist(node);
+        RecursiveVisitor::visit(node);
+    }
+
+    void visit(ExpressionStatement& node) override { eliminate(node); }
+    void visit(VarDeclaration& node) override { eliminate(node); }
+    void visit(PrintStatement& node) override { eliminate(node); }
+    void visit(ReturnStatement& node) override { eliminate(node); }
+    void visit(FunctionDeclaration&) override {}
+
+private:
+    FunctionDeclaration& function;
+    int level;
+    const std::unordered_set<std::string>& pureNatives;
+
+    Region scan(Statement& statement) {
+        RegionScanner scanner(pureNatives);
+        statement.accept(scanner);
+        return std::move(scanner.region);
+    }
+
+    // Caches the outermost cacheable expressions of a loop
+    void hoist(Statement& loop) {
+        Region region = scan(loop);
+        std::vector<Group> groups;
+        std::unordered_map<std::string, size_t> byKey;
+        ExpressionWalker walker([&](Expression& expr) {
+            if (expr.cached) return true;
+            Pure pure;
+            if (!describe(&expr, pureNatives, pure) || !cacheable(pure, region)) return false;
+            add(groups, byKey, std::move(pure), expr);
+            return true;
+        });
+        loop.accept(walker);
+
+        for (const auto& group : groups) {
+            cache(loop, group, region);
+        }
+    }
+
+    // Caches the outermost cacheable expressions a statement repeats
+    void eliminate(Statement& statement) {
+        if (level < 2) return;
+        Region region = scan(statement);
+        std::unordered_map<std::string, int> counts;
+        ExpressionWalker counter([&](Expression& expr) {
+            if (expr.cached) return true;
+            Pure pure;
+            if (describe(&expr, pureNatives, pure) && cacheable(pure, region)) counts[pure.key]++;
+            return false;
+        });
+        statement.accept(counter);
+
+        std::vector<Group> groups;
+        std::unordered_map<std::string, size_t> byKey;
+        ExpressionWalker walker([&](Expression& expr) {
+            if (expr.cached) return true;
+            Pure pure;
+            if (!describe(&expr, pureNatives, pure) || counts[pure.key] < 2) return false;
+            add(groups, byKey, std::move(pure), expr);
+            return true;
+        });
+        statement.accept(walker);
+
+        // A repeat found only inside a larger repeat is already covered by it
+        for (const auto& group : groups) {
+            if (group.occurrences.size() >= 2) cache(statement, group, region);
+        }
+    }
+
+    static void add(std::vector<Group>& groups, std::unordered_map<std::string, size_t>& byKey, Pure pure,
+                    Expression& expr) {
+        auto found = byKey.find(pure.key);
+        if (found == byKey.end()) {
+            found = byKey.emplace(pure.key, groups.size()).first;
+            groups.push_back({std::move(pure), {}});
+        }
+        groups[found->second].occurrences.push_back(&expr);
+    }
+
+    void cache(Statement& owner, const Group& group, const Region& region) {
+        auto value = std::make_shared<CachedValue>();
+        value->slot = function.frameSize++;
+        value->flag = function.numberCount++;
+        value->locals = group.pure.slots;
+        if (group.pure.calls) value->natives = region.natives;
+        for (auto expr : group.occurrences) {
+            expr->cached = value;
+        }
+        owner.cacheFlags.push_back(value->flag);
+    }
+};
+
+}
+
+Optimizer::Optimizer(int level, std::unordered_set<std::string> pureNatives)
+    : level(level), pureNatives(std::move(pureNatives)) {}
+
+void Optimizer::optimize(Program& program) {
+    program.accept(*this);
+}
+
+void Optimizer::visit(FunctionDeclaration& node) {
+    if (!node.body) return;  // lazy bodies are optimized once parsed; see ensureFunctionBody
+    if (node.framed) {
+        FunctionOptimizer optimizer(node, level, pureNatives);
+        optimizer.run();
+    }
+    RecursiveVisitor::visit(node);
+}
@@ -0,0 +1,33 @@
+#pragma once
+#include "ast.h"
+#include <string>
+#include <unordered_set>
+
+// Optional passes over the bodies of framed functions, run after the others
+// when flux is started with -O. Both keep the value of a pure expression in a
+// CachedValue instead of computing it again:
+//
+//   -O1  loop-invariant code motion: an expression in a while, for or for-in
+//        loop that reads only locals the loop never stores to, like sqrt(n)
+//        in `while (i <= sqrt(n))`, is computed once per run of the loop
+//   -O2  also common-subexpression elimination: an expression repeated within
+//        one statement, like the (x - y) in `let d = (x - y) * (x - y) + 1`,
+//        is computed once per execution of the statement
+//
+// Pure means built from locals, literals, operators and calls of pure natives.
+// The value is computed where the expression is first reached, so errors and
+// the order of effects are unchanged. Expressions are only cached when that
+// saves more than the lookup costs: they call a native or apply at least two
+// operators.
+class Optimizer : public RecursiveVisitor {
+public:
+    Optimizer(int level, std::unordered_set<std::string> pureNatives);
+
+    void optimize(Program& program);
+
+    void visit(FunctionDeclaration& node) override;
+
+private:
+    int level;
+    std::unordered_set<std::string> pureNatives;
+};
@@ -2,7 +2,88 @@
 #include <iostream>
 #include <stdexcept>
 
-Parser::Parser(const std::vector<Token>& tokens) : tokens(tokens), current(0) {}
+namespace {
+
+// Records every statement of a generator body that contains a yield, not
+// looking into nested functions (their yields are their own)
+bool markSuspendPoints(const Statement* stmt, std::unordered_set<const Statement*>& points) {
+    bool suspends = false;
+    
+    if (dynamic_cast<const YieldStatement*>(stmt)) {
+        suspends = true;
+    } else if (auto block = dynamic_cast<const BlockStatement*>(stmt)) {
+        for (const auto& child : block->statements) {
+            if (markSuspendPoints(child.get(), points)) suspends = true;
+        }
+    } else if (auto ifStmt = dynamic_cast<const IfStatement*>(stmt)) {
+        suspends = markSuspendPoints(ifStmt->thenBranch.get(), points);
+        if (ifStmt->elseBranch && markSuspendPoints(ifStmt->elseBranch.get(), points)) suspends = true;
+    } else if (auto loop = dynamic_cast<const WhileStatement*>(stmt)) {
+        suspends = markSuspendPoints(loop->body.get(), points);
+    } else if (auto forLoop = dynamic_cast<const ForStatement*>(stmt)) {
+        suspends = markSuspendPoints(forLoop->body.get(), points);
+    } else if (auto forIn = dynamic_cast<const ForInStatement*>(stmt)) {
+        suspends = markSuspendPoints(forIn->body.get(), points);
+    }
+    
+    if (suspends) points.insert(stmt);
+    return suspends;
+}
+
+class FunctionFinder : public RecursiveVisitor {
+public:
+    bool found = false;
+    
+    void visit(FunctionDeclaration&) override {
+        found = true;
+    }
+};
+
+// A loop body block may share one environment across iterations, emptied
+// before each, unless a closure declared inside it could capture a binding of
+// one iteration
+bool canReuseBodyEnvironment(Statement* body) {
+    if (!dynamic_cast<BlockStatement*>(body)) return false;
+    FunctionFinder finder;
+    body->accept(finder);
+    return !finder.found;
+}
+
+IdentifierExpression* asIdentifier(Expression* expr, const std::string& name) {
+    auto identifier = dynamic_cast<IdentifierExpression*>(expr);
+    return identifier && identifier->name == name ? identifier : nullptr;
+}
+
+// Recognizes `for (let i = a; i <op> bound; i = i +/- k)` with a literal k
+void recognizeCountedLoop(ForStatement& loop) {
+    auto init = dynamic_cast<VarDeclaration*>(loop.initializer.get());
+    auto cond = dynamic_cast<BinaryExpression*>(loop.condition.get());
+    auto incr = dynamic_cast<BinaryExpression*>(loop.increment.get());
+    if (!init || !init->initializer || !cond || !incr) return;
+    
+    const std::string& name = init->name;
+    if (cond->op != BinaryOp::Less && cond->op != BinaryOp::LessEqual &&
+        cond->op != BinaryOp::Greater && cond->op != BinaryOp::GreaterEqual) return;
+    if (!asIdentifier(cond->left.get(), name)) return;
+    
+    if (incr->op != BinaryOp::Assign || !asIdentifier(incr->left.get(), name)) return;
+    auto sum = dynamic_cast<BinaryExpression*>(incr->right.get());
+    if (!sum || (sum->op != BinaryOp::Add && sum->op != BinaryOp::Subtract)) return;
+    if (!asIdentifier(sum->left.get(), name)) return;
+    auto literal = dynamic_cast<LiteralExpression*>(sum->right.get());
+    if (!literal || !std::holds_alternative<double>(literal->value)) return;
+    
+    double step = std::get<double>(literal->value);
+    loop.counter = name;
+    loop.counterCompare = cond->op;
+    loop.counterBound = cond->right.get();
+    loop.counterStep = sum->op == BinaryOp::Add ? step : -step;
+}
+
+}
+
+Parser::Parser(const std::vector<Token>& tokens, bool lazyFunctionBodies, const std::string& path)
+    : tokens(tokens), current(0), lazyFunctionBodies(lazyFunctionBodies), path(path) {}
 
 std::unique_ptr<Program> Parser::parse() {
     return program();
@@ -12,15 +93,15 @@ bool Parser::isAtEnd() const {
     return peek().type == TokenType::END_OF_FILE;
 }
 
-Token Parser::peek() const {
+const Token& Parser::peek() const {
     return tokens[current];
 }
 
-Token Parser::previous() const {
+const Token& Parser::previous() const {
     return tokens[current - 1];
 }
 
-Token Parser::advance() {
+const Token& Parser::advance() {
     if (!isAtEnd()) current++;
     return previous();
 }
@@ -48,11 +129,15 @@ void Parser::synchronize() {
         
         switch (peek().type) {
             case TokenType::FUN:
+            case TokenType::MEMO:
             case TokenType::LET:
             case TokenType::IF:
             case TokenType::WHILE:
+            case TokenType::FOR:
+            case TokenType::YIELD:
             case TokenType::RETURN:
             case TokenType::PRINT:
+            case TokenType::IMPORT:
                 return;
             default:
                 break;
@@ -70,7 +155,7 @@ std::unique_ptr<Program> Parser::program() {
         if (match({TokenType::NEWLINE})) continue;
         
         try {
-            auto stmt = declaration();
+            auto stmt = match({TokenType::IMPORT}) ? importStatement() : declaration();
             if (stmt) statements.push_back(std::move(stmt));
         } catch (const std::runtime_error& e) {
             std::cerr << "Parse error: " << e.what() << std::endl;
@@ -82,9 +167,36 @@ std::unique_ptr<Program> Parser::program() {
 }
 
 std::unique_ptr<Statement> Parser::declaration() {
-    if (match({TokenType::LET})) return varDeclaration();
-    if (match({TokenType::FUN})) return functionDeclaration();
-    return statement();
+    int line = peek().line;
+    std::unique_ptr<Statement> stmt;
+    if (match({TokenType::LET})) {
+        stmt = varDeclaration();
+    } else if (match({TokenType::FUN})) {
+        stmt = functionDeclaration();
+    } else if (match({TokenType::MEMO})) {
+        stmt = memoFunctionDeclaration();
+    } else if (match({TokenType::IMPORT})) {
+        error("'import' is only allowed at the top level of a file");
+        return nullptr;
+    } else {
+        return statement();
+    }
+    if (stmt) stmt->line = line;
+    return stmt;
+}
+
+std::unique_ptr<ImportStatement> Parser::importStatement() {
+    int line = previous().line;  // of the 'import'
+    if (!match({TokenType::STRING})) {
+        error("Expected module path string after 'import'");
+        return nullptr;
+    }
+    
+    std::string path(previous().lexeme);
+    match({TokenType::SEMICOLON, TokenType::NEWLINE});
+    auto import = std::make_unique<ImportStatement>(path);
+    import->line = line;
+    return import;
 }
 
 std::unique_ptr<VarDeclaration> Parser::varDeclaration() {
@@ -93,7 +205,7 @@ std::unique_ptr<VarDeclaration> Parser::varDeclaration() {
         return nullptr;
     }
     
-    std::string name = advance().lexeme;
+    std::string name(advance().lexeme);
     
     std::unique_ptr<Expression> initializer = nullptr;
     if (match({TokenType::ASSIGN})) {
@@ -104,13 +216,13 @@ std::unique_ptr<VarDeclaration> Parser::varDeclaration() {
     return std::make_unique<VarDeclaration>(name, std::move(initializer));
 }
 
-std::unique_ptr<FunctionDeclaration> Parser::functionDeclaration() {
+std::unique_ptr<FunctionDeclaration> Parser::functionDeclaration(bool memoAnnotated) {
     if (!check(TokenType::IDENTIFIER)) {
         error("Expected function name");
         return nullptr;
     }
     
-    std::string name = advance().lexeme;
+    std::string name(advance().lexeme);
     
     if (!match({TokenType::LEFT_PAREN})) {
         error("Expected '(' after function name");
@@ -124,7 +236,7 @@ std::unique_ptr<FunctionDeclaration> Parser::functionDeclaration() {
                 error("Expected parameter name");
                 return nullptr;
             }
-            parameters.push_back(advance().lexeme);
+            parameters.emplace_back(advance().lexeme);
         } while (match({TokenType::COMMA}));
     }
     
@@ -133,18 +245,107 @@ std::unique_ptr<FunctionDeclaration> Parser::functionDeclaration() {
         return nullptr;
     }
     
-    auto body = blockStatement();
-    return std::make_unique<FunctionDeclaration>(name, std::move(parameters), std::move(body));
+    if (!match({TokenType::LEFT_BRACE})) {
+        error("Expected '{' before function body");
+        return nullptr;
+    }
+    
+    // Memoized functions are parsed up front so purity analysis can see them
+    if (lazyFunctionBodies && functionYields.empty() && !memoAnnotated) {
+        auto function = std::make_unique<FunctionDeclaration>(name, std::move(parameters), nullptr);
+        function->path = path;
+        function->lazyBody = std::make_unique<LazyBody>(skipFunctionBody());
+        return function;
+    }
+    
+    bool isGenerator = false;
+    auto body = functionBody(isGenerator);
+    auto function = std::make_unique<FunctionDeclaration>(name, std::move(parameters), std::move(body));
+    function->path = path;
+    function->memoAnnotated = memoAnnotated;
+    if (isGenerator) {
+        function->isGenerator = true;
+        markSuspendPoints(function->body.get(), function->suspendPoints);
+    }
+    return function;
 }
 
-std::unique_ptr<Statement> Parser::statement() {
-    if (match({TokenType::IF})) return ifStatement();
-    if (match({TokenType::WHILE})) return whileStatement();
-    if (match({TokenType::RETURN})) return returnStatement();
-    if (match({TokenType::PRINT})) return printStatement();
-    if (match({TokenType::LEFT_BRACE})) return blockStatement();
+// Parses a function's block after its '{', noting whether it yields
+std::unique_ptr<BlockStatement> Parser::functionBody(bool& isGenerator) {
+    functionYields.push_back(false);
+    std::unique_ptr<BlockStatement> body;
+    try {
+        body = blockStatement();
+    } catch (...) {
+        functionYields.pop_back();
+        throw;
+    }
+    isGenerator = functionYields.back();
+    functionYields.pop_back();
+    return body;
+}
+
+// Brace-matches a function body after its '{' and returns its tokens through
+// the closing '}', terminated by an end-of-file token for the later parse
+std::vector<Token> Parser::skipFunctionBody() {
+    size_t start = current;
+    int depth = 1;
+    while (!isAtEnd()) {
+        TokenType type = advance().type;
+        if (type == TokenType::LEFT_BRACE) {
+            depth++;
+        } else if (type == TokenType::RIGHT_BRACE && --depth == 0) {
+            std::vector<Token> body(tokens.begin() + start, tokens.begin() + current);
+            body.emplace_back(TokenType::END_OF_FILE, "", previous().line, previous().column);
+            return body;
+        }
+    }
+    
+    error("Expected '}' after block");
+    return {};
+}
+
+void Parser::parseFunctionBody(FunctionDeclaration& function) {
+    Parser parser(function.lazyBody->tokens, false, function.path);
+    bool isGenerator = false;
+    function.body = parser.functionBody(isGenerator);
+    if (isGenerator) {
+        function.isGenerator = true;
+        markSuspendPoints(function.body.get(), function.suspendPoints);
+    }
+}
+
+std::unique_ptr<FunctionDeclaration> Parser::memoFunctionDeclaration() {
+    if (!match({TokenType::FUN})) {
+        error("Expected 'fun' after 'memo'");
+        return nullptr;
+    }
     
-    return expressionStatement();
+    return functionDeclaration(true);
+}
+
+std::unique_ptr<Statement> Parser::statement() {
+    int line = peek().line;
+    std::unique_ptr<Statement> stmt;
+    if (match({TokenType::IF})) {
+        stmt = ifStatement();
+    } else if (match({TokenType::WHILE})) {
+        stmt = whileStatement();
+    } else if (match({TokenType::FOR})) {
+        stmt = forStatement();
+    } else if (match({TokenType::YIELD})) {
+        stmt = yieldStatement();
+    } else if (match({TokenType::RETURN})) {
+        stmt = returnStatement();
+    } else if (match({TokenType::PRINT})) {
+        stmt = printStatement();
+    } else if (match({TokenType::LEFT_BRACE})) {
+        stmt = blockStatement();
+    } else {
+        stmt = expressionStatement();
+    }
+    if (stmt) stmt->line = line;
+    return stmt;
 }
 
 std::unique_ptr<Statement> Parser::ifStatement() {
@@ -187,6 +388,83 @@ std::unique_ptr<Statement> Parser::whileStatement() {
     return std::make_unique<WhileStatement>(std::move(condition), std::move(body));
 }
 
+std::unique_ptr<Statement> Parser::forStatement() {
+    if (match({TokenType::LEFT_PAREN})) return counterForStatement();
+    
+    if (!check(TokenType::IDENTIFIER)) {
+        error("Expected loop variable after 'for'");
+        return nullptr;
+    }
+    
+    std::string variable(advance().lexeme);
+    
+    if (!match({TokenType::IN})) {
+        error("Expected 'in' after loop variable");
+        return nullptr;
+    }
+    
+    auto iterable = expression();
+    auto body = statement();
+    auto loop = std::make_unique<ForInStatement>(variable, std::move(iterable), std::move(body));
+    loop->reuseBodyEnvironment = canReuseBodyEnvironment(loop->body.get());
+    return loop;
+}
+
+std::unique_ptr<Statement> Parser::counterForStatement() {
+    int line = peek().line;
+    std::unique_ptr<Statement> initializer = nullptr;
+    if (match({TokenType::SEMICOLON})) {
+        // No initializer
+    } else if (match({TokenType::LET})) {
+        initializer = varDeclaration();
+    } else {
+        initializer = expressionStatement();
+    }
+    if (initializer) initializer->line = line;
+    
+    std::unique_ptr<Expression> condition = nullptr;
+    if (!check(TokenType::SEMICOLON)) {
+        condition = expression();
+    }
+    if (!match({TokenType::SEMICOLON})) {
+        error("Expected ';' after loop condition");
+        return nullptr;
+    }
+    
+    std::unique_ptr<Expression> increment = nullptr;
+    if (!check(TokenType::RIGHT_PAREN)) {
+        increment = expression();
+    }
+    if (!match({TokenType::RIGHT_PAREN})) {
+        error("Expected ')' after for clauses");
+        return nullptr;
+    }
+    
+    auto body = statement();
+    auto loop = std::make_unique<ForStatement>(std::move(initializer), std::move(condition),
+                                               std::move(increment), std::move(body));
+    loop->reuseBodyEnvironment = canReuseBodyEnvironment(loop->body.get());
+    recognizeCountedLoop(*loop);
+    return loop;
+}
+
+std::unique_ptr<Statement> Parser::yieldStatement() {
+    if (functionYields.empty()) {
+        error("Cannot 'yield' outside a function");
+        return nullptr;
+    }
+    functionYields.back() = true;
+    
+    std::unique_ptr<Expression> value = nullptr;
+    
+    if (!check(TokenType::SEMICOLON) && !check(TokenType::NEWLINE)) {
+        value = expression();
+    }
+    
+    match({TokenType::SEMICOLON, TokenType::NEWLINE});
+    return std::make_unique<YieldStatement>(std::move(value));
+}
+
 std::unique_ptr<Statement> Parser::returnStatement() {
     std::unique_ptr<Expression> value = nullptr;
     
@@ -254,9 +532,9 @@ std::unique_ptr<Expression> Parser::logicalOr() {
     auto expr = logicalAnd();
     
     while (match({TokenType::OR})) {
-        std::string op = previous().lexeme;
+        std::string op(previous().lexeme);
         auto right = logicalAnd();
-        expr = std::make_unique<BinaryExpression>(std::move(expr), op, std::move(right));
+        expr = std::make_unique<LogicalExpression>(std::move(expr), op, std::move(right));
     }
     
     return expr;
@@ -266,9 +544,9 @@ std::unique_ptr<Expression> Parser::logicalAnd() {
     auto expr = equality();
     
     while (match({TokenType::AND})) {
-        std::string op = previous().lexeme;
+        std::string op(previous().lexeme);
         auto right = equality();
-        expr = std::make_unique<BinaryExpression>(std::move(expr), op, std::move(right));
+        expr = std::make_unique<LogicalExpression>(std::move(expr), op, std::move(right));
     }
     
     return expr;
@@ -278,7 +556,7 @@ std::unique_ptr<Expression> Parser::equality() {
     auto expr = comparison();
     
     while (match({TokenType::NOT_EQUAL, TokenType::EQUAL})) {
-        std::string op = previous().lexeme;
+        std::string op(previous().lexeme);
         auto right = comparison();
         expr = std::make_unique<BinaryExpression>(std::move(expr), op, std::move(right));
     }
@@ -290,7 +568,7 @@ std::unique_ptr<Expression> Parser::comparison() {
     auto expr = term();
     
     while (match({TokenType::GREATER, TokenType::GREATER_EQUAL, TokenType::LESS, TokenType::LESS_EQUAL})) {
-        std::string op = previous().lexeme;
+        std::string op(previous().lexeme);
         auto right = term();
         expr = std::make_unique<BinaryExpression>(std::move(expr), op, std::move(right));
     }
@@ -302,7 +580,7 @@ std::unique_ptr<Expression> Parser::term() {
     auto expr = factor();
     
     while (match({TokenType::MINUS, TokenType::PLUS})) {
-        std::string op = previous().lexeme;
+        std::string op(previous().lexeme);
         auto right = factor();
         expr = std::make_unique<BinaryExpression>(std::move(expr), op, std::move(right));
     }
@@ -314,7 +592,7 @@ std::unique_ptr<Expression> Parser::factor() {
     auto expr = unary();
     
     while (match({TokenType::DIVIDE, TokenType::MULTIPLY, TokenType::MODULO})) {
-        std::string op = previous().lexeme;
+        std::string op(previous().lexeme);
         auto right = unary();
         expr = std::make_unique<BinaryExpression>(std::move(expr), op, std::move(right));
     }
@@ -324,7 +602,7 @@ std::unique_ptr<Expression> Parser::factor() {
 
 std::unique_ptr<Expression> Parser::unary() {
     if (match({TokenType::NOT, TokenType::MINUS})) {
-        std::string op = previous().lexeme;
+        std::string op(previous().lexeme);
         auto right = unary();
         return std::make_unique<UnaryExpression>(op, std::move(right));
     }
@@ -335,13 +613,24 @@ std::unique_ptr<Expression> Parser::unary() {
 std::unique_ptr<Expression> Parser::call() {
     auto expr = primary();
     
-    while (match({TokenType::LEFT_PAREN})) {
-        auto args = arguments();
-        if (!match({TokenType::RIGHT_PAREN})) {
-            error("Expected ')' after arguments");
-            return nullptr;
+    while (true) {
+        if (match({TokenType::LEFT_PAREN})) {
+            auto args = arguments();
+            if (!match({TokenType::RIGHT_PAREN})) {
+                error("Expected ')' after arguments");
+                return nullptr;
+            }
+            expr = std::make_unique<CallExpression>(std::move(expr), std::move(args));
+        } else if (match({TokenType::LEFT_BRACKET})) {
+            auto index = expression();
+            if (!match({TokenType::RIGHT_BRACKET})) {
+                error("Expected ']' after index");
+                return nullptr;
+            }
+            expr = std::make_unique<IndexExpression>(std::move(expr), std::move(index));
+        } else {
+            break;
         }
-        expr = std::make_unique<CallExpression>(std::move(expr), std::move(args));
     }
     
     return expr;
@@ -361,16 +650,16 @@ std::unique_ptr<Expression> Parser::primary() {
     }
     
     if (match({TokenType::NUMBER})) {
-        double value = std::stod(previous().lexeme);
+        double value = std::stod(std::string(previous().lexeme));
         return std::make_unique<LiteralExpression>(value);
     }
     
     if (match({TokenType::STRING})) {
-        return std::make_unique<LiteralExpression>(previous().lexeme);
+        return std::make_unique<LiteralExpression>(FluxString(previous().lexeme));
     }
     
     if (match({TokenType::IDENTIFIER})) {
-        return std::make_unique<IdentifierExpression>(previous().lexeme);
+        return std::make_unique<IdentifierExpression>(std::string(previous().lexeme));
     }
     
     if (match({TokenType::LEFT_PAREN})) {
@@ -382,6 +671,20 @@ std::unique_ptr<Expression> Parser::primary() {
         return expr;
     }
     
+    if (match({TokenType::LEFT_BRACKET})) {
+        std::vector<std::unique_ptr<Expression>> elements;
+        if (!check(TokenType::RIGHT_BRACKET)) {
+            do {
+                elements.push_back(expression());
+            } while (match({TokenType::COMMA}));
+        }
+        if (!match({TokenType::RIGHT_BRACKET})) {
+            error("Expected ']' after array elements");
+            return nullptr;
+        }
+        return std::make_unique<ArrayExpression>(std::move(elements));
+    }
+    
     error("Expected expression");
     return nullptr;
 }
@@ -2,21 +2,32 @@
 #include "lexer.h"
 #include "ast.h"
 #include <memory>
+#include <string>
 #include <vector>
 
 class Parser {
 public:
-    Parser(const std::vector<Token>& tokens);
+    // With lazyFunctionBodies, top-level functions other than `memo` ones only
+    // have their body brace-matched; parseFunctionBody fills it in later. path
+    // is the file the functions are declared in, named in errors raised then
+    // and in heap profiles.
+    Parser(const std::vector<Token>& tokens, bool lazyFunctionBodies = false, const std::string& path = "");
     std::unique_ptr<Program> parse();
     
+    // Parses the skipped body of a lazily loaded function from its own tokens
+    static void parseFunctionBody(FunctionDeclaration& function);
+    
 private:
     std::vector<Token> tokens;
     size_t current;
+    bool lazyFunctionBodies;
+    std::string path;
+    std::vector<bool> functionYields;  // per enclosing function: has it yielded?
     
     bool isAtEnd() const;
-    Token peek() const;
-    Token previous() const;
-    Token advance();
+    const Token& peek() const;
+    const Token& previous() const;
+    const Token& advance();
     bool check(TokenType type) const;
     bool match(std::vector<TokenType> types);
     void synchronize();
@@ -26,9 +37,16 @@ private:
     std::unique_ptr<Statement> statement();
     std::unique_ptr<Statement> declaration();
     std::unique_ptr<VarDeclaration> varDeclaration();
-    std::unique_ptr<FunctionDeclaration> functionDeclaration();
+    std::unique_ptr<FunctionDeclaration> functionDeclaration(bool memoAnnotated = false);
+    std::unique_ptr<BlockStatement> functionBody(bool& isGenerator);
+    std::vector<Token> skipFunctionBody();
+    std::unique_ptr<ImportStatement> importStatement();
+    std::unique_ptr<FunctionDeclaration> memoFunctionDeclaration();
     std::unique_ptr<Statement> ifStatement();
     std::unique_ptr<Statement> whileStatement();
+    std::unique_ptr<Statement> forStatement();
+    std::unique_ptr<Statement> counterForStatement();
+    std::unique_ptr<Statement> yieldStatement();
     std::unique_ptr<Statement> returnStatement();
     std::unique_ptr<Statement> printStatement();
     std::unique_ptr<BlockStatement> blockStatement();
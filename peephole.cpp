@@ -0,0 +1,121 @@
+#include "peephole.h"
+
+namespace {
+
+bool isComparison(BinaryOp op) {
+    switch (op) {
+        case BinaryOp::Less:
+        case BinaryOp::LessEqual:
+        case BinaryOp::Greater:
+        case BinaryOp::GreaterEqual:
+        case BinaryOp::Equal:
+        case BinaryOp::NotEqual:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// A framed local held in a frame slot, or unboxed as a number
+bool localOperand(Expression* expr, FusedOperand& operand) {
+    auto identifier = dynamic_cast<IdentifierExpression*>(expr);
+    if (!identifier) return false;
+    // An unboxed bool is 0 or 1, which mustn't compare equal to a number
+    int numberSlot = identifier->type == StaticType::Number ? identifier->numberSlot : -1;
+    operand = {identifier->slot, numberSlot, 0};
+    return identifier->slot >= 0 || numberSlot >= 0;
+}
+
+bool isLocal(Expression* expr, const FusedOperand& local) {
+    FusedOperand operand;
+    return localOperand(expr, operand) && operand.slot == local.slot && operand.numberSlot == local.numberSlot;
+}
+
+bool numberConstant(Expression* expr, double& value) {
+    auto literal = dynamic_cast<LiteralExpression*>(expr);
+    if (!literal) return false;
+    auto number = std::get_if<double>(&literal->value);
+    if (!number) return false;
+    value = *number;
+    return true;
+}
+
+// A framed local or a number literal
+bool fusedOperand(Expression* expr, FusedOperand& operand) {
+    if (localOperand(expr, operand)) return true;
+    operand = {-1, -1, 0};
+    return numberConstant(expr, operand.constant);
+}
+
+// i = i + k, i = k + i, i = i - k
+bool matchIncrement(BinaryExpression& node) {
+    FusedOperand target;
+    auto value = dynamic_cast<BinaryExpression*>(node.right.get());
+    if (!localOperand(node.left.get(), target) || !value) return false;
+    
+    double step;
+    if (value->op == BinaryOp::Add) {
+        bool matched = (isLocal(value->left.get(), target) && numberConstant(value->right.get(), step)) ||
+                       (isLocal(value->right.get(), target) && numberConstant(value->left.get(), step));
+        if (!matched) return false;
+    } else if (value->op == BinaryOp::Subtract) {
+        if (!isLocal(value->left.get(), target) || !numberConstant(value->right.get(), step)) return false;
+        step = -step;
+    } else {
+        return false;
+    }
+    
+    node.fused = Superinstruction::IncrementLocal;
+    node.fusedLeft = target;
+    node.fusedRight = {-1, -1, step};
+    return true;
+}
+
+// x % k == 0, x % k != 0
+bool matchModuloTest(BinaryExpression& node) {
+    if (node.op != BinaryOp::Equal && node.op != BinaryOp::NotEqual) return false;
+    
+    auto modulo = dynamic_cast<BinaryExpression*>(node.left.get());
+    double zero;
+    if (!modulo || modulo->op != BinaryOp::Modulo) return false;
+    if (!numberConstant(node.right.get(), zero) || zero != 0) return false;
+    
+    FusedOperand dividend, divisor;
+    if (!fusedOperand(modulo->left.get(), dividend) || !fusedOperand(modulo->right.get(), divisor)) return false;
+    
+    node.fused = Superinstruction::ModuloTest;
+    node.fusedLeft = dividend;
+    node.fusedRight = divisor;
+    return true;
+}
+
+// Comparison of two locals, or of a local and a constant
+bool matchCompare(BinaryExpression& node) {
+    if (!isComparison(node.op)) return false;
+    
+    FusedOperand left, right;
+    if (!fusedOperand(node.left.get(), left) || !fusedOperand(node.right.get(), right)) return false;
+    bool constants = left.slot < 0 && left.numberSlot < 0 && right.slot < 0 && right.numberSlot < 0;
+    if (constants) return false;
+    
+    node.fused = Superinstruction::CompareLocal;
+    node.fusedLeft = left;
+    node.fusedRight = right;
+    return true;
+}
+
+}
+
+void PeepholeOptimizer::optimize(Program& program) {
+    program.accept(*this);
+}
+
+void PeepholeOptimizer::visit(BinaryExpression& node) {
+    RecursiveVisitor::visit(node);
+    
+    if (node.op == BinaryOp::Assign) {
+        matchIncrement(node);
+    } else if (!matchModuloTest(node)) {
+        matchCompare(node);
+    }
+}
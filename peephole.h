@@ -0,0 +1,19 @@
+#pragma once
+#include "ast.h"
+
+// Peephole pass over binary expressions, run after the Resolver has given
+// locals their frame slots and the TypeAnalyzer has unboxed the number ones.
+// It fuses the idioms that dominate loop bodies into superinstructions:
+//
+//   i = i + 1         IncrementLocal  bump a local in place
+//   i < n, i <= 10    CompareLocal    compare locals/constants, no temporaries
+//   x % k == 0        ModuloTest      divisibility test as a single bool
+//
+// Only operands that are framed locals, boxed or unboxed numbers, or number
+// literals qualify.
+class PeepholeOptimizer : public RecursiveVisitor {
+public:
+    void optimize(Program& program);
+    
+    void visit(BinaryExpression& node) override;
+};
@@ -0,0 +1,246 @@
+#include "purity.h"
+#include <iostream>
+
+namespace {
+
+// Gathers every function declaration and every assignment target in a program
+class DeclarationCollector : public RecursiveVisitor {
+public:
+    std::vector<FunctionDeclaration*> functions;
+    std::unordered_set<std::string> assigned;
+    
+    void visit(BinaryExpression& node) override {
+        if (node.op == BinaryOp::Assign) {
+            if (auto identifier = dynamic_cast<IdentifierExpression*>(node.left.get())) {
+                assigned.insert(identifier->name);
+            }
+        }
+        RecursiveVisitor::visit(node);
+    }
+    
+    void visit(FunctionDeclaration& node) override {
+        functions.push_back(&node);
+        RecursiveVisitor::visit(node);
+    }
+};
+
+}
+
+PurityAnalyzer::PurityAnalyzer(std::unordered_set<std::string> pureNatives)
+    : pureNatives(std::move(pureNatives)), current(nullptr) {}
+
+void PurityAnalyzer::analyze(Program& program) {
+    collect(program);
+    solve(functions);
+}
+
+void PurityAnalyzer::analyzeUnit(Program& program) {
+    size_t earlier = functions.size();
+    bool calleesChanged = collect(program);
+    
+    std::vector<FunctionDeclaration*> candidates(functions.begin() + earlier, functions.end());
+    // Purity only ever gets lost, and only when a callee turns unstable
+    if (calleesChanged) {
+        for (size_t i = 0; i < earlier; i++) {
+            if (isPure(functions[i])) candidates.push_back(functions[i]);
+        }
+    }
+    solve(candidates);
+}
+
+void PurityAnalyzer::analyzeFunction(FunctionDeclaration& function) {
+    DeclarationCollector collector;
+    function.accept(collector);
+    functions = std::move(collector.functions);
+    unstableGlobals = std::move(collector.assigned);
+    // Direct recursion is the one call whose callee is known to be parsed
+    globalFunctions[function.name] = &function;
+    solve(functions);
+}
+
+void PurityAnalyzer::solve(const std::vector<FunctionDeclaration*>& candidates) {
+    // Optimistic fixpoint: assume every function is pure, then strike out the
+    // ones that violate a rule until nothing changes. Mutually recursive pure
+    // functions stay pure this way.
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (auto function : candidates) {
+            if (impure.count(function)) continue;
+            if (!check(function)) {
+                impure[function] = violation;
+                changed = true;
+            }
+        }
+    }
+    
+    for (auto function : candidates) {
+        function->pure = isPure(function);
+        if (!function->memoAnnotated) continue;
+        function->memoize = function->pure;
+        if (!function->memoize) {
+            std::cerr << "Warning: 'memo' ignored for function '" << function->name
+                      << "': " << reason(function) << std::endl;
+        }
+    }
+}
+
+bool PurityAnalyzer::isPure(const FunctionDeclaration* function) const {
+    return impure.find(function) == impure.end();
+}
+
+std::string PurityAnalyzer::reason(const FunctionDeclaration* function) const {
+    auto it = impure.find(function);
+    return it != impure.end() ? it->second : "";
+}
+
+bool PurityAnalyzer::collect(Program& program) {
+    DeclarationCollector collector;
+    program.accept(collector);
+    functions.insert(functions.end(), collector.functions.begin(), collector.functions.end());
+    
+    bool calleesChanged = false;
+    auto destabilize = [&](const std::string& name) {
+        if (unstableGlobals.insert(name).second && (globalFunctions.count(name) || pureNatives.count(name))) {
+            calleesChanged = true;
+        }
+    };
+    for (const auto& name : collector.assigned) {
+        destabilize(name);
+    }
+    
+    // Lazy bodies haven't been parsed; they get analyzed when they are
+    for (auto function : collector.functions) {
+        if (!function->body) impure[function] = "body not parsed yet";
+    }
+    
+    for (const auto& stmt : program.statements) {
+        if (auto function = dynamic_cast<FunctionDeclaration*>(stmt.get())) {
+            if (globalFunctions.count(function->name)) {
+                destabilize(function->name);
+            }
+            globalFunctions[function->name] = function;
+        } else if (auto var = dynamic_cast<VarDeclaration*>(stmt.get())) {
+            destabilize(var->name);
+        }
+    }
+    return calleesChanged;
+}
+
+bool PurityAnalyzer::check(FunctionDeclaration* function) {
+    current = function;
+    violation.clear();
+    scopes.clear();
+    scopes.emplace_back(function->parameters.begin(), function->parameters.end());
+    
+    // Calling a generator creates a stateful object, never a plain value
+    if (function->isGenerator) fail("is a generator");
+    
+    // Parameters and the body's top-level locals share one environment
+    for (auto& stmt : function->body->statements) {
+        if (!violation.empty()) break;
+        stmt->accept(*this);
+    }
+    
+    current = nullptr;
+    return violation.empty();
+}
+
+bool PurityAnalyzer::isLocal(const std::string& name) const {
+    for (auto it = scopes.rbegin(); it != scopes.rend(); ++it) {
+        if (it->count(name)) return true;
+    }
+    return false;
+}
+
+bool PurityAnalyzer::isPureCallee(const std::string& name) const {
+    if (unstableGlobals.count(name)) return false;
+    
+    auto it = globalFunctions.find(name);
+    if (it != globalFunctions.end()) {
+        return isPure(it->second);
+    }
+    return pureNatives.count(name) > 0;
+}
+
+void PurityAnalyzer::fail(const std::string& message) {
+    if (violation.empty()) violation = message;
+}
+
+void PurityAnalyzer::visit(IdentifierExpression& node) {
+    if (isLocal(node.name) || isPureCallee(node.name)) return;
+    fail("reads non-local variable '" + node.name + "'");
+}
+
+void PurityAnalyzer::visit(BinaryExpression& node) {
+    if (node.op == BinaryOp::Assign) {
+        auto identifier = dynamic_cast<IdentifierExpression*>(node.left.get());
+        if (!identifier || !isLocal(identifier->name)) {
+            fail("assigns to captured variable '" + (identifier ? identifier->name : std::string("?")) + "'");
+            return;
+        }
+        node.right->accept(*this);
+        return;
+    }
+    RecursiveVisitor::visit(node);
+}
+
+void PurityAnalyzer::visit(CallExpression& node) {
+    auto identifier = dynamic_cast<IdentifierExpression*>(node.callee.get());
+    if (!identifier) {
+        fail("calls a computed callee");
+        return;
+    }
+    if (isLocal(identifier->name) || !isPureCallee(identifier->name)) {
+        fail("calls impure function '" + identifier->name + "'");
+        return;
+    }
+    
+    for (auto& arg : node.arguments) {
+        arg->accept(*this);
+    }
+}
+
+void PurityAnalyzer::visit(VarDeclaration& node) {
+    RecursiveVisitor::visit(node);
+    scopes.back().insert(node.name);
+}
+
+void PurityAnalyzer::visit(BlockStatement& node) {
+    scopes.emplace_back();
+    RecursiveVisitor::visit(node);
+    scopes.pop_back();
+}
+
+void PurityAnalyzer::visit(ForStatement& node) {
+    scopes.emplace_back();
+    RecursiveVisitor::visit(node);
+    scopes.pop_back();
+}
+
+void PurityAnalyzer::visit(ForInStatement& node) {
+    // range() returns a fresh iterator, but one the loop uses up and nothing
+    // else sees, so `for i in range(...)` is as pure as the bounds
+    auto call = dynamic_cast<CallExpression*>(node.iterable.get());
+    auto callee = call ? dynamic_cast<IdentifierExpression*>(call->callee.get()) : nullptr;
+    if (callee && callee->name == "range" && !isLocal(callee->name) && !unstableGlobals.count(callee->name) &&
+        !globalFunctions.count(callee->name)) {
+        for (auto& arg : call->arguments) {
+            arg->accept(*this);
+        }
+    } else {
+        node.iterable->accept(*this);
+    }
+    scopes.emplace_back();
+    scopes.back().insert(node.variable);
+    node.body->accept(*this);
+    scopes.pop_back();
+}
+
+void PurityAnalyzer::visit(FunctionDeclaration& node) {
+    fail("declares nested function '" + node.name + "'");
+}
+
+void PurityAnalyzer::visit(PrintStatement&) {
+    fail("prints");
+}
@@ -0,0 +1,63 @@
+#pragma once
+#include "ast.h"
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// Purity analysis over FunctionDeclaration bodies. A function is pure when its
+// result depends only on its arguments: it prints nothing, assigns only its own
+// locals, reads no variables outside itself and calls only pure natives or
+// other pure top-level functions. Pure functions are safe to memoize.
+class PurityAnalyzer : public RecursiveVisitor {
+public:
+    PurityAnalyzer(std::unordered_set<std::string> pureNatives);
+    
+    // Analyzes every function in the program, marks the pure ones and enables
+    // memoization on those annotated with `memo`; warns about annotated impure ones.
+    void analyze(Program& program);
+    // Analyzes a lazily parsed top-level function on its own; calls to other
+    // user functions count as impure since their bodies may not be parsed
+    void analyzeFunction(FunctionDeclaration& function);
+    // Analyzes one more unit of a program compiled in pieces, as the REPL
+    // does, against the functions of the units before it. An earlier function
+    // that calls a global the unit redefines or assigns loses its purity.
+    void analyzeUnit(Program& program);
+    
+    bool isPure(const FunctionDeclaration* function) const;
+    std::string reason(const FunctionDeclaration* function) const;
+    // The natives it counts as pure
+    const std::unordered_set<std::string>& nativeNames() const { return pureNatives; }
+    
+    void visit(IdentifierExpression& node) override;
+    void visit(BinaryExpression& node) override;
+    void visit(CallExpression& node) override;
+    void visit(VarDeclaration& node) override;
+    void visit(BlockStatement& node) override;
+    void visit(ForStatement& node) override;
+    void visit(ForInStatement& node) override;
+    void visit(FunctionDeclaration& node) override;
+    void visit(PrintStatement& node) override;
+    
+private:
+    std::unordered_set<std::string> pureNatives;
+    std::vector<FunctionDeclaration*> functions;
+    std::unordered_map<std::string, FunctionDeclaration*> globalFunctions;
+    std::unordered_set<std::string> unstableGlobals;  // assigned, redeclared or shadowing a native
+    std::unordered_map<const FunctionDeclaration*, std::string> impure;
+    
+    // State while checking one function body
+    FunctionDeclaration* current;
+    std::vector<std::unordered_set<std::string>> scopes;
+    std::string violation;
+    
+    // Adds a program's functions and unstable globals; true if a global
+    // that calls could rely on became unstable
+    bool collect(Program& program);
+    // Settles the purity of candidates and updates their flags
+    void solve(const std::vector<FunctionDeclaration*>& candidates);
+    bool check(FunctionDeclaration* function);
+    bool isLocal(const std::string& name) const;
+    bool isPureCallee(const std::string& name) const;
+    void fail(const std::string& message);
+};
@@ -0,0 +1,75 @@
+#include "records.h"
+#include "interpreter.h"
+#include <algorithm>
+
+RecordReader::RecordReader(std::istream& input, RecordFormat format) : input(input), format(format) {}
+
+bool RecordReader::readLine() {
+    if (!std::getline(input, line)) return false;
+    if (!line.empty() && line.back() == '\r') line.pop_back();
+    return true;
+}
+
+bool RecordReader::next(FluxValue& record) {
+    switch (format) {
+        case RecordFormat::Lines:
+            if (!readLine()) return false;
+            record = FluxString(line);
+            return true;
+            
+        case RecordFormat::Jsonl:
+            while (readLine()) {
+                if (line.find_first_not_of(" \t") == std::string::npos) continue;
+                record = FluxString(line);
+                return true;
+            }
+            return false;
+            
+        case RecordFormat::Csv: {
+            if (!readLine()) return false;
+            std::string row = line;
+            // A quoted field with a line break continues on the next line
+            while (hasOpenQuote(row) && readLine()) {
+                row += '\n';
+                row += line;
+            }
+            record = splitCsv(row);
+            return true;
+        }
+    }
+    return false;
+}
+
+bool RecordReader::hasOpenQuote(const std::string& row) {
+    return std::count(row.begin(), row.end(), '"') % 2 != 0;
+}
+
+FluxValue RecordReader::splitCsv(const std::string& row) {
+    std::vector<FluxValue> fields;
+    std::string field;
+    bool quoted = false;
+    
+    for (size_t i = 0; i < row.size(); i++) {
+        char c = row[i];
+        if (quoted) {
+            if (c != '"') {
+                field += c;
+            } else if (i + 1 < row.size() && row[i + 1] == '"') {
+                field += '"';
+                i++;
+            } else {
+                quoted = false;
+            }
+        } else if (c == '"') {
+            quoted = true;
+        } else if (c == ',') {
+            fields.push_back(FluxString(field));
+            field.clear();
+        } else {
+            field += c;
+        }
+    }
+    fields.push_back(FluxString(field));
+    
+    return makeAccounted<FluxArray>(std::move(fields));
+}
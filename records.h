@@ -0,0 +1,33 @@
+#pragma once
+#include "ast.h"
+#include <istream>
+#include <string>
+
+// How --each splits its input into records
+enum class RecordFormat {
+    Lines,  // each line as a string
+    Csv,    // each row as an array of field strings (RFC 4180 quoting)
+    Jsonl   // each non-blank line as a string; Flux has no object type to decode into
+};
+
+// Reads records one at a time from a stream, for running a script once per
+// input record
+class RecordReader {
+public:
+    RecordReader(std::istream& input, RecordFormat format);
+    
+    // Produces the next record into `record`; false at the end of the input
+    bool next(FluxValue& record);
+    
+    // Splits one CSV row; a quoted field may contain commas, doubled quotes
+    // and newlines
+    static FluxValue splitCsv(const std::string& row);
+    
+private:
+    std::istream& input;
+    RecordFormat format;
+    std::string line;
+    
+    bool readLine();
+    static bool hasOpenQuote(const std::string& row);
+};
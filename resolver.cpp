@@ -0,0 +1,289 @@
+#include "resolver.h"
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace {
+
+// A declaration site: the VarDeclaration, ForInStatement or FunctionDeclaration
+// that introduces a name, or the parameter string itself
+using Site = const void*;
+
+// Pass 1: finds the locals referenced from a function nested in their owner
+class CaptureAnalyzer : public RecursiveVisitor {
+public:
+    std::unordered_set<Site> captured;
+    
+    void visit(IdentifierExpression& node) override {
+        reference(node.name);
+    }
+    
+    void visit(VarDeclaration& node) override {
+        RecursiveVisitor::visit(node);
+        declare(node.name, &node);
+    }
+    
+    void visit(BlockStatement& node) override {
+        scopes.emplace_back();
+        RecursiveVisitor::visit(node);
+        scopes.pop_back();
+    }
+    
+    void visit(ForStatement& node) override {
+        scopes.emplace_back();
+        RecursiveVisitor::visit(node);
+        scopes.pop_back();
+    }
+    
+    void visit(ForInStatement& node) override {
+        node.iterable->accept(*this);
+        scopes.emplace_back();
+        declare(node.variable, &node);
+        node.body->accept(*this);
+        scopes.pop_back();
+    }
+    
+    void visit(FunctionDeclaration& node) override {
+        declare(node.name, &node);
+        if (!node.body) return;  // lazy body, resolved once parsed
+        
+        const FunctionDeclaration* enclosing = current;
+        current = &node;
+        scopes.emplace_back();
+        for (const auto& param : node.parameters) {
+            declare(param, &param);
+        }
+        // Parameters and the body's top-level locals share one scope
+        for (auto& stmt : node.body->statements) {
+            stmt->accept(*this);
+        }
+        scopes.pop_back();
+        current = enclosing;
+    }
+    
+private:
+    struct Binding {
+        const FunctionDeclaration* owner;  // nullptr for blocks of top-level code
+        Site site;
+    };
+    
+    // Innermost-last; globals aren't tracked
+    std::vector<std::unordered_map<std::string, Binding>> scopes;
+    const FunctionDeclaration* current = nullptr;
+    
+    // A redeclaration in the same scope reuses the first binding, as it does
+    // at run time
+    void declare(const std::string& name, Site site) {
+        if (!scopes.empty()) scopes.back().emplace(name, Binding{current, site});
+    }
+    
+    void reference(const std::string& name) {
+        for (auto it = scopes.rbegin(); it != scopes.rend(); ++it) {
+            auto found = it->find(name);
+            if (found == it->end()) continue;
+            if (found->second.owner && found->second.owner != current) captured.insert(found->second.site);
+            return;
+        }
+    }
+};
+
+// Pass 2: gives the locals of framed functions their slots and cells, and
+// threads each captured cell through the upvalues of the functions between
+// its owner and the function referencing it
+class SlotAllocator : public RecursiveVisitor {
+public:
+    explicit SlotAllocator(const std::unordered_set<Site>& captured) : captured(captured) {}
+    
+    void visit(IdentifierExpression& node) override {
+        const Binding* binding = lookup(node.name);
+        if (!binding) return;
+        if (binding->owner == current()) {
+            node.slot = binding->slot;
+            node.cell = binding->cell;
+        } else if (binding->cell >= 0) {
+            node.upvalue = capture(*binding);
+        }
+    }
+    
+    void visit(VarDeclaration& node) override {
+        RecursiveVisitor::visit(node);
+        const Binding& binding = declare(node.name, &node);
+        node.slot = binding.slot;
+        node.cell = binding.cell;
+    }
+    
+    void visit(BlockStatement& node) override {
+        node.needsEnvironment = !framed() && declaresNames(node);
+        pushScope();
+        RecursiveVisitor::visit(node);
+        popScope();
+    }
+    
+    void visit(ForStatement& node) override {
+        node.needsEnvironment = !framed();
+        pushScope();
+        RecursiveVisitor::visit(node);
+        popScope();
+    }
+    
+    void visit(ForInStatement& node) override {
+        node.iterable->accept(*this);
+        pushScope();
+        const Binding& binding = declare(node.variable, &node);
+        node.slot = binding.slot;
+        node.cell = binding.cell;
+        node.body->accept(*this);
+        popScope();
+    }
+    
+    void visit(FunctionDeclaration& node) override {
+        const Binding& binding = declare(node.name, &node);
+        node.slot = binding.slot;
+        node.cell = binding.cell;
+        if (!node.body) return;
+        
+        int enclosingNextSlot = nextSlot;
+        functions.push_back(&node);
+        nextSlot = 0;
+        node.framed = !node.isGenerator;
+        node.frameSize = 0;
+        node.cellCount = 0;
+        node.parameterCells.clear();
+        node.upvalues.clear();
+        
+        pushScope();
+        for (const auto& param : node.parameters) {
+            // Parameters keep their positional slot even when captured, since
+            // the call copies arguments into the first slots of the frame
+            const Binding& parameter = declare(param, &param);
+            if (framed()) {
+                if (parameter.cell >= 0) {
+                    nextSlot++;
+                    node.frameSize = std::max(node.frameSize, nextSlot);
+                }
+                node.parameterCells.push_back(parameter.cell);
+            }
+        }
+        for (auto& stmt : node.body->statements) {
+            stmt->accept(*this);
+        }
+        popScope();
+        
+        functions.pop_back();
+        nextSlot = enclosingNextSlot;
+    }
+    
+private:
+    struct Binding {
+        FunctionDeclaration* owner;
+        int slot;
+        int cell;
+    };
+    
+    struct Scope {
+        std::unordered_map<std::string, Binding> names;
+        int firstSlot;
+    };
+    
+    const std::unordered_set<Site>& captured;
+    std::vector<Scope> scopes;
+    std::vector<FunctionDeclaration*> functions;  // innermost-last
+    int nextSlot = 0;
+    
+    FunctionDeclaration* current() const {
+        return functions.empty() ? nullptr : functions.back();
+    }
+    
+    bool framed() const {
+        return current() && current()->framed;
+    }
+    
+    static bool declaresNames(const BlockStatement& block) {
+        for (const auto& stmt : block.statements) {
+            if (dynamic_cast<VarDeclaration*>(stmt.get()) || dynamic_cast<FunctionDeclaration*>(stmt.get())) {
+                return true;
+            }
+        }
+        return false;
+    }
+    
+    // Slots of a finished scope are reused by its siblings; cells are not, so
+    // a cell index names one variable for the whole call
+    void pushScope() {
+        scopes.push_back({{}, nextSlot});
+    }
+    
+    void popScope() {
+        nextSlot = scopes.back().firstSlot;
+        scopes.pop_back();
+    }
+    
+    const Binding& declare(const std::string& name, Site site) {
+        static const Binding unresolved{nullptr, -1, -1};
+        if (scopes.empty()) return unresolved;
+        
+        auto existing = scopes.back().names.find(name);
+        if (existing != scopes.back().names.end()) return existing->second;
+        
+        Binding binding{current(), -1, -1};
+        if (framed()) {
+            if (captured.count(site)) {
+                binding.cell = current()->cellCount++;
+            } else {
+                binding.slot = nextSlot++;
+                current()->frameSize = std::max(current()->frameSize, nextSlot);
+            }
+        }
+        return scopes.back().names[name] = binding;
+    }
+    
+    const Binding* lookup(const std::string& name) const {
+        for (auto it = scopes.rbegin(); it != scopes.rend(); ++it) {
+            auto found = it->names.find(name);
+            if (found != it->names.end()) return &found->second;
+        }
+        return nullptr;
+    }
+    
+    // Adds the cell to the upvalues of every function from its owner inward
+    // and returns its index among the current function's upvalues
+    int capture(const Binding& binding) {
+        auto owner = std::find(functions.begin(), functions.end(), binding.owner);
+        UpvalueSource source{true, binding.cell};
+        for (auto it = owner + 1; it != functions.end(); ++it) {
+            source = {false, addUpvalue(**it, source)};
+        }
+        return source.index;
+    }
+    
+    static int addUpvalue(FunctionDeclaration& function, UpvalueSource source) {
+        for (size_t i = 0; i < function.upvalues.size(); i++) {
+            const UpvalueSource& existing = function.upvalues[i];
+            if (existing.fromCell == source.fromCell && existing.index == source.index) {
+                return static_cast<int>(i);
+            }
+        }
+        function.upvalues.push_back(source);
+        return static_cast<int>(function.upvalues.size()) - 1;
+    }
+};
+
+}
+
+void Resolver::resolve(Program& program) {
+    CaptureAnalyzer captures;
+    program.accept(captures);
+    
+    SlotAllocator slots(captures.captured);
+    program.accept(slots);
+}
+
+void Resolver::resolveFunction(FunctionDeclaration& function) {
+    CaptureAnalyzer captures;
+    function.accept(captures);
+    
+    SlotAllocator slots(captures.captured);
+    function.accept(slots);
+}
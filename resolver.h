@@ -0,0 +1,21 @@
+#pragma once
+#include "ast.h"
+
+// Escape analysis and frame-slot allocation, run once after parsing.
+//
+// Every function but a generator is marked framed: its parameters and locals
+// are given slots in a contiguous frame on the interpreter's frame stack
+// instead of living in a heap-allocated Environment, and every node that
+// touches them records its slot. Blocks left with nothing to hold are marked
+// as not needing an environment.
+//
+// The locals that do escape, because a nested function references them (like
+// count in makeCounter), get a cell instead of a slot. Each nested function
+// lists the free variables it references as upvalues, so a closure captures
+// exactly those cells rather than the whole chain of enclosing scopes.
+class Resolver {
+public:
+    void resolve(Program& program);
+    // Resolves one top-level function, e.g. a lazily parsed one
+    void resolveFunction(FunctionDeclaration& function);
+};
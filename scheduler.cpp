@@ -0,0 +1,65 @@
+#include "scheduler.h"
+#include <algorithm>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+
+Scheduler::Scheduler(size_t threads) : threadCount(std::max<size_t>(1, threads)) {}
+
+void Scheduler::add(Task task) {
+    auto entry = std::make_unique<Entry>();
+    Entry* target = entry.get();
+    entry->fiber = std::make_unique<Fiber>([target, task = std::move(task)]() {
+        task(target->out, target->err);
+    });
+    entries.push_back(std::move(entry));
+}
+
+void Scheduler::run(std::ostream& out, std::ostream& err) {
+    std::mutex outputMutex;
+    
+    auto pass = [&](Entry& entry, const std::string& error) {
+        std::lock_guard<std::mutex> lock(outputMutex);
+        out << entry.out.str();
+        out.flush();
+        err << entry.err.str() << error;
+        entry.out.str("");
+        entry.err.str("");
+    };
+    
+    // Fibers can't move between threads, so each thread keeps the tasks it
+    // was dealt
+    auto work = [&](size_t thread) {
+        std::deque<Entry*> queue;
+        for (size_t i = thread; i < entries.size(); i += threadCount) {
+            queue.push_back(entries[i].get());
+        }
+        
+        while (!queue.empty()) {
+            Entry* entry = queue.front();
+            queue.pop_front();
+            bool more = false;
+            std::string error;
+            try {
+                more = entry->fiber->resume();
+            } catch (const std::exception& e) {
+                error = std::string("Error: ") + e.what() + "\n";
+            }
+            pass(*entry, error);
+            if (more) queue.push_back(entry);
+        }
+    };
+    
+    size_t threads = std::min(threadCount, entries.size());
+    std::vector<std::thread> workers;
+    for (size_t i = 1; i < threads; i++) {
+        workers.emplace_back(work, i);
+    }
+    if (threads > 0) work(0);
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    
+    entries.clear();
+}
@@ -0,0 +1,40 @@
+#pragma once
+#include "fiber.h"
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <ostream>
+#include <sstream>
+#include <vector>
+
+// Runs many tasks on a few threads by time-slicing them. Each task runs on
+// a Fiber of its own and gives up its thread by yielding, which a Flux
+// interpreter with a quantum does whenever its fuel runs out. Tasks are
+// dealt out to the threads in turn and each thread resumes its own tasks
+// round-robin, so a task that never finishes only ever delays the others by
+// one slice per round.
+//
+// A task writes to streams of its own. What it wrote is passed on to the
+// real output after each slice, so output of different tasks never
+// interleaves within a slice and each task's output stays in order.
+class Scheduler {
+public:
+    using Task = std::function<void(std::ostream& out, std::ostream& err)>;
+    
+    explicit Scheduler(size_t threads);
+    
+    void add(Task task);
+    // Runs every task to completion. A task that throws has the error
+    // written to err as "Error: ..." and is dropped.
+    void run(std::ostream& out, std::ostream& err);
+    
+private:
+    struct Entry {
+        std::unique_ptr<Fiber> fiber;
+        std::ostringstream out;
+        std::ostringstream err;
+    };
+    
+    size_t threadCount;
+    std::vector<std::unique_ptr<Entry>> entries;
+};
@@ -0,0 +1,251 @@
+#include "server.h"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+volatile std::sig_atomic_t stopRequested = 0;
+
+void requestStop(int) {
+    stopRequested = 1;
+}
+
+// Answers one request, appending the response line to out
+void answer(Interpreter& interpreter, const FluxValue& handler, std::string_view request, std::string& out) {
+    try {
+        FluxValue result = interpreter.callValue(handler, {FluxString(request)});
+        if (auto str = std::get_if<FluxString>(&result)) {
+            out.append(str->data(), str->size());
+        } else {
+            out += interpreter.stringify(result);
+        }
+    } catch (const std::exception& e) {
+        out += "error: ";
+        out += e.what();
+    }
+    out += '\n';
+}
+
+uint64_t elapsedSince(std::chrono::steady_clock::time_point start) {
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+}
+
+#ifndef _WIN32
+
+// Answers every complete line a client sends until it hangs up. Responses to
+// pipelined requests go out together once the input buffer is drained.
+void serveConnection(Interpreter& interpreter, const FluxValue& handler, int client, LatencyHistogram& latencies) {
+    std::string pending;
+    std::string responses;
+    char buffer[65536];
+    
+    while (!stopRequested) {
+        ssize_t received = read(client, buffer, sizeof(buffer));
+        if (received < 0 && errno == EINTR) continue;
+        if (received <= 0) break;
+        pending.append(buffer, static_cast<size_t>(received));
+        
+        size_t start = 0;
+        size_t end;
+        while ((end = pending.find('\n', start)) != std::string::npos) {
+            auto began = std::chrono::steady_clock::now();
+            size_t length = end - start;
+            if (length > 0 && pending[end - 1] == '\r') length--;
+            answer(interpreter, handler, std::string_view(pending).substr(start, length), responses);
+            latencies.record(elapsedSince(began));
+            start = end + 1;
+        }
+        pending.erase(0, start);
+        
+        size_t sent = 0;
+        while (sent < responses.size()) {
+            ssize_t written = write(client, responses.data() + sent, responses.size() - sent);
+            if (written < 0 && errno == EINTR) continue;
+            if (written <= 0) return;
+            sent += static_cast<size_t>(written);
+        }
+        responses.clear();
+    }
+}
+
+void runWorker(Interpreter& interpreter, const FluxValue& handler, int listener) {
+    LatencyHistogram latencies;
+    while (!stopRequested) {
+        int client = accept(listener, nullptr, nullptr);
+        if (client < 0) {
+            // Interrupted, or the client gave up before being accepted
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            break;
+        }
+        serveConnection(interpreter, handler, client, latencies);
+        close(client);
+    }
+    std::cout.flush();
+    latencies.writeSummary(std::cerr, "worker " + std::to_string(getpid()));
+}
+
+int serveSocket(Interpreter& interpreter, const FluxValue& handler, const std::string& socketPath, size_t workers) {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (socketPath.size() >= sizeof(address.sun_path)) {
+        throw std::runtime_error("Socket path is too long: " + socketPath);
+    }
+    std::strcpy(address.sun_path, socketPath.c_str());
+    
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(socketPath.c_str());
+    if (listener < 0 || bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+        listen(listener, 128) != 0) {
+        throw std::runtime_error("Could not listen on " + socketPath + ": " + std::strerror(errno));
+    }
+    
+    // No SA_RESTART: a signal has to interrupt accept, read and waitpid
+    struct sigaction action{};
+    action.sa_handler = requestStop;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+    signal(SIGPIPE, SIG_IGN);
+    
+    // Threads don't survive fork; children start their own pool if they need one
+    interpreter.stopWorkerThreads();
+    std::cout.flush();
+    
+    std::vector<pid_t> children;
+    auto spawn = [&]() -> bool {
+        pid_t pid = fork();
+        if (pid == 0) {
+            runWorker(interpreter, handler, listener);
+            _exit(0);
+        }
+        if (pid > 0) children.push_back(pid);
+        return pid > 0;
+    };
+    for (size_t i = 0; i < workers; i++) {
+        if (!spawn()) throw std::runtime_error(std::string("Could not fork a worker: ") + std::strerror(errno));
+    }
+    std::cerr << "Serving on " << socketPath << " with " << workers << " workers" << std::endl;
+    
+    while (!stopRequested) {
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid <= 0) continue;
+        children.erase(std::remove(children.begin(), children.end(), pid), children.end());
+        if (!stopRequested) {
+            std::cerr << "Worker " << pid << " died; starting another" << std::endl;
+            spawn();
+        }
+    }
+    
+    for (pid_t pid : children) {
+        kill(pid, SIGTERM);
+    }
+    for (pid_t pid : children) {
+        waitpid(pid, nullptr, 0);
+    }
+    close(listener);
+    unlink(socketPath.c_str());
+    return 0;
+}
+
+#endif
+
+}
+
+void LatencyHistogram::record(uint64_t nanoseconds) {
+    buckets[bucketOf(nanoseconds)]++;
+    total++;
+    if (nanoseconds > maximum) maximum = nanoseconds;
+}
+
+size_t LatencyHistogram::bucketOf(uint64_t nanoseconds) {
+    if (nanoseconds < SubBuckets) return nanoseconds;
+    int exponent = 4;
+    while (nanoseconds >> (exponent + 1)) exponent++;
+    // The SubBuckets values below the top bit, scaled to 0..SubBuckets-1
+    size_t sub = (nanoseconds >> (exponent - 4)) & (SubBuckets - 1);
+    return (exponent - 3) * SubBuckets + sub;
+}
+
+uint64_t LatencyHistogram::bucketLimit(size_t bucket) {
+    if (bucket < SubBuckets) return bucket;
+    int exponent = static_cast<int>(bucket / SubBuckets) + 3;
+    uint64_t sub = bucket % SubBuckets;
+    return ((SubBuckets + sub + 1) << (exponent - 4)) - 1;
+}
+
+uint64_t LatencyHistogram::percentile(double fraction) const {
+    uint64_t rank = static_cast<uint64_t>(fraction * total);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < sizeof(buckets) / sizeof(buckets[0]); i++) {
+        seen += buckets[i];
+        if (seen > rank) return std::min(bucketLimit(i), maximum);
+    }
+    return maximum;
+}
+
+void LatencyHistogram::writeSummary(std::ostream& out, const std::string& who) const {
+    out << who << ": " << total << " requests";
+    if (total > 0) {
+        out << ", latency p50 " << percentile(0.5) / 1000.0 << "us, p99 " << percentile(0.99) / 1000.0
+            << "us, max " << maximum / 1000.0 << "us";
+    }
+    out << std::endl;
+}
+
+int serve(Interpreter& interpreter, const std::string& socketPath, size_t workers,
+          std::istream& input, std::ostream& output) {
+    try {
+        const auto& globals = interpreter.globals->bindings();
+        if (!globals.count("handle")) {
+            throw std::runtime_error("--serve requires the script to define a function handle(request)");
+        }
+        FluxValue handler = globals.at("handle");
+        
+        if (!socketPath.empty()) {
+#ifndef _WIN32
+            if (workers == 0) workers = std::max(1u, std::thread::hardware_concurrency());
+            return serveSocket(interpreter, handler, socketPath, workers);
+#else
+            throw std::runtime_error("Serving on a socket needs fork and Unix sockets; use --serve with stdin");
+#endif
+        }
+        
+        LatencyHistogram latencies;
+        std::string line;
+        std::string response;
+        // Flushing is decided below; a tied output would be flushed by every read
+        input.tie(nullptr);
+        while (std::getline(input, line)) {
+            auto began = std::chrono::steady_clock::now();
+            if (!line.empty() && line.back() == '\r') line.pop_back();
+            response.clear();
+            answer(interpreter, handler, line, response);
+            output << response;
+            latencies.record(elapsedSince(began));
+            // A client waiting for this answer before sending more must get it now
+            if (input.rdbuf()->in_avail() <= 0) output.flush();
+        }
+        output.flush();
+        latencies.writeSummary(std::cerr, "server");
+        return 0;
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+}
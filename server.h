@@ -0,0 +1,39 @@
+#pragma once
+#include "interpreter.h"
+#include <cstddef>
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include <string>
+
+// Latencies in log-linear buckets: 16 per power of two, so percentiles are
+// within about 6% at any scale and recording never allocates
+class LatencyHistogram {
+public:
+    void record(uint64_t nanoseconds);
+    uint64_t count() const { return total; }
+    // Upper bound of the bucket holding the given fraction of samples
+    uint64_t percentile(double fraction) const;
+    void writeSummary(std::ostream& out, const std::string& who) const;
+    
+private:
+    static constexpr int SubBuckets = 16;
+    uint64_t buckets[64 * SubBuckets] = {};
+    uint64_t total = 0;
+    uint64_t maximum = 0;
+    
+    static size_t bucketOf(uint64_t nanoseconds);
+    static uint64_t bucketLimit(size_t bucket);
+};
+
+// Serving mode. The script has been run once; its handle(request) function
+// then answers requests, one per line, each response being the text of the
+// returned value on a line of its own (or "error: ..." if the call threw).
+//
+// With a socket path, the warmed interpreter is forked into workers that
+// share it copy-on-write and accept connections on a Unix socket; a worker
+// that dies is replaced. Otherwise requests are read from `input`. Each
+// worker reports its request count and latency percentiles to stderr when
+// it stops. Returns the process exit code.
+int serve(Interpreter& interpreter, const std::string& socketPath, size_t workers,
+          std::istream& input, std::ostream& output);
@@ -0,0 +1,298 @@
+#include "snapshot.h"
+#include "mappedfile.h"
+#include "parser.h"
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <unordered_map>
+
+namespace {
+
+const char Magic[8] = {'F', 'L', 'U', 'X', 'S', 'N', 'A', 'P'};
+const uint32_t Version = 2;
+
+enum class Tag : uint8_t { Nil, False, True, Number, String, Array, Function, Native };
+
+// Where a function is declared: its unit and top-level statement
+struct DeclarationSite {
+    uint32_t unit;
+    uint32_t statement;
+};
+
+class SnapshotWriter {
+public:
+    explicit SnapshotWriter(const std::vector<const Module*>& units) {
+        for (uint32_t u = 0; u < units.size(); u++) {
+            const auto& statements = units[u]->program->statements;
+            for (uint32_t s = 0; s < statements.size(); s++) {
+                if (auto function = dynamic_cast<FunctionDeclaration*>(statements[s].get())) {
+                    sites[function] = {u, s};
+                }
+            }
+        }
+    }
+    
+    std::string image;
+    
+    template <typename T>
+    void put(T value) {
+        image.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+    
+    void putText(std::string_view text) {
+        put<uint64_t>(text.size());
+        image.append(text.data(), text.size());
+    }
+    
+    // Arrays are numbered as first seen and written after the globals, so
+    // shared and cyclic arrays come back shared. Functions are numbered the
+    // same way, with their declaration written the first time only, so a
+    // function bound to several names is still one function with one memo
+    // cache.
+    void putValue(const std::string& what, const FluxValue& value, const std::shared_ptr<Environment>& globals) {
+        if (std::holds_alternative<std::nullptr_t>(value)) {
+            put(Tag::Nil);
+        } else if (auto b = std::get_if<bool>(&value)) {
+            put(*b ? Tag::True : Tag::False);
+        } else if (auto num = std::get_if<double>(&value)) {
+            put(Tag::Number);
+            put(*num);
+        } else if (auto str = std::get_if<FluxString>(&value)) {
+            put(Tag::String);
+            putText(str->view());
+        } else if (auto array = std::get_if<std::shared_ptr<FluxArray>>(&value)) {
+            auto found = arrayIds.find(array->get());
+            if (found == arrayIds.end()) {
+                found = arrayIds.emplace(array->get(), static_cast<uint32_t>(arrays.size())).first;
+                arrays.push_back(*array);
+            }
+            put(Tag::Array);
+            put(found->second);
+        } else if (auto callable = std::get_if<std::shared_ptr<FluxCallable>>(&value)) {
+            if (auto native = std::dynamic_pointer_cast<NativeFunction>(*callable)) {
+                put(Tag::Native);
+                putText(native->name);
+                return;
+            }
+            auto function = std::dynamic_pointer_cast<FluxFunction>(*callable);
+            auto site = function ? sites.find(function->declaration) : sites.end();
+            if (site == sites.end() || function->closure != globals || !function->upvalues.empty()) {
+                throw std::runtime_error("Cannot snapshot " + what + ": " + (*callable)->toString() +
+                                         " is not a top-level function");
+            }
+            put(Tag::Function);
+            auto found = functionIds.find(function.get());
+            if (found != functionIds.end()) {
+                put(found->second);
+                return;
+            }
+            uint32_t id = static_cast<uint32_t>(functionIds.size());
+            functionIds.emplace(function.get(), id);
+            put(id);
+            put(site->second.unit);
+            put(site->second.statement);
+        } else {
+            throw std::runtime_error("Cannot snapshot " + what + ": iterators and generators have running state");
+        }
+    }
+    
+    std::vector<std::shared_ptr<FluxArray>> arrays;
+    
+private:
+    std::unordered_map<const FunctionDeclaration*, DeclarationSite> sites;
+    std::unordered_map<const FluxArray*, uint32_t> arrayIds;
+    std::unordered_map<const FluxFunction*, uint32_t> functionIds;
+};
+
+class SnapshotReader {
+public:
+    SnapshotReader(std::shared_ptr<MappedFile> file) : file(std::move(file)), position(0) {}
+    
+    template <typename T>
+    T get() {
+        T value;
+        std::memcpy(&value, take(sizeof(T)), sizeof(T));
+        return value;
+    }
+    
+    // A count of items, each taking at least itemSize bytes of the image. It
+    // is checked against the bytes left, so a corrupt count fails here rather
+    // than in a huge allocation.
+    template <typename T>
+    size_t getCount(size_t itemSize) {
+        T count = get<T>();
+        if (count > (file->size() - position) / itemSize) {
+            throw std::runtime_error("Snapshot is truncated or corrupt");
+        }
+        return static_cast<size_t>(count);
+    }
+    
+    std::string_view getText() {
+        uint64_t size = get<uint64_t>();
+        return std::string_view(take(size), size);
+    }
+    
+    // Strings view the mapped image, which they keep alive
+    FluxString getString() {
+        std::string_view text = getText();
+        return FluxString::external(text.data(), text.size(), file);
+    }
+    
+private:
+    std::shared_ptr<MappedFile> file;
+    size_t position;
+    
+    const char* take(uint64_t size) {
+        if (size > file->size() - position) {
+            throw std::runtime_error("Snapshot is truncated or corrupt");
+        }
+        const char* data = file->data() + position;
+        position += size;
+        return data;
+    }
+};
+
+}
+
+void writeSnapshot(const std::string& path, Interpreter& interpreter, const std::vector<const Module*>& units) {
+    std::vector<const Module*> all = units;
+    for (const Module* module : interpreter.moduleCache().loaded()) {
+        all.push_back(module);
+    }
+    
+    SnapshotWriter writer(all);
+    writer.image.append(Magic, sizeof(Magic));
+    writer.put(Version);
+    
+    writer.put<uint32_t>(all.size());
+    for (const Module* module : all) {
+        writer.putText(ModuleCache::key(module->path));
+        writer.putText(module->lexer->text());
+    }
+    
+    const auto& bindings = interpreter.globals->bindings();
+    writer.put<uint32_t>(bindings.size());
+    for (const auto& binding : bindings) {
+        writer.putText(binding.first);
+        writer.putValue("'" + binding.first + "'", binding.second, interpreter.globals);
+    }
+    std::string head = std::move(writer.image);
+    
+    // Writing an array's elements may number more arrays, so the count is
+    // only known at the end
+    writer.image.clear();
+    for (size_t i = 0; i < writer.arrays.size(); i++) {
+        const auto& elements = writer.arrays[i]->elements;
+        writer.put<uint64_t>(elements.size());
+        for (const auto& element : elements) {
+            writer.putValue("an array element", element, interpreter.globals);
+        }
+    }
+    uint64_t arrayCount = writer.arrays.size();
+    head.append(reinterpret_cast<const char*>(&arrayCount), sizeof(arrayCount));
+    
+    std::ofstream out(path, std::ios::binary);
+    out.write(head.data(), head.size());
+    out.write(writer.image.data(), writer.image.size());
+    if (!out) {
+        throw std::runtime_error("Could not write snapshot '" + path + "'");
+    }
+}
+
+void readSnapshot(const std::string& path, Interpreter& interpreter) {
+    SnapshotReader reader(MappedFile::open(path));
+    char magic[sizeof(Magic)];
+    for (char& c : magic) c = reader.get<char>();
+    if (std::memcmp(magic, Magic, sizeof(Magic)) != 0 || reader.get<uint32_t>() != Version) {
+        throw std::runtime_error("'" + path + "' is not a snapshot of this version of Flux");
+    }
+    
+    // A unit is at least its path's and its source's lengths
+    std::vector<Module*> units(reader.getCount<uint32_t>(2 * sizeof(uint64_t)));
+    auto pureNatives = interpreter.pureNativeNames();
+    for (auto& unit : units) {
+        auto module = std::make_unique<Module>();
+        module->path = std::string(reader.getText());
+        module->lexer = std::make_unique<Lexer>(std::string(reader.getText()));
+        auto tokens = module->lexer->tokenize();
+        Parser parser(tokens, true, module->path);
+        module->program = parser.parse();
+        analyzeProgram(*module->program, pureNatives, interpreter.optimizationLevel());
+        unit = module.get();
+        interpreter.moduleCache().adopt(std::move(module));
+    }
+    
+    // Values are decoded after every global is read, since arrays come last
+    std::unordered_map<std::string, std::shared_ptr<FluxCallable>> natives;
+    for (const auto& binding : interpreter.globals->bindings()) {
+        if (auto callable = std::get_if<std::shared_ptr<FluxCallable>>(&binding.second)) {
+            if (auto native = std::dynamic_pointer_cast<NativeFunction>(*callable)) natives[native->name] = native;
+        }
+    }
+    std::vector<std::shared_ptr<FluxArray>> arrays;
+    std::vector<std::pair<FluxValue*, uint32_t>> arrayReferences;
+    std::vector<std::shared_ptr<FluxFunction>> functions;
+    
+    auto getValue = [&](FluxValue& value) {
+        switch (reader.get<Tag>()) {
+            case Tag::Nil: value = nullptr; return;
+            case Tag::False: value = false; return;
+            case Tag::True: value = true; return;
+            case Tag::Number: value = reader.get<double>(); return;
+            case Tag::String: value = reader.getString(); return;
+            case Tag::Array: arrayReferences.emplace_back(&value, reader.get<uint32_t>()); return;
+            case Tag::Function: {
+                // A function seen before is only its number
+                uint32_t id = reader.get<uint32_t>();
+                if (id < functions.size()) {
+                    value = std::static_pointer_cast<FluxCallable>(functions[id]);
+                    return;
+                }
+                if (id != functions.size()) throw std::runtime_error("Snapshot is corrupt");
+                uint32_t unit = reader.get<uint32_t>();
+                uint32_t statement = reader.get<uint32_t>();
+                FunctionDeclaration* declaration = nullptr;
+                if (unit < units.size() && statement < units[unit]->program->statements.size()) {
+                    declaration = dynamic_cast<FunctionDeclaration*>(units[unit]->program->statements[statement].get());
+                }
+                if (!declaration) throw std::runtime_error("Snapshot is corrupt");
+                functions.push_back(interpreter.topLevelFunction(*declaration));
+                value = std::static_pointer_cast<FluxCallable>(functions.back());
+                return;
+            }
+            case Tag::Native: {
+                auto native = natives.find(std::string(reader.getText()));
+                if (native == natives.end()) throw std::runtime_error("Snapshot refers to an unknown native");
+                value = native->second;
+                return;
+            }
+        }
+        throw std::runtime_error("Snapshot is corrupt");
+    };
+    
+    // A global is at least its name's length and its value's tag
+    std::vector<std::pair<std::string, FluxValue>> globals(reader.getCount<uint32_t>(sizeof(uint64_t) + sizeof(Tag)));
+    for (auto& global : globals) {
+        global.first = std::string(reader.getText());
+        getValue(global.second);
+    }
+    // Elements are read into place; references to arrays are patched once
+    // every array exists
+    size_t arrayCount = reader.getCount<uint64_t>(sizeof(uint64_t));
+    for (size_t i = 0; i < arrayCount; i++) {
+        auto array = makeAccounted<FluxArray>();
+        array->elements.resize(reader.getCount<uint64_t>(sizeof(Tag)));
+        arrays.push_back(array);
+        for (auto& element : array->elements) {
+            getValue(element);
+        }
+    }
+    for (auto& reference : arrayReferences) {
+        if (reference.second >= arrays.size()) throw std::runtime_error("Snapshot is corrupt");
+        *reference.first = arrays[reference.second];
+    }
+    
+    for (auto& global : globals) {
+        interpreter.globals->define(global.first, std::move(global.second));
+    }
+}
@@ -0,0 +1,22 @@
+#pragma once
+#include "interpreter.h"
+#include "module.h"
+#include <string>
+#include <vector>
+
+// Snapshots of the global environment, so short-lived processes can start
+// from a loaded prelude without running it again. An image holds the source
+// of every unit that was run (scripts and their imports) and the values of
+// the globals. Functions are stored as references to their top-level
+// declarations, which are parsed again with lazy bodies when the image is
+// loaded. Strings are read in place from the mapped image. Offsets replace
+// pointers throughout, so an image can be loaded at any address.
+
+// Writes interpreter's globals to path. units are the scripts it ran; its
+// imports are found in its module cache. Throws std::runtime_error for a
+// global that can't be stored, such as a closure over locals or a generator.
+void writeSnapshot(const std::string& path, Interpreter& interpreter, const std::vector<const Module*>& units);
+
+// Restores an image into an interpreter that hasn't run anything yet. The
+// units go into its module cache, so importing them again does nothing.
+void readSnapshot(const std::string& path, Interpreter& interpreter);
@@ -0,0 +1,42 @@
+#include "stats.h"
+#include <algorithm>
+
+void RuntimeStats::merge(const RuntimeStats& other) {
+    functionCalls += other.functionCalls;
+    memoHits += other.memoHits;
+    nativeCalls += other.nativeCalls;
+    nativeNanoseconds += other.nativeNanoseconds;
+    environments += other.environments;
+    closures += other.closures;
+    arrays += other.arrays;
+    strings += other.strings;
+    generators += other.generators;
+    // Workers start from an empty stack of their own, on top of the caller's
+    peakCallDepth = std::max(peakCallDepth, callDepth + other.peakCallDepth);
+    peakMemory = std::max(peakMemory, other.peakMemory);
+}
+
+void RuntimeStats::reset() {
+    bool timed = timeNatives;
+    *this = RuntimeStats();
+    timeNatives = timed;
+}
+
+void RuntimeStats::writeJson(std::ostream& out) const {
+    out << "{\n"
+        << "  \"function_calls\": " << functionCalls << ",\n"
+        << "  \"memo_hits\": " << memoHits << ",\n"
+        << "  \"native_calls\": " << nativeCalls << ",\n"
+        << "  \"native_time_ns\": " << nativeNanoseconds << ",\n"
+        << "  \"allocations\": {\n"
+        << "    \"total\": " << allocations() << ",\n"
+        << "    \"environments\": " << environments << ",\n"
+        << "    \"closures\": " << closures << ",\n"
+        << "    \"arrays\": " << arrays << ",\n"
+        << "    \"strings\": " << strings << ",\n"
+        << "    \"generators\": " << generators << "\n"
+        << "  },\n"
+        << "  \"peak_call_depth\": " << peakCallDepth << ",\n"
+        << "  \"peak_memory_bytes\": " << peakMemory << "\n"
+        << "}\n";
+}
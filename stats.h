@@ -0,0 +1,67 @@
+#pragma once
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+
+// Counters of what an interpreter did during its run. They are always
+// collected: each interpreter owns one set and bumps plain integers without
+// synchronization, and parallel_map merges its workers' sets back into the
+// caller's. Only native timing, which reads the clock twice per call, has to
+// be switched on.
+struct RuntimeStats {
+    uint64_t functionCalls = 0;   // calls of Flux functions, memo hits included
+    uint64_t memoHits = 0;
+    uint64_t nativeCalls = 0;
+    uint64_t nativeNanoseconds = 0;  // inclusive; 0 unless timeNatives is set
+    uint64_t environments = 0;
+    uint64_t closures = 0;
+    uint64_t arrays = 0;
+    uint64_t strings = 0;         // built at run time by concatenation
+    uint64_t generators = 0;
+    size_t callDepth = 0;
+    size_t peakCallDepth = 0;
+    size_t peakMemory = 0;        // bytes; copied from the MemoryAccount when reported
+    bool timeNatives = false;
+    
+    uint64_t allocations() const { return environments + closures + arrays + strings + generators; }
+    
+    void merge(const RuntimeStats& other);
+    void reset();
+    void writeJson(std::ostream& out) const;
+};
+
+// Tracks the depth of one Flux call, unwinding with it on errors
+class CallDepthScope {
+public:
+    explicit CallDepthScope(RuntimeStats& stats) : stats(stats) {
+        if (++stats.callDepth > stats.peakCallDepth) stats.peakCallDepth = stats.callDepth;
+    }
+    ~CallDepthScope() { stats.callDepth--; }
+    
+    CallDepthScope(const CallDepthScope&) = delete;
+    CallDepthScope& operator=(const CallDepthScope&) = delete;
+    
+private:
+    RuntimeStats& stats;
+};
+
+// Adds the time until it goes out of scope to the native time, when timed
+class NativeTimer {
+public:
+    explicit NativeTimer(RuntimeStats& stats) : stats(stats) {
+        if (stats.timeNatives) start = std::chrono::steady_clock::now();
+    }
+    ~NativeTimer() {
+        if (!stats.timeNatives) return;
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        stats.nativeNanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+    }
+    
+    NativeTimer(const NativeTimer&) = delete;
+    NativeTimer& operator=(const NativeTimer&) = delete;
+    
+private:
+    RuntimeStats& stats;
+    std::chrono::steady_clock::time_point start;
+};
@@ -0,0 +1,138 @@
+#include "threadpool.h"
+#include <algorithm>
+
+namespace {
+thread_local bool isPoolThread = false;
+}
+
+WorkStealingPool::WorkStealingPool(size_t threadCount)
+    : job(nullptr), generation(0), busyWorkers(0), stopping(false), cancelled(false) {
+    if (threadCount == 0) threadCount = 1;
+    
+    for (size_t i = 0; i < threadCount; i++) {
+        queues.push_back(std::make_unique<WorkQueue>());
+    }
+    for (size_t i = 0; i < threadCount; i++) {
+        threads.emplace_back(&WorkStealingPool::workerLoop, this, i);
+    }
+}
+
+WorkStealingPool::~WorkStealingPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
+size_t WorkStealingPool::size() const {
+    return threads.size();
+}
+
+bool WorkStealingPool::onWorkerThread() {
+    return isPoolThread;
+}
+
+void WorkStealingPool::parallelFor(size_t count, const std::function<void(size_t, size_t)>& body) {
+    if (count == 0) return;
+    
+    if (onWorkerThread()) {
+        for (size_t i = 0; i < count; i++) {
+            body(0, i);
+        }
+        return;
+    }
+    
+    std::lock_guard<std::mutex> callLock(callMutex);
+    
+    // Several chunks per worker leaves room for stealing to even out the load
+    size_t workers = threads.size();
+    size_t chunk = std::max<size_t>(1, count / (workers * 8));
+    size_t next = 0;
+    for (size_t begin = 0; begin < count; begin += chunk) {
+        size_t end = std::min(count, begin + chunk);
+        queues[next]->ranges.push_back({begin, end});
+        next = (next + 1) % workers;
+    }
+    
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        job = &body;
+        failure = nullptr;
+        cancelled = false;
+        busyWorkers = workers;
+        generation++;
+    }
+    wake.notify_all();
+    
+    std::exception_ptr error;
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [this] { return busyWorkers == 0; });
+        job = nullptr;
+        error = failure;
+        failure = nullptr;
+    }
+    
+    if (error) std::rethrow_exception(error);
+}
+
+void WorkStealingPool::workerLoop(size_t worker) {
+    isPoolThread = true;
+    size_t seen = 0;
+    
+    while (true) {
+        const std::function<void(size_t, size_t)>* body;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [&] { return stopping || generation != seen; });
+            if (stopping) return;
+            seen = generation;
+            body = job;
+        }
+        
+        Range range;
+        while (takeWork(worker, range)) {
+            for (size_t i = range.begin; i < range.end && !cancelled; i++) {
+                try {
+                    (*body)(worker, i);
+                } catch (...) {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if (!failure) failure = std::current_exception();
+                    cancelled = true;
+                }
+            }
+        }
+        
+        std::lock_guard<std::mutex> lock(mutex);
+        if (--busyWorkers == 0) done.notify_all();
+    }
+}
+
+bool WorkStealingPool::takeWork(size_t worker, Range& range) {
+    {
+        WorkQueue& own = *queues[worker];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.ranges.empty()) {
+            range = own.ranges.front();
+            own.ranges.pop_front();
+            return true;
+        }
+    }
+    
+    for (size_t offset = 1; offset < queues.size(); offset++) {
+        WorkQueue& victim = *queues[(worker + offset) % queues.size()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.ranges.empty()) {
+            range = victim.ranges.back();
+            victim.ranges.pop_back();
+            return true;
+        }
+    }
+    
+    return false;
+}
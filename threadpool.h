@@ -0,0 +1,61 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed-size pool of worker threads for data-parallel loops. Each worker owns
+// a deque of index ranges: it pops its own work from the front and, once that
+// runs dry, steals from the back of another worker's deque, so uneven
+// per-item costs still keep every thread busy.
+class WorkStealingPool {
+public:
+    explicit WorkStealingPool(size_t threads);
+    ~WorkStealingPool();
+    
+    // Runs body(worker, index) for every index in [0, count) and blocks until
+    // all calls have finished. worker is in [0, size()) and names the thread
+    // running the call, so callers can keep per-worker state without locking.
+    // The first exception thrown by body cancels the remaining work and is
+    // rethrown here.
+    void parallelFor(size_t count, const std::function<void(size_t, size_t)>& body);
+    
+    size_t size() const;
+    
+    // True on a pool thread; nested parallel loops run inline there
+    static bool onWorkerThread();
+    
+private:
+    struct Range {
+        size_t begin;
+        size_t end;
+    };
+    
+    struct WorkQueue {
+        std::mutex mutex;
+        std::deque<Range> ranges;
+    };
+    
+    std::vector<std::thread> threads;
+    std::vector<std::unique_ptr<WorkQueue>> queues;
+    
+    std::mutex callMutex;  // one parallelFor at a time
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    const std::function<void(size_t, size_t)>* job;
+    size_t generation;
+    size_t busyWorkers;
+    bool stopping;
+    std::atomic<bool> cancelled;
+    std::exception_ptr failure;
+    
+    void workerLoop(size_t worker);
+    bool takeWork(size_t worker, Range& range);
+};
@@ -0,0 +1,155 @@
+#include "trace.h"
+#include "stats.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+namespace {
+
+std::chrono::steady_clock::time_point traceEpoch;
+
+void writeEscaped(std::ostream& out, const char* text) {
+    for (const char* c = text; *c; c++) {
+        if (*c == '"' || *c == '\\') {
+            out << '\\' << *c;
+        } else if (static_cast<unsigned char>(*c) < 0x20) {
+            out << ' ';
+        } else {
+            out << *c;
+        }
+    }
+}
+
+void writeMicros(std::ostream& out, uint64_t nanoseconds) {
+    out << nanoseconds / 1000 << '.';
+    uint64_t fraction = nanoseconds % 1000;
+    out << static_cast<char>('0' + fraction / 100) << static_cast<char>('0' + fraction / 10 % 10)
+        << static_cast<char>('0' + fraction % 10);
+}
+
+}
+
+std::atomic<bool> Tracer::active{false};
+std::string Tracer::outputPath;
+std::mutex Tracer::registryMutex;
+std::vector<std::unique_ptr<TraceBuffer>> Tracer::buffers;
+
+TraceBuffer::TraceBuffer(uint32_t thread)
+    : thread(thread), events(new TraceEvent[Capacity]), written(0), sampledAllocations(0) {}
+
+void TraceBuffer::push(const TraceEvent& event) {
+    uint64_t index = written.load(std::memory_order_relaxed);
+    events[index & (Capacity - 1)] = event;
+    written.store(index + 1, std::memory_order_release);
+}
+
+void Tracer::start(const std::string& path) {
+    outputPath = path;
+    traceEpoch = std::chrono::steady_clock::now();
+    active.store(true, std::memory_order_relaxed);
+}
+
+uint64_t Tracer::now() {
+    auto elapsed = std::chrono::steady_clock::now() - traceEpoch;
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+}
+
+TraceBuffer& Tracer::threadBuffer() {
+    thread_local TraceBuffer* buffer = nullptr;
+    if (!buffer) {
+        std::lock_guard<std::mutex> lock(registryMutex);
+        buffers.push_back(std::make_unique<TraceBuffer>(static_cast<uint32_t>(buffers.size() + 1)));
+        buffer = buffers.back().get();
+    }
+    return *buffer;
+}
+
+void Tracer::span(std::string_view name, const char* category, uint64_t start) {
+    TraceEvent event;
+    size_t length = std::min(name.size(), TraceEvent::NameCapacity);
+    std::memcpy(event.name, name.data(), length);
+    event.name[length] = '\0';
+    event.category = category;
+    event.phase = 'X';
+    event.start = start;
+    event.duration = now() - start;
+    if (category == FunctionCategory || category == NativeCategory) {
+        threadBuffer().push(event);
+    } else {
+        threadBuffer().kept.push_back(event);
+    }
+}
+
+void Tracer::sampleAllocations(uint64_t total) {
+    TraceBuffer& buffer = threadBuffer();
+    if (total - buffer.sampledAllocations < AllocationBurst) return;
+    buffer.sampledAllocations = total;
+    
+    // Counters are tracked per name, so each thread's total gets its own
+    TraceEvent event;
+    if (buffer.thread == 1) {
+        std::strcpy(event.name, "allocations");
+    } else {
+        std::snprintf(event.name, sizeof(event.name), "allocations (worker %u)", buffer.thread);
+    }
+    event.category = "memory";
+    event.phase = 'C';
+    event.start = now();
+    event.duration = total;
+    buffer.kept.push_back(event);
+}
+
+bool Tracer::finish() {
+    if (!enabled()) return true;
+    active.store(false, std::memory_order_relaxed);
+    
+    std::ofstream out(outputPath);
+    if (!out.is_open()) return false;
+    
+    std::lock_guard<std::mutex> lock(registryMutex);
+    uint64_t dropped = 0;
+    bool first = true;
+    out << "{\"traceEvents\":[\n";
+    for (const auto& buffer : buffers) {
+        out << (first ? "" : ",\n") << "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":" << buffer->thread
+            << ",\"args\":{\"name\":\"" << (buffer->thread == 1 ? "main" : "worker") << "\"}}";
+        first = false;
+        
+        uint64_t written = buffer->written.load(std::memory_order_acquire);
+        uint64_t begin = written > TraceBuffer::Capacity ? written - TraceBuffer::Capacity : 0;
+        dropped += begin;
+        std::vector<const TraceEvent*> events;
+        events.reserve(buffer->kept.size() + (written - begin));
+        for (const auto& event : buffer->kept) {
+            events.push_back(&event);
+        }
+        for (uint64_t i = begin; i < written; i++) {
+            events.push_back(&buffer->events[i & (TraceBuffer::Capacity - 1)]);
+        }
+        
+        for (const TraceEvent* eventPointer : events) {
+            const TraceEvent& event = *eventPointer;
+            out << ",\n{\"ph\":\"" << event.phase << "\",\"name\":\"";
+            writeEscaped(out, event.name);
+            out << "\",\"cat\":\"" << event.category << "\",\"pid\":1,\"tid\":" << buffer->thread << ",\"ts\":";
+            writeMicros(out, event.start);
+            if (event.phase == 'X') {
+                out << ",\"dur\":";
+                writeMicros(out, event.duration);
+                out << "}";
+            } else {
+                out << ",\"args\":{\"total\":" << event.duration << "}}";
+            }
+        }
+    }
+    out << "\n],\"displayTimeUnit\":\"ns\",\"otherData\":{\"dropped_events\":" << dropped << "}}\n";
+    return static_cast<bool>(out);
+}
+
+TraceScope::~TraceScope() {
+    if (!Tracer::enabled()) return;
+    Tracer::span(name, category, start);
+    if (stats) Tracer::sampleAllocations(stats->allocations());
+}
@@ -0,0 +1,90 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+struct RuntimeStats;
+
+// One recorded event: a complete span ('X') or a counter sample ('C')
+struct TraceEvent {
+    static constexpr size_t NameCapacity = 47;
+    
+    char name[NameCapacity + 1];
+    const char* category;
+    char phase;
+    uint64_t start;     // ns since tracing started
+    uint64_t duration;  // ns for spans, the sampled value for counters
+};
+
+// Events written by a single thread. Calls go to a fixed-size ring, which
+// never locks or allocates and once full overwrites its oldest events; the
+// few phase spans and counter samples are kept in full.
+class TraceBuffer {
+public:
+    static constexpr size_t Capacity = 1 << 16;
+    
+    explicit TraceBuffer(uint32_t thread);
+    
+    void push(const TraceEvent& event);
+    
+    const uint32_t thread;
+    std::unique_ptr<TraceEvent[]> events;
+    std::atomic<uint64_t> written;
+    std::vector<TraceEvent> kept;
+    uint64_t sampledAllocations;  // allocation total at the last counter sample
+};
+
+// Records Chrome trace events (the JSON format chrome://tracing and Perfetto
+// load) for Flux and native calls, allocation bursts and the compile phases.
+// Each thread appends to its own TraceBuffer; the buffers are only read when
+// finish() writes the file, after the run.
+class Tracer {
+public:
+    static void start(const std::string& path);
+    // Writes the trace file; false if it couldn't be written
+    static bool finish();
+    
+    static bool enabled() { return active.load(std::memory_order_relaxed); }
+    static uint64_t now();
+    
+    static constexpr const char* FunctionCategory = "function";
+    static constexpr const char* NativeCategory = "native";
+    
+    static void span(std::string_view name, const char* category, uint64_t start);
+    // Samples the allocation total once it has grown by AllocationBurst
+    static void sampleAllocations(uint64_t total);
+    
+    static constexpr uint64_t AllocationBurst = 1024;
+    
+private:
+    static std::atomic<bool> active;
+    static std::string outputPath;
+    static std::mutex registryMutex;
+    static std::vector<std::unique_ptr<TraceBuffer>> buffers;
+    
+    static TraceBuffer& threadBuffer();
+};
+
+// Records the span from construction to destruction when tracing is on. The
+// name must outlive the scope. With stats, it also samples their allocation
+// total when the span ends.
+class TraceScope {
+public:
+    TraceScope(std::string_view name, const char* category, const RuntimeStats* stats = nullptr)
+        : name(name), category(category), stats(stats), start(Tracer::enabled() ? Tracer::now() : 0) {}
+    ~TraceScope();
+    
+    TraceScope(const TraceScope&) = delete;
+    TraceScope& operator=(const TraceScope&) = delete;
+    
+private:
+    std::string_view name;
+    const char* category;
+    const RuntimeStats* stats;
+    uint64_t start;
+};
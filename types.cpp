@@ -0,0 +1,373 @@
+#include "types.h"
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace {
+
+// Type of a local while the analysis runs: Unassigned until a store into it
+// has been typed
+enum class Inferred {
+    Unassigned,
+    Number,
+    Bool,
+    Any
+};
+
+Inferred join(Inferred a, Inferred b) {
+    if (a == Inferred::Unassigned) return b;
+    if (b == Inferred::Unassigned) return a;
+    return a == b ? a : Inferred::Any;
+}
+
+StaticType staticType(Inferred type) {
+    switch (type) {
+        case Inferred::Number: return StaticType::Number;
+        case Inferred::Bool: return StaticType::Bool;
+        default: return StaticType::Any;
+    }
+}
+
+bool isArithmetic(BinaryOp op) {
+    switch (op) {
+        case BinaryOp::Add:
+        case BinaryOp::Subtract:
+        case BinaryOp::Multiply:
+        case BinaryOp::Divide:
+        case BinaryOp::Modulo:
+            return true;
+        default:
+            return false;
+    }
+}
+
+bool isComparison(BinaryOp op) {
+    switch (op) {
+        case BinaryOp::Less:
+        case BinaryOp::LessEqual:
+        case BinaryOp::Greater:
+        case BinaryOp::GreaterEqual:
+        case BinaryOp::Equal:
+        case BinaryOp::NotEqual:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// A parameter or local of the function being analyzed
+struct Local {
+    std::string name;
+    bool unboxable;  // a `let` in a frame slot; anything else can hold any value
+    Inferred type;
+    std::vector<Expression*> stores;  // nullptr for a `let` without initializer
+    std::vector<VarDeclaration*> declarations;
+    std::vector<IdentifierExpression*> references;
+};
+
+// Finds the locals of one framed function, the values stored into them and
+// the identifiers referring to them, scope by scope as the Resolver does.
+// Nested functions are left to their own analysis; the locals they reference
+// are cells, which stay boxed.
+class LocalCollector : public RecursiveVisitor {
+public:
+    std::vector<Local> locals;
+    
+    explicit LocalCollector(FunctionDeclaration& function) {
+        scopes.emplace_back();
+        for (const auto& param : function.parameters) {
+            declare(param, false);
+        }
+        for (auto& stmt : function.body->statements) {
+            stmt->accept(*this);
+        }
+    }
+    
+    void visit(IdentifierExpression& node) override {
+        int local = lookup(node.name);
+        if (local >= 0) locals[local].references.push_back(&node);
+    }
+    
+    void visit(BinaryExpression& node) override {
+        RecursiveVisitor::visit(node);
+        if (node.op != BinaryOp::Assign) return;
+        auto target = dynamic_cast<IdentifierExpression*>(node.left.get());
+        int local = target ? lookup(target->name) : -1;
+        if (local >= 0) locals[local].stores.push_back(node.right.get());
+    }
+    
+    void visit(VarDeclaration& node) override {
+        RecursiveVisitor::visit(node);
+        int local = declare(node.name, node.slot >= 0);
+        locals[local].declarations.push_back(&node);
+        locals[local].stores.push_back(node.initializer.get());
+    }
+    
+    void visit(BlockStatement& node) override {
+        scopes.emplace_back();
+        RecursiveVisitor::visit(node);
+        scopes.pop_back();
+    }
+    
+    void visit(ForStatement& node) override {
+        scopes.emplace_back();
+        RecursiveVisitor::visit(node);
+        scopes.pop_back();
+    }
+    
+    void visit(ForInStatement& node) override {
+        node.iterable->accept(*this);
+        scopes.emplace_back();
+        declare(node.variable, false);
+        node.body->accept(*this);
+        scopes.pop_back();
+    }
+    
+    void visit(FunctionDeclaration& node) override {
+        declare(node.name, false);
+    }
+    
+private:
+    std::vector<std::unordered_map<std::string, int>> scopes;
+    
+    // A redeclaration in the same scope reuses the first binding
+    int declare(const std::string& name, bool unboxable) {
+        auto existing = scopes.back().find(name);
+        if (existing != scopes.back().end()) return existing->second;
+        
+        locals.push_back(Local{name, unboxable, Inferred::Unassigned, {}, {}, {}});
+        return scopes.back()[name] = static_cast<int>(locals.size()) - 1;
+    }
+    
+    int lookup(const std::string& name) const {
+        for (auto it = scopes.rbegin(); it != scopes.rend(); ++it) {
+            auto found = it->find(name);
+            if (found != it->end()) return found->second;
+        }
+        return -1;
+    }
+};
+
+// Types expressions bottom-up from the current types of the locals. With
+// annotate set it also records each result, and how to compute it unboxed,
+// on the node.
+class ExpressionTyper {
+public:
+    bool annotate = false;
+    
+    explicit ExpressionTyper(const std::vector<Local>& locals) : locals(locals) {
+        for (size_t i = 0; i < locals.size(); i++) {
+            for (auto reference : locals[i].references) {
+                references[reference] = i;
+            }
+        }
+    }
+    
+    Inferred type(Expression* expr) {
+        Inferred result = compute(expr);
+        if (annotate) expr->type = staticType(result);
+        return result;
+    }
+    
+private:
+    const std::vector<Local>& locals;
+    std::unordered_map<const IdentifierExpression*, size_t> references;
+    
+    void setForm(Expression* expr, UnboxedForm form) {
+        if (annotate) expr->form = form;
+    }
+    
+    Inferred compute(Expression* expr) {
+        if (auto literal = dynamic_cast<LiteralExpression*>(expr)) {
+            if (std::holds_alternative<double>(literal->value)) {
+                setForm(expr, UnboxedForm::Constant);
+                return Inferred::Number;
+            }
+            return std::holds_alternative<bool>(literal->value) ? Inferred::Bool : Inferred::Any;
+        }
+        
+        if (auto identifier = dynamic_cast<IdentifierExpression*>(expr)) {
+            auto found = references.find(identifier);
+            if (found == references.end() || !locals[found->second].unboxable) return Inferred::Any;
+            Inferred result = locals[found->second].type;
+            if (result == Inferred::Number || result == Inferred::Bool) setForm(expr, UnboxedForm::Local);
+            return result;
+        }
+        
+        if (auto binary = dynamic_cast<BinaryExpression*>(expr)) {
+            Inferred left = type(binary->left.get());
+            Inferred right = type(binary->right.get());
+            if (binary->op == BinaryOp::Assign) return right;
+            
+            bool numbers = left == Inferred::Number && right == Inferred::Number;
+            if (isComparison(binary->op)) {
+                if (numbers) setForm(expr, UnboxedForm::Compare);
+                return Inferred::Bool;
+            }
+            if (!isArithmetic(binary->op)) return Inferred::Any;
+            
+            if (numbers) setForm(expr, UnboxedForm::Arithmetic);
+            // Every operator but + throws unless it gets two numbers; + also
+            // joins strings, so it's a number only when both operands are
+            if (binary->op != BinaryOp::Add || numbers) return Inferred::Number;
+            bool mayBeNumbers = (left == Inferred::Number || left == Inferred::Unassigned) &&
+                                (right == Inferred::Number || right == Inferred::Unassigned);
+            return mayBeNumbers ? Inferred::Unassigned : Inferred::Any;
+        }
+        
+        // `and` and `or` return one of their operands
+        if (auto logical = dynamic_cast<LogicalExpression*>(expr)) {
+            Inferred left = type(logical->left.get());
+            return join(left, type(logical->right.get()));
+        }
+        
+        if (auto unary = dynamic_cast<UnaryExpression*>(expr)) {
+            Inferred operand = type(unary->operand.get());
+            if (unary->operator_ == "-") {
+                if (operand == Inferred::Number) setForm(expr, UnboxedForm::Negate);
+                return Inferred::Number;
+            }
+            return unary->operator_ == "not" || unary->operator_ == "!" ? Inferred::Bool : Inferred::Any;
+        }
+        
+        if (auto call = dynamic_cast<CallExpression*>(expr)) {
+            type(call->callee.get());
+            for (auto& arg : call->arguments) {
+                type(arg.get());
+            }
+        } else if (auto array = dynamic_cast<ArrayExpression*>(expr)) {
+            for (auto& element : array->elements) {
+                type(element.get());
+            }
+        } else if (auto index = dynamic_cast<IndexExpression*>(expr)) {
+            type(index->object.get());
+            type(index->index.get());
+        }
+        return Inferred::Any;
+    }
+};
+
+// Annotates every expression of one function body, but not of the functions
+// nested in it
+class Annotator : public RecursiveVisitor {
+public:
+    explicit Annotator(ExpressionTyper& typer) : typer(typer) {}
+    
+    void visit(LiteralExpression& node) override { typer.type(&node); }
+    void visit(IdentifierExpression& node) override { typer.type(&node); }
+    void visit(BinaryExpression& node) override { typer.type(&node); }
+    void visit(LogicalExpression& node) override { typer.type(&node); }
+    void visit(UnaryExpression& node) override { typer.type(&node); }
+    void visit(CallExpression& node) override { typer.type(&node); }
+    void visit(ArrayExpression& node) override { typer.type(&node); }
+    void visit(IndexExpression& node) override { typer.type(&node); }
+    void visit(FunctionDeclaration&) override {}
+    
+private:
+    ExpressionTyper& typer;
+};
+
+void inferLocals(FunctionDeclaration& function) {
+    LocalCollector collector(function);
+    std::vector<Local>& locals = collector.locals;
+    ExpressionTyper typer(locals);
+    
+    // Types only ever widen, so this ends after a few rounds. A local still
+    // unassigned once nothing changes is only stored values computed from
+    // itself, and is given up on.
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (auto& local : locals) {
+            if (!local.unboxable) continue;
+            Inferred type = local.type;
+            for (Expression* store : local.stores) {
+                type = join(type, store ? typer.type(store) : Inferred::Any);
+            }
+            if (type != local.type) {
+                local.type = type;
+                changed = true;
+            }
+        }
+        if (changed) continue;
+        for (auto& local : locals) {
+            if (local.unboxable && local.type == Inferred::Unassigned) {
+                local.type = Inferred::Any;
+                changed = true;
+            }
+        }
+    }
+    
+    function.numberCount = 0;
+    function.localTypes.clear();
+    for (auto& local : locals) {
+        StaticType type = local.unboxable ? staticType(local.type) : StaticType::Any;
+        function.localTypes.emplace_back(local.name, type);
+        if (type == StaticType::Any) continue;
+        
+        int slot = function.numberCount++;
+        for (auto declaration : local.declarations) {
+            declaration->slot = -1;
+            declaration->numberSlot = slot;
+        }
+        for (auto reference : local.references) {
+            reference->slot = -1;
+            reference->numberSlot = slot;
+        }
+    }
+    
+    typer.annotate = true;
+    Annotator annotator(typer);
+    for (auto& stmt : function.body->statements) {
+        stmt->accept(annotator);
+    }
+}
+
+class FunctionLister : public RecursiveVisitor {
+public:
+    std::vector<FunctionDeclaration*> functions;
+    
+    void visit(FunctionDeclaration& node) override {
+        if (node.body) functions.push_back(&node);
+        RecursiveVisitor::visit(node);
+    }
+};
+
+}
+
+void TypeAnalyzer::analyze(Program& program) {
+    program.accept(*this);
+}
+
+void TypeAnalyzer::analyzeFunction(FunctionDeclaration& function) {
+    function.accept(*this);
+}
+
+void TypeAnalyzer::visit(FunctionDeclaration& node) {
+    if (!node.body) return;  // lazy body, analyzed once parsed
+    if (node.framed) inferLocals(node);
+    RecursiveVisitor::visit(node);
+}
+
+void dumpTypes(Program& program, std::ostream& out) {
+    FunctionLister lister;
+    program.accept(lister);
+    
+    for (auto function : lister.functions) {
+        out << function->name << "(";
+        for (size_t i = 0; i < function->parameters.size(); i++) {
+            out << (i > 0 ? ", " : "") << function->parameters[i];
+        }
+        out << "):";
+        
+        if (!function->framed) {
+            out << " generator, not analyzed\n";
+            continue;
+        }
+        for (size_t i = 0; i < function->localTypes.size(); i++) {
+            const auto& local = function->localTypes[i];
+            out << (i > 0 ? ", " : " ") << local.first << " " << staticTypeName(local.second);
+        }
+        out << "\n";
+    }
+}
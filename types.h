@@ -0,0 +1,27 @@
+#pragma once
+#include "ast.h"
+#include <ostream>
+
+// Flow-based type inference over the locals of framed functions, run after
+// the Resolver and before the PeepholeOptimizer.
+//
+// A local starts out with no type and takes the join of the types of every
+// value stored into it, iterated until nothing changes: `let i = 0` and
+// `i = i + 1` leave i a number, `let found = false` and `found = x > 3` a
+// bool. Such locals move out of their frame slot into an unboxed slot that
+// holds a raw double, and each expression records how to compute it without
+// boxing: arithmetic and comparisons over proven numbers run with no type
+// checks. Parameters, captured locals, `for x in` variables and globals can
+// hold anything and stay boxed.
+class TypeAnalyzer : public RecursiveVisitor {
+public:
+    void analyze(Program& program);
+    // Analyzes one top-level function, e.g. a lazily parsed one
+    void analyzeFunction(FunctionDeclaration& function);
+    
+    void visit(FunctionDeclaration& node) override;
+};
+
+// Writes the inferred type of every parameter and local, one line per
+// function, e.g. `loop(n): n any, acc number, i number`
+void dumpTypes(Program& program, std::ostream& out);